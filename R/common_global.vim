@@ -19,7 +19,7 @@ g:did_vimr_global_stuff = 1
 
 if !exists('g:rplugin')
     # Attention: also in functions.vim because either of them might be sourced first.
-    g:rplugin = {'debug_info': {}, 'libs_in_nrs': [], 'nrs_running': 0, 'myport': 0, 'R_pid': 0, 'rscript_name': ''}
+    g:rplugin = {'debug_info': {}, 'libs_in_nrs': [], 'nrs_running': 0, 'myport': 0, 'mysocket': '', 'R_pid': 0, 'rscript_name': ''}
 endif
 
 g:rplugin.debug_info['Time'] = {'common_global.vim': reltime()}
@@ -882,6 +882,10 @@ g:R_objbr_h           = get(g:, "R_objbr_h",           10)
 g:R_objbr_opendf      = get(g:, "R_objbr_opendf",       1)
 g:R_objbr_openlist    = get(g:, "R_objbr_openlist",     0)
 g:R_objbr_allnames    = get(g:, "R_objbr_allnames",     0)
+g:R_objbr_stream      = get(g:, "R_objbr_stream",       0)
+g:R_objbr_interval    = get(g:, "R_objbr_interval",   100)
+g:R_shared_memory     = get(g:, "R_shared_memory",      1)
+g:R_remote_compress   = get(g:, "R_remote_compress",    1)
 g:R_never_unmake_menu = get(g:, "R_never_unmake_menu",  0)
 g:R_insert_mode_cmds  = get(g:, "R_insert_mode_cmds",   0)
 g:R_disable_cmds      = get(g:, "R_disable_cmds",    [''])
@@ -932,6 +936,7 @@ endif
 
 g:R_objbr_place      = get(g:, "R_objbr_place",    "script,right")
 g:R_source_args      = get(g:, "R_source_args",                "")
+g:R_source_direct    = get(g:, "R_source_direct",               0)
 g:R_user_maps_only   = get(g:, "R_user_maps_only",              0)
 g:R_latexcmd         = get(g:, "R_latexcmd",          ["default"])
 g:R_texerr           = get(g:, "R_texerr",                      1)
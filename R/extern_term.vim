@@ -64,6 +64,7 @@ def g:StartR_ExternalTerm(rcmd: string)
                 ' VIMR_ID=' .. shellescape($VIMR_ID) ..
                 ' VIMR_SECRET=' .. shellescape($VIMR_SECRET) ..
                 ' VIMR_PORT=' .. g:rplugin.myport ..
+                ' VIMR_SOCKET=' .. shellescape(g:rplugin.mysocket) ..
                 ' R_DEFAULT_PACKAGES=' .. shellescape($R_DEFAULT_PACKAGES)
 
     envrcmd ..= ' ' .. rcmd
@@ -7,18 +7,16 @@ syn keyword rGlobEnvFun ThisIsADummyGlobEnvFunKeyword
 hi def link rGlobEnvFun Function
 
 # On re-source: refresh highlights for loaded libraries, then stop.
-# g:SourceRFunList was defined (in functions_def.vim) on first source.
+# g:SourceRFunList and g:SourceAllRFunLists were defined (in functions_def.vim) on first source.
 if exists('*g:SourceRFunList')
-    for lib in g:rplugin.libs_in_nrs
-        g:SourceRFunList(lib)
-    endfor
+    g:SourceAllRFunLists()
     finish
 endif
 
 # First-time initialisation
 if !exists('g:rplugin')
     # Also in common_global.vim because either file might be sourced first.
-    g:rplugin = {debug_info: {}, libs_in_nrs: [], nrs_running: 0, myport: 0, R_pid: 0}
+    g:rplugin = {debug_info: {}, libs_in_nrs: [], nrs_running: 0, myport: 0, mysocket: '', R_pid: 0}
 endif
 
 if !has_key(g:rplugin, 'compldir')
@@ -42,6 +42,23 @@ def g:SourceRFunList(lib: string)
     endif
 enddef
 
+# Highlight the functions of all libraries listed in libs_in_nrs. vimrserver
+# also writes all of them in a single file that is sourced when possible.
+def g:SourceAllRFunLists()
+    var fnm = get(g:rplugin, 'localtmpdir', '') .. '/fun_all_' .. $VIMR_ID
+    if g:R_hi_fun == 0 || get(g:, 'R_hi_fun_paren', 0) != 0 || !filereadable(fnm)
+        for lib in g:rplugin.libs_in_nrs
+            g:SourceRFunList(lib)
+        endfor
+        return
+    endif
+
+    if has_key(g:rplugin, 'localfun')
+        g:UpdateLocalFunctions(g:rplugin.localfun)
+    endif
+    execute 'source ' .. substitute(fnm, ' ', '\\ ', 'g')
+enddef
+
 def g:FunHiOtherBf()
     if &diff || g:R_hi_fun == 0
         return
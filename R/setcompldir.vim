@@ -66,7 +66,7 @@ if need_readme
     delete(g:rplugin.compldir .. "/pack_descriptions")
     delete(g:rplugin.compldir .. "/path_to_vimcom")
 
-    ['fun_*', 'omnils_*', 'args_*']
+    ['fun_*', 'omnils_*', 'args_*', 'obstate_*']
         ->mapnew((_, p) => glob(g:rplugin.compldir .. '/' .. p, false, true))
         ->flattennew()
         ->mapnew((_, f) => delete(f))
@@ -77,6 +77,8 @@ if need_readme
         'The omnils_ and args_ are used for omni completion, the fun_ files for ',
         'syntax highlighting, and the inst_libs for library description in the ',
         'Object Browser. If you delete them, they will be regenerated.',
+        'The obstate_ files keep which lists were open in the Object Browser,',
+        'one file for each working directory.',
         '',
         'When you load a new version of a library, their files are replaced.',
         '',
@@ -84,7 +86,7 @@ if need_readme
         'You should manually delete them if you want to save disk space.',
         '',
         'If you delete this README file, all omnils_, args_ and fun_ files will be ',
-        'regenerated.',
+        'regenerated, and the obstate_ files will be deleted.',
         '',
         'All lines in the omnils_ files have 7 fields with information on the object',
         'separated by the byte \006:',
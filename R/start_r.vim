@@ -10,7 +10,8 @@ if exists('*g:SanitizeRLine')
     for fn in ['IsSendCmdToRFake', 'SendCmdToR_NotYet', 'RSetMyPort',
             'StartR', 'ReallyStartR', 'SignalToR',
             'VimcomStartTimeout', 'WaitVimcomStart', 'SetVimcomInfo',
-            'SetSendCmdToR', 'OnVimcomDisconnect', 'RQuit',
+            'SetSendCmdToR', 'OnVimcomDisconnect', 'OnVimcomReconnect',
+            'RQuit',
             'RStudioQuitTimeout', 'OnRStudioQuitComplete',
             'RRestart', 'QuitROnClose',
             'ClearRInfo', 'SendToVimcom', 'UpdateLocalFunctions',
@@ -99,11 +100,14 @@ def g:SendCmdToR_NotYet(...args: list<any>): number
     return 0
 enddef
 
-# This function is called by vimrserver when its server binds to a specific port.
+# This function is called by vimrserver when its server binds to a specific
+# port or, for local R sessions, to a Unix domain socket (then p is '0').
 var waiting_to_start_r = ''
-def g:RSetMyPort(p: string)
+def g:RSetMyPort(p: string, sock = '')
     g:rplugin.myport = str2nr(p)
+    g:rplugin.mysocket = sock
     $VIMR_PORT = p
+    $VIMR_SOCKET = sock
     if waiting_to_start_r != ''
         g:StartR(waiting_to_start_r)
         waiting_to_start_r = ''
@@ -119,7 +123,7 @@ enddef
 def g:ReallyStartR(whatr: string)
     wait_vimcom = 1
 
-    if g:rplugin.myport == 0
+    if g:rplugin.myport == 0 && g:rplugin.mysocket == ''
         if g:IsJobRunning("Server") == 0
             g:RWarningMsg("Cannot start R: vimrserver not running")
             return
@@ -130,6 +134,7 @@ def g:ReallyStartR(whatr: string)
         endif
         waiting_to_start_r = whatr
         g:JobStdin(g:rplugin.jobs["Server"], "1\n") # Start the TCP server
+        g:UpdateNoRLibList()
         return
     endif
 
@@ -204,6 +209,11 @@ def g:ReallyStartR(whatr: string)
     else
         start_options += ['options(vimcom.vimpager = TRUE)']
     endif
+    if g:R_remote_compress
+        start_options += ['options(vimcom.compress = TRUE)']
+    else
+        start_options += ['options(vimcom.compress = FALSE)']
+    endif
     if type(g:R_external_term) == v:t_number && g:R_external_term == 0 && g:R_esc_term
         start_options += ['options(editor = vimcom:::vim.edit)']
     endif
@@ -436,6 +446,15 @@ def g:OnVimcomDisconnect()
     g:RWarningMsg("Connection to R lost")
 enddef
 
+# Called by vimrserver when the same R session connects again.
+def g:OnVimcomReconnect()
+    if string(g:SendCmdToR) == "function('g:SendCmdToR_fake')"
+        return
+    endif
+    g:rplugin.vimcom_connected = 1
+    echomsg "Connection to R restored"
+enddef
+
 # Quit R
 def g:RQuit(how: string)
     var qcmd: string
@@ -1299,9 +1318,28 @@ def g:RSourceLines(...args: list<any>): number
         lines = map(copy(lines), (_, v) => substitute(v, "^(\\`\\`)\\?", "", ""))
     endif
 
+    # vimcom can receive the code itself if no line has the characters that
+    # delimit the message and its lines. Big blocks are streamed in parts, but
+    # vimrserver keeps the order of the messages to vimcom, and the code is
+    # still run before any code sent after it.
+    var direct = match(lines, "[\x02\x14\r\n]") < 0
+
     if len(args) == 3 && args[2] == "NewtabInsert"
-        writefile(lines, Rsource_write)
-        g:SendToVimcom("E", 'vimcom:::vim_capture_source_output("' .. Rsource_read .. '", "NewtabInsert")')
+        if direct
+            g:SendToVimcom("S", 'vimcom:::vim_capture_source_output(nm = "NewtabInsert")' .. "\x02" .. join(lines, "\x14"))
+        else
+            writefile(lines, Rsource_write)
+            g:SendToVimcom("E", 'vimcom:::vim_capture_source_output("' .. Rsource_read .. '", "NewtabInsert")')
+        endif
+        return 1
+    endif
+
+    if direct && g:R_source_direct && !has("win32") && !rdebugging
+                && g:R_source_args != "bracketed paste"
+                && !(len(args) == 3 && args[2] == "PythonCode")
+                && g:IsJobRunning("Server")
+        var sargs = substitute(g:GetSourceArgs(args[1]), '^, ', '', '')
+        g:SendToVimcom("S", 'vimcom:::VimR.source.exprs(' .. sargs .. ')' .. "\x02" .. join(lines, "\x14"))
         return 1
     endif
 
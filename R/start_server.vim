@@ -67,6 +67,7 @@ var RoutLine = ''
 var RBout: list<string> = []
 var RBerr: list<string> = []
 var RWarn: list<string> = []
+var LastBuildLibs = ''
 
 def g:RInitStdout(...args: list<any>)
     var rcmd = substitute(args[1], '[\r\n]', '', 'g')
@@ -157,6 +158,7 @@ def g:RInitExit(...args: list<any>)
     RBout = []
     g:AddForDeletion(g:rplugin.tmpdir .. "/bo_code.R")
     g:AddForDeletion(g:rplugin.localtmpdir .. "/libs_in_nrs_" .. $VIMR_ID)
+    g:AddForDeletion(g:rplugin.localtmpdir .. "/fun_all_" .. $VIMR_ID)
     g:AddForDeletion(g:rplugin.tmpdir .. "/libnames_" .. $VIMR_ID)
     if len(RWarn) > 0
         g:rplugin.debug_info['RInit Warning'] = ''
@@ -194,6 +196,7 @@ def g:StartNServer()
     if g:IsJobRunning("Server")
         return
     endif
+    LastBuildLibs = ''
 
     var nrs_path: string
     if exists("g:R_local_R_library_dir")
@@ -243,6 +246,13 @@ def g:StartNServer()
     if g:R_objbr_allnames
         $VIMR_OBJBR_ALLNAMES = "TRUE"
     endif
+    if g:R_objbr_stream
+        $VIMR_OBJBR_STREAM = "TRUE"
+    endif
+    $VIMR_OBJBR_INTERVAL = string(g:R_objbr_interval)
+    if g:R_shared_memory
+        $VIMR_SHM = "TRUE"
+    endif
     $VIMR_RPATH = g:rplugin.Rcmd
 
     $VIMR_LOCAL_TMPDIR = g:rplugin.localtmpdir
@@ -260,15 +270,15 @@ def g:StartNServer()
     unlet $VIMR_OPENDF
     unlet $VIMR_OPENLS
     unlet $VIMR_OBJBR_ALLNAMES
+    unlet $VIMR_OBJBR_STREAM
+    unlet $VIMR_OBJBR_INTERVAL
+    unlet $VIMR_SHM
     unlet $VIMR_RPATH
     unlet $VIMR_LOCAL_TMPDIR
 enddef
 
-def g:ListRLibsFromBuffer(): string
-    if !exists("g:R_start_libs")
-        g:R_start_libs = "base,stats,graphics,grDevices,utils,methods"
-    endif
-
+# Names of the libraries loaded by library() and require() in the buffer
+def BufferRLibs(): list<string>
     var lines = getline(1, "$")
     filter(lines, (_, v) => v =~ '^\s*\(library\|require\)\s*(')
     map(lines, (_, v) => substitute(v, '\s*).*', '', ''))
@@ -276,6 +286,15 @@ def g:ListRLibsFromBuffer(): string
     map(lines, (_, v) => substitute(v, '\s*\(library\|require\)\s*(\s*', '', ''))
     map(lines, (_, v) => substitute(v, "['" .. '"]', '', 'g'))
     map(lines, (_, v) => substitute(v, '\\', '', 'g'))
+    return lines
+enddef
+
+def g:ListRLibsFromBuffer(): string
+    if !exists("g:R_start_libs")
+        g:R_start_libs = "base,stats,graphics,grDevices,utils,methods"
+    endif
+
+    var lines = BufferRLibs()
     var libs = ""
     if len(g:R_start_libs) > 4
         libs = '"' .. substitute(g:R_start_libs, ",", '", "', "g") .. '"'
@@ -289,6 +308,21 @@ def g:ListRLibsFromBuffer(): string
     return libs
 enddef
 
+# Tell vimrserver which libraries the buffer loads to get their omnils_ files
+# built before the ones of libraries loaded only as dependencies.
+def g:UpdateNoRLibList()
+    if !g:IsJobRunning("Server")
+        return
+    endif
+    var slibs = substitute(get(g:, 'R_start_libs', 'base,stats,graphics,grDevices,utils,methods'), '\s', '', 'g')
+    var blibs = slibs .. "\x02" .. join(BufferRLibs(), ',')
+    if blibs == LastBuildLibs
+        return
+    endif
+    LastBuildLibs = blibs
+    g:JobStdin(g:rplugin.jobs["Server"], "44" .. blibs .. "\n")
+enddef
+
 # Get information from vimrserver (currently only the names of loaded libraries).
 def g:RequestNCSInfo()
     if g:IsJobRunning("Server")
@@ -320,43 +354,6 @@ def g:ShowBuildOmnilsError(stt: string)
     endif
 enddef
 
-def g:BAAExit(...args: list<any>)
-    if (args[1] == 0 || args[1] == 512) && g:IsJobRunning("Server")
-        g:JobStdin(g:rplugin.jobs["Server"], "41\n")
-    endif
-enddef
-
-def BuildAllArgs(_t: number = 0)
-    if filereadable(g:rplugin.compldir .. '/args_lock')
-        timer_start(5000, (t) => BuildAllArgs(t))
-        return
-    endif
-
-    var flist = glob(g:rplugin.compldir .. '/omnils_*', false, true)
-    map(flist, (_, v) => substitute(v, "/omnils_", "/args_", ""))
-    var rscrpt = ['library("vimcom", warn.conflicts = FALSE)']
-    for afile in flist
-        if filereadable(afile) == 0
-            var pkg = substitute(substitute(afile, ".*/args_", "", ""), "_.*", "", "")
-            rscrpt += ['vimcom:::vim.buildargs("' .. afile .. '", "' .. pkg .. '")']
-        endif
-    endfor
-    if len(rscrpt) == 1
-        return
-    endif
-    writefile([""], g:rplugin.compldir .. '/args_lock')
-    rscrpt += ['unlink("' .. g:rplugin.compldir .. '/args_lock")']
-
-    var scrptnm = g:rplugin.tmpdir .. "/build_args.R"
-    g:AddForDeletion(scrptnm)
-    writefile(rscrpt, scrptnm)
-    if exists("g:R_remote_compldir")
-        scrptnm = g:R_remote_compldir .. "/tmp/build_args.R"
-    endif
-    var jobh = {'exit_cb': 'g:BAAExit'}
-    g:rplugin.jobs["Build_args"] = g:StartJob([g:rplugin.Rcmd, "--quiet", "--no-save", "--no-restore", "--slave", "-f", scrptnm], jobh)
-enddef
-
 # This function is called for the first time before R is running because we
 # support syntax highlighting and omni completion of default libraries' objects.
 def g:UpdateSynRhlist()
@@ -372,8 +369,6 @@ def g:UpdateSynRhlist()
         # R/functions.vim will not be sourced if r_syntax_fun_pattern = 1
         g:FunHiOtherBf()
     endif
-    # Building args_ files is too time consuming. Do it asynchronously.
-    timer_start(1, (t) => BuildAllArgs(t))
 enddef
 
 # Filter words to :Rhelp
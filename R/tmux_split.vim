@@ -28,6 +28,7 @@ def g:StartR_ExternalTerm(rcmd: string)
                 'set-environment VIMR_ID ' .. $VIMR_ID,
                 'set-environment VIMR_SECRET ' .. $VIMR_SECRET,
                 'set-environment VIMR_PORT ' .. g:rplugin.myport,
+                'set-environment VIMR_SOCKET "' .. g:rplugin.mysocket .. '"',
                 'set-environment R_DEFAULT_PACKAGES ' .. $R_DEFAULT_PACKAGES]
     if $R_LIBS_USER != ""
         extend(tmuxconf, ['set-environment R_LIBS_USER ' .. $R_LIBS_USER])
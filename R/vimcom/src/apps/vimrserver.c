@@ -1,3 +1,9 @@
+#ifdef WIN32
+#if !defined(_WIN32_WINNT) || _WIN32_WINNT < 0x0600
+#undef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600 // WSAPoll() and GetTickCount64()
+#endif
+#endif
 #include <ctype.h>     // Character type functions
 #include <dirent.h>    // Directory entry
 #include <signal.h>    // Signal handling
@@ -47,15 +53,34 @@ static void ForceForegroundWindow(HWND hwnd) {
 #else
 #define PRI_SIZET PRIu32
 #endif
+#define IOV_LEN(v) ((v).len)
+#define IOV_SKIP(v, n) ((v).buf += (n), (v).len -= (ULONG)(n))
 #else
+#include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <netinet/tcp.h> // TCP_NODELAY
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdint.h>
+#include <sys/mman.h> // mmap()
 #include <sys/socket.h>
+#include <sys/uio.h> // struct iovec
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 #define PRI_SIZET "zu"
+#define IOV_LEN(v) ((v).iov_len)
+#define IOV_SKIP(v, n)                                                         \
+    ((v).iov_base = (char *)(v).iov_base + (n), (v).iov_len -= (n))
+#ifdef __linux__
+#include <sys/epoll.h>
+#define USE_EPOLL
+#endif
+#endif
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
 #endif
 
 static char strL[8];       // String for last element prefix in tree view
@@ -64,6 +89,8 @@ static int OpenDF;         // Flag for open data frames in tree view
 static int OpenLS;         // Flag for open lists in tree view
 static int vimcom_is_utf8; // Flag for UTF-8 encoding
 static int allnames; // Flag for showing all names, including starting with '.'
+static int ob_stream; // Flag for sending the Object Browser lines through
+                      // stdout instead of the globenv_ and liblist_ files
 
 static char compl_cb[64];      // Completion callback buffer
 static char compl_info[64];    // Completion info buffer
@@ -75,20 +102,37 @@ static char globenv[576];      // Global environment buffer
 static int auto_obbr;          // Auto object browser flag
 static size_t glbnv_buffer_sz; // Global environment buffer size
 static char *glbnv_buffer;     // Global environment buffer
+static unsigned glb_gen;       // Generation of the list of objects in
+                               // glbnv_buffer (0: not sent as a delta)
+static unsigned glbnv_ver;     // Changed whenever glbnv_buffer is rebuilt
+static unsigned lib_gen;       // Generation of the list of libraries
+static char r_session[64];     // Session of the R whose lists we have. If it
+                               // connects again, it sends only what changed.
 static char *compl_buffer;     // Completion buffer
-static char *finalbuffer;      // Final buffer for message processing
 static unsigned long compl_buffer_size = 32768; // Completion buffer size
-static unsigned long fb_size = 1024;            // Final buffer size
 static int n_omnils_build;                      // number of omni lists to build
 static int building_omnils;                     // Flag for building Omni lists
 static int more_to_build;                       // Flag for more lists to build
-static int has_args_to_read;                    // Flag for args to read
+static int build_tier = -1; // Priority of the packages being built (-1: idle)
+static char *start_libs;    // ",lib1,lib2," from R_start_libs
+static char *buffer_libs;   // ",lib1,lib2," from library() calls in the buffer
+static unsigned ob_gen;     // Changed when objects or their status change
+static int ob_interval = 100; // Minimum time between automatic Object
+                              // Browser updates (ms)
+static int ob_pending;        // Views waiting for an automatic update
+#define OB_PEND_G 1           // .GlobalEnv
+#define OB_PEND_L 2           // Libraries
 
 void omni2ob(void);                 // Convert Omni completion to Object Browser
 void lib2ob(void);                  // Convert Library to object browser
+static void ob_refresh(int what);   // Coalesced omni2ob() and lib2ob()
+static const char *ob_fields(const char *p, const char **f); // Split a line
 void update_inst_libs(void);        // Update installed libraries
 void update_pkg_list(char *libnms); // Update package list
 void update_glblenv_buffer(char *g); // Update global environment buffer
+static int apply_glbenv_delta(char *d); // Patch the global environment buffer
+static void args_answer(char *b);        // Answer to args_request()
+void send_to_vimcom(char *msg);          // Send a message to vimcom
 static void build_omnils(void);      // Build Omni lists
 static void finish_bol();            // Finish building of lists
 void complete(const char *id, char *base, char *funcnm,
@@ -107,6 +151,7 @@ typedef struct instlibs_ {
     char *name;             // Library name
     char *title;            // Library title
     char *descr;            // Library description
+    char *version;          // Library version (NULL if read from inst_libs)
     int si;                 // still installed flag
     struct instlibs_ *next; // Next installed library
 } InstLibs;
@@ -115,14 +160,28 @@ InstLibs *instlibs; // Pointer to first installed library
 
 // Is a list or library open or closed in the Object Browser?
 typedef struct liststatus_ {
-    char *key; // Name of the object or library. Library names are prefixed with
-               // "package:"
-    int status;                // 0: closed; 1: open
-    struct liststatus_ *left;  // Left node
-    struct liststatus_ *right; // Right node
+    char *key; // Name of the object or library. Library names are suffixed
+               // with ":"
+    int status;               // 0: closed; 1: open
+    unsigned gen;             // Value of ls_gen when status was last updated
+    unsigned pkg;             // Id of the package in whose view the list is
+                              // (0: none; LS_SHARED: more than one)
+    int seen;                 // Was the object seen in this session?
+    struct liststatus_ *next; // Next entry in the same bucket
 } ListStatus;
 
-static ListStatus *listTree = NULL; // Root node of the list status tree
+#define LS_SHARED ((unsigned)-1)
+
+static ListStatus **lsTable; // Hash table of list status
+static size_t lsSize;        // Number of buckets (power of 2)
+static size_t lsCount;       // Number of entries
+static unsigned ls_gen;      // Incremented when all lists are opened or closed
+static int ls_all;           // Status of all lists after the last change_all()
+static char lsfile[1024];    // File where the list status is saved
+static unsigned ls_pkg;      // Id of the package being rendered (0: none)
+
+// Priorities for building omnils_ files
+enum { BP_DEP, BP_NORMAL, BP_HIGH };
 
 // Store information from an R library
 typedef struct pkg_data_ {
@@ -134,8 +193,19 @@ typedef struct pkg_data_ {
     char *args;    // a copy of the args_ file
     int nobjs;     // number of objects in the omnils_
     int loaded;    // Loaded flag in libnames_
-    int to_build;  // Flag to indicate if the name is sent to build list
+    int to_build;  // 0: waiting; 1: sent to build list; 2: being built
     int built;     // Flag to indicate if omnils_ found
+    int priority;  // Build priority (BP_DEP, BP_NORMAL or BP_HIGH)
+    unsigned id;   // Unique identifier (a new version is a new package)
+    char *ob_b;    // Lines of the package in the Libraries view
+    size_t ob_len; // Length of ob_b
+    size_t ob_sz;  // Allocated size of ob_b
+    int ob_nlines; // Number of lines in ob_b
+    struct obentry_ *ob_e; // Objects in ob_b, with rows relative to ob_b
+    int ob_ne;             // Number of objects in ob_b
+    int ob_esz;            // Allocated number of objects
+    unsigned ob_lsgen;     // Value of ls_gen when ob_b was rendered
+    int ob_valid;          // Flag: ob_b has the current state of the lists
     struct pkg_data_ *next; // Pointer to next package data
 } PkgData;
 
@@ -144,7 +214,10 @@ static int nLibObjs; // Number of library objects
 
 int nGlbEnvFun; // Number of global environment functions
 
-static int r_conn;          // R connection status flag
+static int r_conn;          // Primary vimcom connection status flag
+static int primary = -1;    // Client that receives the messages from Vim and
+                            // whose workspace is in the Object Browser
+static int reply_to = -1;   // Client whose message is being parsed
 static char VimSecret[128]; // Secret for communication with Vim
 static int VimSecretLen;    // Length of Vim secret
 
@@ -153,13 +226,16 @@ static int Tid;                       // Thread ID
 static CRITICAL_SECTION stdout_mutex; // Mutex for stdout writes
 static CRITICAL_SECTION state_mutex;  // Mutex for shared state
                                       // (compl_buffer, glbnv_buffer,
-                                      // pkgList, connfd, r_conn)
+                                      // pkgList, r_conn)
+static CRITICAL_SECTION conn_mutex;   // Mutex for the vimcom clients
 #else
 static pthread_t Tid; // Thread ID
 static pthread_mutex_t stdout_mutex =
     PTHREAD_MUTEX_INITIALIZER; // Mutex for stdout writes
 static pthread_mutex_t state_mutex =
     PTHREAD_MUTEX_INITIALIZER; // Mutex for shared state
+static pthread_mutex_t conn_mutex =
+    PTHREAD_MUTEX_INITIALIZER; // Mutex for the vimcom clients
 #endif
 
 static void lock_stdout(void) {
@@ -193,9 +269,26 @@ static void unlock_state(void) {
     pthread_mutex_unlock(&state_mutex);
 #endif
 }
+
+// conn_mutex may be acquired while holding state_mutex, never the reverse
+static void lock_conn(void) {
+#ifdef WIN32
+    EnterCriticalSection(&conn_mutex);
+#else
+    pthread_mutex_lock(&conn_mutex);
+#endif
+}
+
+static void unlock_conn(void) {
+#ifdef WIN32
+    LeaveCriticalSection(&conn_mutex);
+#else
+    pthread_mutex_unlock(&conn_mutex);
+#endif
+}
 struct sockaddr_in servaddr; // Server address structure
-static int sockfd;           // socket file descriptor
-static int connfd;           // Connection file descriptor
+static int sockfd;           // Listening socket file descriptor
+static char sockpath[128];   // Path of the Unix domain socket (empty: TCP)
 
 #define Debug_NRS_
 __attribute__((format(printf, 1, 2))) static void
@@ -248,8 +341,7 @@ static int ascii_ic_cmp(const char *a,
 static char *grow_buffer(char **b, unsigned long *sz,
                          unsigned long inc) // Function to grow a buffer
 {
-    Log("grow_buffer(%lu, %lu) [%lu, %lu]", *sz, inc, compl_buffer_size,
-        fb_size);
+    Log("grow_buffer(%lu, %lu) [%lu]", *sz, inc, compl_buffer_size);
     unsigned long new_sz = *sz + inc;
     char *tmp = calloc(new_sz, sizeof(char));
     if (!tmp) {
@@ -297,17 +389,27 @@ int str_here(const char *o,
     return 1;
 }
 
+static void remove_socket_file(void) // Remove the Unix domain socket
+{
+    if (sockpath[0])
+        unlink(sockpath);
+}
+
 static void
 HandleSigTerm(__attribute__((unused)) int s) // Signal handler for SIGTERM
 {
+    remove_socket_file();
     _exit(0);
 }
 
 static void RegisterPort(int bindportn) // Function to register port number to R
 {
-    // Register the port:
+    // Register the port (and the socket path, if not using TCP):
     lock_stdout();
-    printf("g:RSetMyPort('%d')\n", bindportn);
+    if (sockpath[0])
+        printf("g:RSetMyPort('%d', '%s')\n", bindportn, sockpath);
+    else
+        printf("g:RSetMyPort('%d')\n", bindportn);
     fflush(stdout);
     unlock_stdout();
 }
@@ -319,22 +421,42 @@ static void ParseMsg(char *b) // Parse the message from R
 
     if (*b == '+') {
         b++;
+        // Other R sessions must not replace the primary one's objects
+        if ((*b == 'G' || *b == 'D' || *b == 'L') && reply_to != primary) {
+            unlock_state();
+            return;
+        }
         switch (*b) {
         case 'G':
             b++;
             update_glblenv_buffer(b);
             if (auto_obbr) // Update the Object Browser after sending the
-                           // message to vim-rr to
-                omni2ob(); // avoid unnecessary delays in omni completion
+                           // message to vim-rr to avoid unnecessary
+                           // delays in omni completion
+                ob_refresh(OB_PEND_G);
+            break;
+        case 'D': // Changes in the list of objects
+            b++;
+            if (!apply_glbenv_delta(b)) {
+                char msg[64];
+                snprintf(msg, sizeof(msg), "F%s", getenv("VIMR_ID"));
+                send_to_vimcom(msg);
+                break;
+            }
+            if (auto_obbr)
+                ob_refresh(OB_PEND_G);
             break;
-        case 'L':
+        case 'L': // "<gen> <libraries>"
             b++;
+            lib_gen = (unsigned)strtoul(b, &b, 10);
+            if (*b == ' ')
+                b++;
             update_pkg_list(b);
             unlock_state(); // Release before blocking R process
             build_omnils(); // Manages its own locking internally
             lock_state();   // Re-acquire for lib2ob
             if (auto_obbr)
-                lib2ob();
+                ob_refresh(OB_PEND_L);
             break;
         case 'A': // strtok doesn't work here because "base" might be empty.
             b++;
@@ -365,6 +487,35 @@ static void ParseMsg(char *b) // Parse the message from R
             *b = 0;
             complete(id, base, fnm, args);
             break;
+        case 'R': // Answer to a request
+            args_answer(b + 1);
+            break;
+        case 'H': // First message of a connection: "<session>"
+            b++;
+            char msg[96];
+            int resumed = 0;
+            if (reply_to == primary) {
+                if (r_session[0] && strcmp(b, r_session) == 0) {
+                    resumed = 1;
+                } else {
+                    // Another R: its lists must be sent whole
+                    snprintf(r_session, sizeof(r_session), "%s", b);
+                    glb_gen = 0;
+                    lib_gen = 0;
+                }
+                snprintf(msg, sizeof(msg), "H%s%u %u", getenv("VIMR_ID"),
+                         lib_gen, glb_gen);
+            } else {
+                snprintf(msg, sizeof(msg), "H%s0 0", getenv("VIMR_ID"));
+            }
+            send_to_vimcom(msg);
+            if (resumed) {
+                lock_stdout();
+                printf("g:OnVimcomReconnect()\n");
+                fflush(stdout);
+                unlock_stdout();
+            }
+            break;
         }
         unlock_state();
         return;
@@ -378,28 +529,124 @@ static void ParseMsg(char *b) // Parse the message from R
     unlock_state();
 }
 
-// Adapted from
-// https://www.geeksforgeeks.org/socket-programming-in-cc-handling-multiple-clients-on-server-without-multi-threading/
-static void init_listening() // Initialise listening for incoming connections
+// vimcom clients connected to the server. A single thread multiplexes the
+// listening socket and all the connections (epoll on Linux, poll()
+// elsewhere), keeping the partially received message of each client.
+#define MAX_CLIENTS 16
+#define LISTEN_SLOT MAX_CLIENTS // Event tag of the listening socket
+
+typedef struct client_ {
+    int fd;           // Socket (-1: free slot)
+    unsigned id;      // Order of connection
+    char *rb;         // Bytes received and not parsed yet are in
+    size_t rstart;    // rb[rstart..rend). Each message is VimSecret, the size
+    size_t rend;      // of the body in 9 digits, the body and a \x11 byte.
+    size_t rsz;       // Allocated size of rb
+    char *ring;       // Ring buffer shared with a local vimcom (NULL: none)
+    unsigned nout;    // Messages waiting in the queue of stream_thread()
+    size_t ring_size; // Size of the ring after its header
+} Client;
+
+#define RB_CHUNK 65536 // Initial size of the receive buffers
+
+#ifndef WIN32
+// Local vimcom clients write big messages to a ring buffer mapped from a file
+// in the tmpdir and send only "+S<position> <length>" through the socket. The
+// layout must match the one in vimcom.c.
+#define RING_HDR 4096
+typedef struct ring_hdr {
+    char magic[8];           // "vimcomR1"
+    unsigned long long size; // Size of the ring after the header
+    unsigned long long tail; // Position up to which the ring was read
+} RingHdr;
+
+static int use_ring; // $VIMR_SHM: map the ring buffers of vimcom clients
+#endif
+
+static Client clients[MAX_CLIENTS];
+static int nclients;      // Number of connected clients
+static unsigned conn_id;  // Number of connections accepted
+#ifdef USE_EPOLL
+static int epfd; // epoll instance
+#endif
+
+static void close_socket(int fd) {
+#ifdef WIN32
+    closesocket(fd);
+#else
+    close(fd);
+#endif
+}
+
+static int set_nonblocking(int fd) {
+#ifdef WIN32
+    u_long on = 1;
+    return ioctlsocket(fd, FIONBIO, &on) == 0 ? 0 : -1;
+#else
+    int fl = fcntl(fd, F_GETFL, 0);
+    return fl == -1 ? -1 : fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+#endif
+}
+
+static int would_block(void) // Did the last socket call fail temporarily?
 {
-    Log("init_listening()");
 #ifdef WIN32
-    int len;
+    int e = WSAGetLastError();
+    return e == WSAEWOULDBLOCK || e == WSAEINTR;
 #else
-    socklen_t len;
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
 #endif
-    struct sockaddr_in cli;
-    int res = 1;
-    int port = 10101;
+}
 
+static int wait_socket(int fd, short events, int ms) {
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = events;
+    pfd.revents = 0;
 #ifdef WIN32
-    WSADATA d;
-    int wr = WSAStartup(MAKEWORD(2, 2), &d);
-    if (wr != 0) {
-        fprintf(stderr, "WSAStartup failed: %d\n", wr);
-        fflush(stderr);
+    return WSAPoll(&pfd, 1, ms);
+#else
+    return poll(&pfd, 1, ms);
+#endif
+}
+
+#ifndef WIN32
+// Listen on a Unix domain socket in the local tmpdir, which is only
+// accessible by the user. Return 0 if R is remote (it shares the tmpdir with
+// vimrserver only when local) or on failure: TCP is used then.
+static int init_unix_socket() {
+    struct sockaddr_un su;
+
+    if (!localtmpdir[0] || strcmp(tmpdir, localtmpdir) != 0 ||
+        getenv("VIMR_IP_ADDRESS"))
+        return 0;
+    bzero(&su, sizeof(su));
+    su.sun_family = AF_UNIX;
+    if (snprintf(su.sun_path, sizeof(su.sun_path), "%s/nrs_%s.sock",
+                 localtmpdir, getenv("VIMR_ID")) >= (int)sizeof(su.sun_path) ||
+        strchr(su.sun_path, '\'')) // The path is quoted in RSetMyPort()
+        return 0;
+
+    sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd == -1)
+        return 0;
+    unlink(su.sun_path); // Left by a vimrserver that did not finish cleanly
+    if (bind(sockfd, (struct sockaddr *)&su, sizeof(su)) != 0) {
+        close(sockfd);
+        return 0;
     }
+    chmod(su.sun_path, 0600);
+    strcpy(sockpath, su.sun_path);
+    Log("init_unix_socket: %s", sockpath);
+    return 1;
+}
 #endif
+
+// Listen on the first free TCP port. Return the port number.
+static int init_tcp_socket() {
+    int res = 1;
+    int port = 10101;
+
     sockfd = socket(AF_INET, SOCK_STREAM, 0);
 
     if (sockfd == -1) {
@@ -426,187 +673,753 @@ static void init_listening() // Initialise listening for incoming connections
             break;
         port++;
     }
-    if (res == 0) {
-        RegisterPort(port);
-        Log("init_listening: RegisterPort");
-    } else {
+    if (res != 0) {
         fprintf(stderr, "Failed to bind to port %d\n", port);
         fflush(stderr);
         exit(2);
     }
+    return port;
+}
+
+// Adapted from
+// https://www.geeksforgeeks.org/socket-programming-in-cc-handling-multiple-clients-on-server-without-multi-threading/
+static void init_listening() // Initialise listening for incoming connections
+{
+    Log("init_listening()");
+    int port = 0;
+
+#ifdef WIN32
+    WSADATA d;
+    int wr = WSAStartup(MAKEWORD(2, 2), &d);
+    if (wr != 0) {
+        fprintf(stderr, "WSAStartup failed: %d\n", wr);
+        fflush(stderr);
+    }
+#endif
+    for (int i = 0; i < MAX_CLIENTS; i++)
+        clients[i].fd = -1;
+
+#ifndef WIN32
+    if (!init_unix_socket())
+#endif
+        port = init_tcp_socket();
 
     // Now server is ready to listen and verification
-    if ((listen(sockfd, 5)) != 0) {
+    if ((listen(sockfd, 5)) != 0 || set_nonblocking(sockfd) != 0) {
         fprintf(stderr, "Listen failed...\n");
         fflush(stderr);
         exit(3);
     }
-    Log("init_listening: Listen succeeded");
 
-    len = sizeof(cli);
-
-    // Accept the data packet from client and verification
-    connfd = accept(sockfd, (struct sockaddr *)&cli, &len);
-    if (connfd < 0) {
-        fprintf(stderr, "server accept failed...\n");
+#ifdef USE_EPOLL
+    struct epoll_event ev;
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    ev.events = EPOLLIN;
+    ev.data.u32 = LISTEN_SLOT;
+    if (epfd == -1 || epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev) != 0) {
+        fprintf(stderr, "epoll setup failed...\n");
         fflush(stderr);
-        exit(4);
+        exit(3);
     }
-    lock_state();
-    r_conn = 1;
-    unlock_state();
-    Log("init_listening: accept succeeded");
+#endif
+    Log("init_listening: Listen succeeded");
+
+    // R is started as soon as Vim knows where to connect
+    RegisterPort(port);
 }
 
-/**
- * @brief Read exactly n bytes from a socket, looping on partial reads.
- * @return n on success, 0 on clean close, -1 on error.
- */
-static int recv_exact_vrs(int fd, char *buf, int n) {
-    int total = 0;
-    while (total < n) {
-        int r = recv(fd, buf + total, n - total, 0);
-        if (r <= 0)
-            return r;
-        total += r;
+static void accept_clients() // Accept all pending connections
+{
+#ifdef WIN32
+    int len;
+#else
+    socklen_t len;
+#endif
+    struct sockaddr_storage cli;
+    int fd, i;
+
+    for (;;) {
+        len = sizeof(cli);
+        fd = accept(sockfd, (struct sockaddr *)&cli, &len);
+        if (fd < 0) {
+            if (!would_block()) {
+                fprintf(stderr, "server accept failed...\n");
+                fflush(stderr);
+            }
+            return;
+        }
+        for (i = 0; i < MAX_CLIENTS; i++)
+            if (clients[i].fd == -1)
+                break;
+        if (i == MAX_CLIENTS || set_nonblocking(fd) != 0) {
+            fprintf(stderr, "Too many vimcom connections\n");
+            fflush(stderr);
+            close_socket(fd);
+            continue;
+        }
+        if (!sockpath[0]) {
+            // Messages are small and answered at once: don't wait for ACKs
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const char *)&one,
+                       sizeof(one));
+        }
+#ifdef USE_EPOLL
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u32 = (uint32_t)i;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            close_socket(fd);
+            continue;
+        }
+#endif
+        lock_conn();
+        clients[i].fd = fd;
+        clients[i].id = ++conn_id;
+        clients[i].rstart = 0;
+        clients[i].rend = 0;
+        clients[i].nout = 0;
+        nclients++;
+        // The first R to connect (or the first after the previous one was
+        // lost) is the one started by vim-rr
+        if (primary == -1)
+            primary = i;
+        unlock_conn();
+        lock_state();
+        r_conn = 1;
+        unlock_state();
+        Log("accept_clients: client %u in slot %d", clients[i].id, i);
     }
-    return total;
 }
 
-static void get_whole_msg(char *b) // Get the whole message from the socket
+static void drop_client(int i) // Close the connection with a client
 {
-    Log("get_whole_msg()");
-    char *p;
-    unsigned long msg_size;
+    int was_primary;
+
+    Log("drop_client: client %u in slot %d", clients[i].id, i);
+    lock_conn();
+    close_socket(clients[i].fd); // Also removes it from epoll
+    clients[i].fd = -1;
+    free(clients[i].rb);
+    clients[i].rb = NULL;
+    clients[i].rsz = 0;
+#ifndef WIN32
+    if (clients[i].ring)
+        munmap(clients[i].ring, RING_HDR + clients[i].ring_size);
+#endif
+    clients[i].ring = NULL;
+    nclients--;
+    was_primary = i == primary;
+    if (was_primary)
+        primary = -1;
+    unlock_conn();
+
+    if (was_primary) {
+        lock_state();
+        r_conn = 0; // The lists are kept in case the same R connects again
+        unlock_state();
+        // Notify Vim that vimcom TCP connection was lost.
+        lock_stdout();
+        printf("g:OnVimcomDisconnect()\n");
+        fflush(stdout);
+        unlock_stdout();
+    }
+}
+
+// Check the header of the message at the start of the client's buffer and
+// get the size of its body. Return 0 if the header is invalid.
+static int parse_header(Client *c, unsigned long *msg_size) {
+    const char *h = c->rb + c->rstart;
+    char digits[10];
+    char *endptr;
 
-    if (strstr(b, VimSecret) != b) {
+    if (memcmp(h, VimSecret, VimSecretLen) != 0) {
         fprintf(stderr, "Rejected message: authentication failed\n");
         fflush(stderr);
-        return;
+        return 0;
     }
-    p = b + VimSecretLen;
 
     // Get the message size using strtoul for validation
-    p[9] = 0;
-    char *endptr;
-    msg_size = strtoul(p, &endptr, 10);
-    if (endptr == p || msg_size == 0 || msg_size > 100000000UL) {
-        fprintf(stderr, "Invalid TCP message size: %s\n", p);
+    memcpy(digits, h + VimSecretLen, 9);
+    digits[9] = 0;
+    *msg_size = strtoul(digits, &endptr, 10);
+    if (endptr == digits || *msg_size == 0 || *msg_size > 100000000UL) {
+        fprintf(stderr, "Invalid TCP message size: %s\n", digits);
         fflush(stderr);
-        return;
+        return 0;
     }
+    return 1;
+}
 
-    // Allocate enough memory to the final buffer
-    if (finalbuffer) {
-        memset(finalbuffer, 0, fb_size);
-        if (msg_size + 1 > fb_size)
-            finalbuffer = grow_buffer(&finalbuffer, &fb_size,
-                                      msg_size + 1 - fb_size + 1024);
-    } else {
-        if (msg_size + 1 > fb_size)
-            fb_size = msg_size + 1024;
-        finalbuffer = calloc(fb_size, sizeof(char));
-        if (!finalbuffer) {
-            fprintf(stderr, "get_whole_msg: calloc failed\n");
+// Make room in the client's buffer for a message of need bytes, moving the
+// bytes not parsed yet to its beginning. Return 0 if out of memory.
+static int rb_reserve(Client *c, size_t need) {
+    size_t len = c->rend - c->rstart;
+
+    if (c->rstart > 0 && (c->rend == c->rsz || c->rstart + need > c->rsz)) {
+        memmove(c->rb, c->rb + c->rstart, len);
+        c->rstart = 0;
+        c->rend = len;
+    }
+    if (need > c->rsz || c->rend == c->rsz) {
+        size_t nsz = c->rsz ? c->rsz : RB_CHUNK;
+        while (nsz < need || nsz <= c->rend)
+            nsz *= 2;
+        char *tmp = realloc(c->rb, nsz);
+        if (!tmp) {
+            fprintf(stderr, "rb_reserve: realloc failed (%" PRI_SIZET
+                            " bytes)\n", nsz);
             fflush(stderr);
-            return;
+            return 0;
+        }
+        c->rb = tmp;
+        c->rsz = nsz;
+    }
+    return 1;
+}
+
+// Decompress the data compressed by lz_compress() in vimcom.c. Return 0 if
+// the data is invalid or does not fill exactly size bytes.
+static int lz_decompress(const char *in, size_t n, char *out, size_t size) {
+    const unsigned char *ip = (const unsigned char *)in;
+    const unsigned char *end = ip + n;
+    unsigned char *op = (unsigned char *)out;
+    unsigned char *oend = op + size;
+    unsigned b;
+
+    while (ip < end) {
+        unsigned t = *ip++;
+        size_t lit = t >> 4;
+        if (lit == 15) {
+            do {
+                if (ip >= end)
+                    return 0;
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > (size_t)(end - ip) || lit > (size_t)(oend - op))
+            return 0;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == end) // The last sequence has only literals
+            break;
+
+        if (end - ip < 2)
+            return 0;
+        size_t off = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t mlen = t & 15;
+        if (mlen == 15) {
+            do {
+                if (ip >= end)
+                    return 0;
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
         }
+        mlen += 4;
+        if (off == 0 || off > (size_t)(op - (unsigned char *)out) ||
+            mlen > (size_t)(oend - op))
+            return 0;
+        const unsigned char *ref = op - off;
+        while (mlen--) // The match may overlap the bytes being written
+            *op++ = *ref++;
+    }
+    return op == oend;
+}
+
+// Parse a message compressed by a remote vimcom: "<size> <data>"
+static void lz_parse(char *b, size_t n) {
+    char *p;
+    unsigned long size = strtoul(b, &p, 10);
+    if (*p != ' ' || size == 0 || size > 100000000UL) {
+        fprintf(stderr, "Invalid compressed message\n");
+        fflush(stderr);
+        return;
+    }
+    p++;
+    char *m = malloc(size + 1);
+    if (!m) {
+        fprintf(stderr, "lz_parse: malloc failed (%lu bytes)\n", size);
+        fflush(stderr);
+        return;
+    }
+    if (lz_decompress(p, n - (p - b), m, size)) {
+        m[size] = 0;
+        Log("TCP in [%lu bytes compressed to %" PRI_SIZET "]", size,
+            n - (p - b));
+        ParseMsg(m);
+    } else {
+        fprintf(stderr, "Corrupted compressed message\n");
+        fflush(stderr);
+    }
+    free(m);
+}
+
+#ifndef WIN32
+// Map the ring buffer created by vimcom: "<size> <path>"
+static void ring_attach(Client *c, char *b) {
+    char *path;
+    unsigned long long size = strtoull(b, &path, 10);
+    size_t tl = strlen(localtmpdir);
+    struct stat st;
+
+    if (*path != ' ')
+        return;
+    path++;
+    // The file must be in our tmpdir, which only the user can access
+    if (!tl || strncmp(path, localtmpdir, tl) != 0 || path[tl] != '/' ||
+        strchr(path + tl + 1, '/'))
+        return;
+
+    int fd = open(path, O_RDWR);
+    unlink(path); // Both processes have it open or mapped
+    if (fd == -1)
+        return;
+    char *r = MAP_FAILED;
+    if (use_ring && !c->ring && size > 0 && size <= 1073741824ULL &&
+        fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_uid == getuid() &&
+        (unsigned long long)st.st_size == RING_HDR + size)
+        r = mmap(NULL, RING_HDR + size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                 fd, 0);
+    close(fd);
+    if (r == MAP_FAILED)
+        return;
+    RingHdr *h = (RingHdr *)r;
+    if (memcmp(h->magic, "vimcomR1", 8) != 0 || h->size != size) {
+        munmap(r, RING_HDR + size);
+        return;
     }
+    c->ring = r;
+    c->ring_size = size;
+    Log("ring_attach: client %u, %llu bytes", c->id, size);
+    send_to_vimcom("M");
+}
+
+// Parse a message written to the ring buffer: "<position> <length>"
+static void ring_read(Client *c, char *b) {
+    char *p;
+    unsigned long long pos = strtoull(b, &p, 10);
+    unsigned long long len = *p == ' ' ? strtoull(p + 1, NULL, 10) : 0;
+    RingHdr *h = (RingHdr *)c->ring;
 
-    // Bulk read exactly msg_size bytes
-    if (recv_exact_vrs(connfd, finalbuffer, (int)msg_size) <= 0) {
-        fprintf(stderr, "Failed to recv message body (%lu bytes)\n", msg_size);
+    if (!h || len == 0 || pos < h->tail ||
+        pos % c->ring_size + len + 1 > c->ring_size) {
+        fprintf(stderr, "Invalid ring message: %s\n", b);
         fflush(stderr);
-        finalbuffer[0] = 0;
         return;
     }
-    finalbuffer[msg_size] = 0;
+    char *m = c->ring + RING_HDR + pos % c->ring_size;
+    if (m[len] == 0)
+        ParseMsg(m);
+    // vimcom can now reuse the space
+    __atomic_store_n(&h->tail, pos + len + 1, __ATOMIC_RELEASE);
+}
+#endif
+
+// Read what is available from a client in large chunks, parsing each message
+// in place as soon as it is complete. Return 0 if the connection must be
+// closed.
+static int read_client(int i) {
+    Client *c = &clients[i];
+    size_t hdrlen = VimSecretLen + 9;
+    size_t need = hdrlen; // Bytes of the next message needed to parse it
+    unsigned long msg_size;
+    int r;
+
+    for (;;) {
+        while (c->rend - c->rstart >= hdrlen) {
+            if (!parse_header(c, &msg_size))
+                return 0;
+            need = hdrlen + msg_size + 1;
+            if (c->rend - c->rstart < need)
+                break;
+            char *body = c->rb + c->rstart + hdrlen;
+            if (body[msg_size] != '\x11') {
+                fprintf(stderr, "Missing end of TCP message\n");
+                fflush(stderr);
+                return 0;
+            }
+            body[msg_size] = 0;
+            c->rstart += need;
+            need = hdrlen;
+            Log("TCP in [%lu bytes]", msg_size);
+            reply_to = i;
+            if (body[0] == '+' && body[1] == 'Z')
+                lz_parse(body + 2, msg_size - 2);
+#ifndef WIN32
+            else if (body[0] == '+' && body[1] == 'M')
+                ring_attach(c, body + 2);
+            else if (body[0] == '+' && body[1] == 'S')
+                ring_read(c, body + 2);
+            else
+#endif
+                ParseMsg(body);
+            reply_to = -1;
+        }
+        if (c->rstart == c->rend) {
+            c->rstart = c->rend = 0;
+            if (c->rsz > 16 * RB_CHUNK) { // Don't keep a huge idle buffer
+                free(c->rb);
+                c->rb = NULL;
+                c->rsz = 0;
+            }
+        }
+
+        if (!rb_reserve(c, need))
+            return 0;
+        r = recv(c->fd, c->rb + c->rend, c->rsz - c->rend, 0);
+        if (r == 0)
+            return 0;
+        if (r < 0)
+            return would_block();
+        c->rend += r;
+    }
+}
 
-    // Consume trailing \x11 byte
-    char trail;
-    recv(connfd, &trail, 1, 0);
+#ifdef WIN32
+static DWORD ev_tid; // Id of the thread running event_loop()
+#endif
 
-    ParseMsg(finalbuffer);
+static int on_event_thread() {
+#ifdef WIN32
+    return GetCurrentThreadId() == ev_tid;
+#else
+    return pthread_equal(pthread_self(), Tid);
+#endif
 }
 
 #ifdef WIN32
 static void
-receive_msg(void *arg) // Thread function to receive messages on Windows
+event_loop(void *arg) // Thread function to receive messages on Windows
 #else
-static void *receive_msg() // Thread function to receive messages on Unix
+static void *event_loop() // Thread function to receive messages on Unix
 #endif
 {
-    size_t blen = VimSecretLen + 9;
-    char b[256];
-    size_t rlen;
+#ifdef USE_EPOLL
+    struct epoll_event evs[MAX_CLIENTS + 1];
+#else
+    struct pollfd pfd[MAX_CLIENTS + 1];
+    int slot[MAX_CLIENTS + 1];
+#endif
+    int n;
 
+#ifdef WIN32
+    ev_tid = GetCurrentThreadId();
+#endif
     for (;;) {
-        bzero(b, blen);
-        rlen = recv(connfd, b, blen, 0);
-        if (rlen == blen) {
-            Log("TCP in [%" PRI_SIZET " bytes] (message header): %s", blen, b);
-            get_whole_msg(b);
-        } else {
-            lock_state();
-            r_conn = 0;
+#ifdef USE_EPOLL
+        n = epoll_wait(epfd, evs, MAX_CLIENTS + 1, -1);
+        for (int k = 0; k < n; k++) {
+            int i = (int)evs[k].data.u32;
+            if (i == LISTEN_SLOT)
+                accept_clients();
+            else if (clients[i].fd != -1 && !read_client(i))
+                drop_client(i);
+        }
+#else
+        n = 0;
+        pfd[n].fd = sockfd;
+        pfd[n].events = POLLIN;
+        slot[n++] = LISTEN_SLOT;
+        for (int i = 0; i < MAX_CLIENTS; i++)
+            if (clients[i].fd != -1) {
+                pfd[n].fd = clients[i].fd;
+                pfd[n].events = POLLIN;
+                slot[n++] = i;
+            }
 #ifdef WIN32
-            closesocket(connfd);
-            closesocket(sockfd);
-            WSACleanup();
+        if (WSAPoll(pfd, n, -1) < 0)
+            continue;
 #else
-            close(connfd);
-            close(sockfd);
+        if (poll(pfd, n, -1) < 0)
+            continue;
 #endif
-            connfd = -1;
-            unlock_state();
-            // Notify Vim that vimcom TCP connection was lost.
-            lock_stdout();
-            printf("g:OnVimcomDisconnect()\n");
-            fflush(stdout);
-            unlock_stdout();
-            if (rlen != -1 && rlen != 0) {
-                fprintf(stderr, "TCP socket -1: restarting...\n");
-                fprintf(stderr,
-                        "Wrong TCP data length: %" PRI_SIZET " x %" PRI_SIZET
-                        "\n",
-                        blen, rlen);
-                fflush(stderr);
-                break;
-            }
-            init_listening();
+        for (int k = 0; k < n; k++) {
+            int i = slot[k];
+            if (!(pfd[k].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            if (i == LISTEN_SLOT)
+                accept_clients();
+            else if (clients[i].fd != -1 && !read_client(i))
+                drop_client(i);
         }
+#endif
     }
 #ifndef WIN32
     return NULL;
 #endif
 }
 
-void send_to_vimcom(
-    char *msg) // Function to send messages to R (vimcom package)
-{
-    Log("TCP out: %s", msg);
-    lock_state();
-    if (connfd >= 0) {
-        size_t len = strlen(msg);
-        char header[9];
-        snprintf(header, sizeof(header), "%08X", (unsigned int)len);
-        if (send(connfd, header, 8, 0) != 8) {
-            fprintf(stderr, "Failed to send header to vimcom.\n");
+// Write as much of the header and the body of a message as the socket takes
+// without waiting, with a single gather write (two small writes would be
+// delayed by Nagle's algorithm). The number of bytes written is saved in
+// done. Return -1 if the connection failed.
+static int send_frame(int fd, const char *h, size_t hlen, const char *b,
+                      size_t blen, size_t *done) {
+#ifdef WIN32
+    WSABUF v[2];
+    v[0].buf = (char *)h;
+    v[0].len = (ULONG)hlen;
+    v[1].buf = (char *)b;
+    v[1].len = (ULONG)blen;
+#else
+    struct iovec v[2];
+    struct msghdr m;
+    v[0].iov_base = (void *)h;
+    v[0].iov_len = hlen;
+    v[1].iov_base = (void *)b;
+    v[1].iov_len = blen;
+    memset(&m, 0, sizeof(m));
+#endif
+    int k = 0;
+    *done = 0;
+    while (k < 2 && IOV_LEN(v[k]) == 0)
+        k++;
+    while (k < 2) {
+        size_t r;
+#ifdef WIN32
+        DWORD sent;
+        if (WSASend(fd, v + k, 2 - k, &sent, 0, NULL, NULL) != 0) {
+#else
+        m.msg_iov = v + k;
+        m.msg_iovlen = 2 - k;
+        ssize_t sent = sendmsg(fd, &m, MSG_NOSIGNAL);
+        if (sent < 0) {
+#endif
+            return would_block() ? 0 : -1;
+        }
+        r = (size_t)sent;
+        *done += r;
+        while (k < 2 && r >= IOV_LEN(v[k])) {
+            r -= IOV_LEN(v[k]);
+            k++;
+        }
+        if (k < 2)
+            IOV_SKIP(v[k], r);
+    }
+    return 0;
+}
+
+// Stop using a connection that failed in the middle of a message, because
+// vimcom would read the rest of the stream out of sync. The event loop drops
+// the client and vimcom connects again. Must be called under conn_mutex.
+static void shutdown_client(int i) {
+    fprintf(stderr, "Failed write to vimcom.\n");
+    fflush(stderr);
+#ifdef WIN32
+    shutdown(clients[i].fd, SD_BOTH);
+#else
+    shutdown(clients[i].fd, SHUT_RDWR);
+#endif
+}
+
+// Messages to vimcom bigger than MSG_CHUNK are sent in parts by
+// stream_thread(): "P<VIMR_ID><number of the message> " followed by the bytes
+// of the part ("Q..." for the last part). A part is written only when the
+// socket can take it. vimcom must get the messages in the order they were
+// sent, so the messages for a client with a big message in the queue go to
+// the queue too, and are sent whole after it, as well as the rest of a
+// message that the socket could not take at once.
+#define MSG_CHUNK 16384
+#define MSG_MAX 67108864 // Maximum size of a message to vimcom
+
+typedef struct out_stream_ {
+    struct out_stream_ *next;
+    int slot;     // Client the message is for
+    unsigned cid; // Its order of connection (the slot may be reused)
+    unsigned id;  // Number of the message
+    size_t len;   // Size of the message
+    size_t sent;  // Bytes already sent
+    size_t fsent; // Bytes of the current part (with its header) already sent
+    int whole;    // Send the message as it is (not in parts)?
+    char data[];
+} OutStream;
+
+static OutStream *os_head, *os_tail; // Messages being sent (under conn_mutex)
+static unsigned os_count;            // Number of streamed messages
+static int os_thread_on;             // Is stream_thread() running?
+#ifdef WIN32
+static CONDITION_VARIABLE os_cond; // Signaled when a message is queued
+#else
+static pthread_cond_t os_cond = PTHREAD_COND_INITIALIZER;
+#endif
+
+static void os_pop(void) {
+    OutStream *s = os_head;
+    Client *c = &clients[s->slot];
+    if (c->id == s->cid && c->nout > 0)
+        c->nout--;
+    os_head = s->next;
+    if (!os_head)
+        os_tail = NULL;
+    free(s);
+}
+
+// Thread sending the parts of the big messages. It holds conn_mutex except
+// while waiting for a message or for the socket, and writes only what the
+// socket takes, going back to wait for the rest of a part.
+#ifdef WIN32
+static void stream_thread(void *arg)
+#else
+static void *stream_thread(void *arg)
+#endif
+{
+    (void)arg;
+    char *part = malloc(MSG_CHUNK + 72);
+    lock_conn();
+    for (;;) {
+        while (!os_head) {
+#ifdef WIN32
+            SleepConditionVariableCS(&os_cond, &conn_mutex, INFINITE);
+#else
+            pthread_cond_wait(&os_cond, &conn_mutex);
+#endif
+        }
+        OutStream *s = os_head;
+        Client *c = &clients[s->slot];
+        if (!part || c->fd == -1 || c->id != s->cid) {
+            os_pop(); // vimcom is gone
+            continue;
+        }
+
+        // Don't block the other messages while vimcom is not reading
+        int fd = c->fd;
+        unlock_conn();
+        wait_socket(fd, POLLOUT, 200);
+        lock_conn();
+        if (c->fd != fd || c->id != s->cid)
+            continue;
+
+        size_t n = s->len - s->sent;
+        if (n > MSG_CHUNK)
+            n = MSG_CHUNK;
+        int last = s->sent + n == s->len;
+        int h = 0;
+        if (s->whole) {
+            memcpy(part + 8, s->data, n);
+        } else {
+            h = snprintf(part + 8, 64, "%c%s%u ", last ? 'Q' : 'P',
+                         getenv("VIMR_ID"), s->id);
+            memcpy(part + 8 + h, s->data + s->sent, n);
+        }
+        char header[9];
+        snprintf(header, sizeof(header), "%08X", (unsigned int)(h + n));
+        memcpy(part, header, 8);
+        size_t w;
+        if (send_frame(fd, part + s->fsent, 8 + h + n - s->fsent, NULL, 0,
+                       &w) != 0) {
+            shutdown_client(s->slot);
+            os_pop();
+            continue;
+        }
+        s->fsent += w;
+        if (s->fsent < 8 + h + n)
+            continue;
+        s->fsent = 0;
+        s->sent += n;
+        if (last)
+            os_pop();
+    }
+#ifndef WIN32
+    return NULL;
+#endif
+}
+
+// Queue a message to be sent by stream_thread(), in parts if it is bigger
+// than MSG_CHUNK. fsent is the number of bytes of a small message (with its
+// header) already sent. Must be called under conn_mutex.
+static void stream_to_vimcom(int i, const char *msg, size_t len,
+                             size_t fsent) {
+    if (len > MSG_MAX) {
+        fprintf(stderr, "Message to vimcom too big (%" PRI_SIZET " bytes)\n",
+                len);
+        fflush(stderr);
+        return;
+    }
+    if (!os_thread_on) {
+#ifdef WIN32
+        os_thread_on = _beginthread(stream_thread, 0, NULL) != -1L;
+#else
+        pthread_t tid;
+        os_thread_on = pthread_create(&tid, NULL, stream_thread, NULL) == 0;
+        if (os_thread_on)
+            pthread_detach(tid);
+#endif
+        if (!os_thread_on) {
+            fprintf(stderr, "Failed to start the thread sending big messages\n");
             fflush(stderr);
-            unlock_state();
+            if (fsent)
+                shutdown_client(i);
             return;
         }
-        if (send(connfd, msg, len, 0) != (ssize_t)len) {
-            fprintf(stderr, "Partial/failed write to vimcom.\n");
-            fflush(stderr);
-            unlock_state();
+    }
+    OutStream *s = malloc(sizeof(OutStream) + len);
+    if (!s) {
+        fprintf(stderr, "stream_to_vimcom: malloc failed (%" PRI_SIZET
+                        " bytes)\n", len);
+        fflush(stderr);
+        if (fsent)
+            shutdown_client(i);
+        return;
+    }
+    s->next = NULL;
+    s->slot = i;
+    s->cid = clients[i].id;
+    s->id = len > MSG_CHUNK ? ++os_count : 0;
+    s->len = len;
+    s->sent = 0;
+    s->fsent = fsent;
+    s->whole = len <= MSG_CHUNK;
+    memcpy(s->data, msg, len);
+    clients[i].nout++;
+    if (os_tail)
+        os_tail->next = s;
+    else
+        os_head = s;
+    os_tail = s;
+#ifdef WIN32
+    WakeConditionVariable(&os_cond);
+#else
+    pthread_cond_signal(&os_cond);
+#endif
+}
+
+/**
+ * @brief Send a message to vimcom.
+ *
+ * While a message from a client is being parsed, the answers go back to that
+ * client. Everything else is sent to the primary client. Big messages, and
+ * the ones sent to the same client after them while they are queued, are
+ * sent by stream_thread().
+ */
+void send_to_vimcom(
+    char *msg) // Function to send messages to R (vimcom package)
+{
+    Log("TCP out: %s", msg);
+    lock_conn();
+    int i = (on_event_thread() && reply_to >= 0) ? reply_to : primary;
+    if (i >= 0 && clients[i].fd >= 0) {
+        size_t len = strlen(msg);
+        if (len > MSG_CHUNK || clients[i].nout) {
+            stream_to_vimcom(i, msg, len, 0);
+            unlock_conn();
             return;
         }
+        char header[9];
+        size_t w;
+        snprintf(header, sizeof(header), "%08X", (unsigned int)len);
+        if (send_frame(clients[i].fd, header, 8, msg, len, &w) != 0)
+            shutdown_client(i);
+        else if (w < 8 + len)
+            stream_to_vimcom(i, msg, len, w); // The socket buffer is full
+
     } else {
         fprintf(stderr, "vimcom is not connected");
         fflush(stderr);
     }
-    unlock_state();
+    unlock_conn();
 }
 
 #ifdef WIN32
@@ -819,10 +1632,9 @@ static int server_started = 0;
 
 void start_server(void) // Start server and listen for connections
 {
-    // Guard: after TCP disconnect, receive_msg()'s init_listening() already
-    // re-binds and waits for the next connection.  A second "1\n" from Vim
-    // (e.g. during restart) must not block the main stdin_loop thread on a
-    // duplicate accept().
+    // Guard: the event loop keeps accepting connections after a vimcom
+    // disconnect. A second "1\n" from Vim (e.g. during restart) must not
+    // bind a second port.
     if (server_started) {
         Log("start_server: already started, ignoring duplicate request");
         return;
@@ -836,9 +1648,9 @@ void start_server(void) // Start server and listen for connections
 
     // Receive messages from TCP and output them to stdout
 #ifdef WIN32
-    Tid = _beginthread(receive_msg, 0, NULL);
+    Tid = _beginthread(event_loop, 0, NULL);
 #else
-    pthread_create(&Tid, NULL, receive_msg, NULL);
+    pthread_create(&Tid, NULL, event_loop, NULL);
 #endif
 }
 
@@ -965,11 +1777,79 @@ void pkg_delete(PkgData *pd) {
         free(pd->omnils);
     if (pd->args)
         free(pd->args);
+    free(pd->ob_b);
+    free(pd->ob_e);
     free(pd);
 }
 
+// Functions from base that are not highlighted as functions
+static const char *base_not_fun[] = {
+    "array",   "attach",  "character", "complex", "data.frame", "detach",
+    "double",  "function", "integer",  "library", "list",       "logical",
+    "matrix",  "numeric", "require",   "source",  "vector",     NULL};
+
+// Write the syntax keywords for the functions in the omnils_ of a package.
+// Returns the number of keywords.
+static int write_fun_keywords(PkgData *pd, FILE *f) {
+    const char *s = pd->omnils;
+    const char *nm, *grp;
+    int n = 0;
+    int isbase = strcmp(pd->name, "base") == 0;
+
+    while (*s) {
+        if (*s == '\n') { // Empty omnils_
+            s++;
+            continue;
+        }
+        nm = s;
+        s += strlen(s) + 1;
+        grp = s;
+        // Go to the next line
+        while (*s != '\n' && *s != 0)
+            s++;
+        if (*s == '\n')
+            s++;
+
+        if (grp[0] != '\003' || grp[1] != 0)
+            continue;
+        if (strpbrk(nm, "<%[+*&=$:{|@(^>/~!-"))
+            continue;
+        if (isbase) {
+            int i = 0;
+            while (base_not_fun[i] && strcmp(base_not_fun[i], nm) != 0)
+                i++;
+            if (base_not_fun[i])
+                continue;
+        }
+        fprintf(f, "syn keyword rFunction %s\n", nm);
+        n++;
+    }
+    return n;
+}
+
+// Create the fun_ file (list of functions for syntax highlighting) from the
+// omnils_ file already loaded.
+static void write_fun_file(PkgData *pd) {
+    char buf[1024];
+
+    snprintf(buf, 1023, "%s/fun_%s_%s", compldir, pd->name, pd->version);
+    if (access(buf, F_OK) == 0)
+        return;
+    FILE *f = fopen(buf, "w");
+    if (!f) {
+        fprintf(stderr, "Failed to write \"%s\"\n", buf);
+        fflush(stderr);
+        return;
+    }
+    if (write_fun_keywords(pd, f) == 0)
+        fputs("\" No functions found.\n", f);
+    fclose(f);
+}
+
 void load_pkg_data(PkgData *pd) {
     int size;
+    ob_gen++;
+    pd->ob_valid = 0;
     if (!pd->descr)
         pd->descr = get_pkg_descr(pd->name);
     pd->omnils = read_omnils_file(pd->fname, &size);
@@ -980,33 +1860,85 @@ void load_pkg_data(PkgData *pd) {
             for (int i = 0; i < size; i++)
                 if (pd->omnils[i] == '\n')
                     pd->nobjs++;
+        write_fun_file(pd);
+    }
+}
+
+// Packages loaded in the buffer have the highest priority and those only
+// loaded as dependencies of other packages have the lowest one.
+static int lib_priority(const char *nm) {
+    char buf[160];
+
+    if (!start_libs || !buffer_libs)
+        return BP_NORMAL;
+    snprintf(buf, sizeof(buf), ",%s,", nm);
+    if (strstr(buffer_libs, buf))
+        return BP_HIGH;
+    if (strstr(start_libs, buf))
+        return BP_NORMAL;
+    return BP_DEP;
+}
+
+// Ask the R process building omnils_ files to stop before its next package
+// if pd should be built before the packages of the current batch.
+static void preempt_build(PkgData *pd) {
+    char buf[1024];
+
+    if (build_tier < 0 || pd->built || pd->to_build != 0 ||
+        pd->priority <= build_tier)
+        return;
+    snprintf(buf, 1023, "%s/bo_preempt", tmpdir);
+    FILE *f = fopen(buf, "w");
+    if (f)
+        fclose(f);
+}
+
+// Save the libraries from R_start_libs and from library() and require()
+// calls in the buffer: "start_libs\002buffer_libs", both comma separated.
+static void set_build_priorities(const char *s) {
+    const char *b = strchr(s, '\002');
+    if (!b)
+        return;
+
+    size_t len = b - s;
+    free(start_libs);
+    free(buffer_libs);
+    start_libs = malloc(len + 3);
+    snprintf(start_libs, len + 3, ",%.*s,", (int)len, s);
+    b++;
+    buffer_libs = malloc(strlen(b) + 3);
+    snprintf(buffer_libs, strlen(b) + 3, ",%s,", b);
+
+    PkgData *pd = pkgList;
+    while (pd) {
+        if (pd->priority < BP_HIGH)
+            pd->priority = lib_priority(pd->name);
+        preempt_build(pd);
+        pd = pd->next;
     }
 }
 
 PkgData *new_pkg_data(const char *nm, const char *vrsn) {
+    static unsigned last_id;
     char buf[1024];
 
     PkgData *pd = calloc(1, sizeof(PkgData));
+    pd->id = ++last_id;
     pd->name = malloc((strlen(nm) + 1) * sizeof(char));
     strcpy(pd->name, nm);
     pd->version = malloc((strlen(vrsn) + 1) * sizeof(char));
     strcpy(pd->version, vrsn);
     pd->descr = get_pkg_descr(pd->name);
     pd->loaded = 1;
+    pd->priority = lib_priority(nm);
 
     snprintf(buf, 1023, "%s/omnils_%s_%s", compldir, nm, vrsn);
     pd->fname = malloc((strlen(buf) + 1) * sizeof(char));
     strcpy(pd->fname, buf);
 
-    // Check if both fun_ and omnils_ exist
-    pd->built = 1;
-    if (access(buf, F_OK) != 0) {
-        pd->built = 0;
-    } else {
-        snprintf(buf, 1023, "%s/fun_%s_%s", compldir, nm, vrsn);
-        if (access(buf, F_OK) != 0)
-            pd->built = 0;
-    }
+    // Check if omnils_ exists. The fun_ file is created when the omnils_ is
+    // loaded.
+    pd->built = access(buf, F_OK) == 0;
     return pd;
 }
 
@@ -1030,6 +1962,57 @@ void add_pkg(const char *nm, const char *vrsn) {
     pkgList->next = tmp;
 }
 
+#ifndef WIN32
+// Start R to run the script fnm with stdout and stderr redirected to the
+// given files (stderr is inherited if stderr_path is NULL). Returns the pid of
+// the child process or -1 on failure.
+static pid_t spawn_R(const char *fnm, const char *stdout_path,
+                     const char *stderr_path) {
+    // Use fork()+exec() instead of system() to avoid shell injection risks.
+    // The Windows path already uses CreateProcess() (no shell).
+    const char *rpath = getenv("VIMR_RPATH");
+    const char *remote_tmpdir = getenv("VIMR_REMOTE_TMPDIR");
+    const char *remote_compldir = getenv("VIMR_REMOTE_COMPLDIR");
+    if (!rpath || !remote_tmpdir || !remote_compldir) {
+        fprintf(stderr, "Missing VIMR_RPATH, VIMR_REMOTE_TMPDIR, or "
+                        "VIMR_REMOTE_COMPLDIR\n");
+        fflush(stderr);
+        return -1;
+    }
+
+    Log("R command: %s --quiet --no-restore --no-save --no-echo --slave -f %s",
+        rpath, fnm);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Child: set env vars, redirect stdout/stderr, exec R
+        setenv("VIMR_TMPDIR", remote_tmpdir, 1);
+        setenv("VIMR_COMPLDIR", remote_compldir, 1);
+
+        int fd_out = open(stdout_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd_out >= 0) {
+            dup2(fd_out, STDOUT_FILENO);
+            close(fd_out);
+        }
+        if (stderr_path) {
+            int fd_err = open(stderr_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd_err >= 0) {
+                dup2(fd_err, STDERR_FILENO);
+                close(fd_err);
+            }
+        }
+
+        execlp(rpath, rpath, "--quiet", "--no-restore", "--no-save",
+               "--no-echo", "--slave", "-f", fnm, (char *)NULL);
+        _exit(127); // exec failed
+    } else if (pid < 0) {
+        fprintf(stderr, "fork() failed\n");
+        fflush(stderr);
+    }
+    return pid;
+}
+#endif
+
 // Get a string with R code, save it in a file and source the file with R.
 static int run_R_code(const char *s, int senderror) {
     char fnm[1024];
@@ -1177,67 +2160,30 @@ static int run_R_code(const char *s, int senderror) {
     return 1;
 
 #else
-    // Use fork()+exec() instead of system() to avoid shell injection risks.
-    // The Windows path already uses CreateProcess() (no shell).
-    const char *rpath = getenv("VIMR_RPATH");
-    const char *remote_tmpdir = getenv("VIMR_REMOTE_TMPDIR");
-    const char *remote_compldir = getenv("VIMR_REMOTE_COMPLDIR");
-    if (!rpath || !remote_tmpdir || !remote_compldir) {
-        fprintf(stderr, "Missing VIMR_RPATH, VIMR_REMOTE_TMPDIR, or "
-                        "VIMR_REMOTE_COMPLDIR\n");
-        fflush(stderr);
-        return 0;
-    }
-
     char stdout_path[1024];
     char stderr_path[1024];
     snprintf(stdout_path, sizeof(stdout_path), "%s/run_R_stdout", tmpdir);
     snprintf(stderr_path, sizeof(stderr_path), "%s/run_R_stderr", tmpdir);
 
-    Log("R command: %s --quiet --no-restore --no-save --no-echo --slave -f %s",
-        rpath, fnm);
-
-    pid_t pid = fork();
-    if (pid == 0) {
-        // Child: set env vars, redirect stdout/stderr, exec R
-        setenv("VIMR_TMPDIR", remote_tmpdir, 1);
-        setenv("VIMR_COMPLDIR", remote_compldir, 1);
-
-        int fd_out = open(stdout_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (fd_out >= 0) {
-            dup2(fd_out, STDOUT_FILENO);
-            close(fd_out);
-        }
-        int fd_err = open(stderr_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (fd_err >= 0) {
-            dup2(fd_err, STDERR_FILENO);
-            close(fd_err);
-        }
+    pid_t pid = spawn_R(fnm, stdout_path, stderr_path);
+    if (pid < 0)
+        return 0;
 
-        execlp(rpath, rpath, "--quiet", "--no-restore", "--no-save",
-               "--no-echo", "--slave", "-f", fnm, (char *)NULL);
-        _exit(127); // exec failed
-    } else if (pid > 0) {
-        int status;
-        waitpid(pid, &status, 0);
-        int exit_code = -1;
-        if (WIFEXITED(status))
-            exit_code = WEXITSTATUS(status);
-        if (exit_code != 0 && exit_code != 2) {
-            if (senderror) {
-                lock_stdout();
-                printf("g:ShowBuildOmnilsError('%d')\n", exit_code);
-                fflush(stdout);
-                unlock_stdout();
-            }
-            return 0;
+    int status;
+    waitpid(pid, &status, 0);
+    int exit_code = -1;
+    if (WIFEXITED(status))
+        exit_code = WEXITSTATUS(status);
+    if (exit_code != 0 && exit_code != 2) {
+        if (senderror) {
+            lock_stdout();
+            printf("g:ShowBuildOmnilsError('%d')\n", exit_code);
+            fflush(stdout);
+            unlock_stdout();
         }
-        return 1;
-    } else {
-        fprintf(stderr, "fork() failed\n");
-        fflush(stderr);
         return 0;
     }
+    return 1;
 #endif
 }
 
@@ -1264,9 +2210,10 @@ void parse_descr(char *descr, const char *fnm) {
     int z = 0;
     int k = 0;
     int l = strlen(descr);
-    char *ttl, *dsc;
+    char *ttl, *dsc, *vrs;
     ttl = NULL;
     dsc = NULL;
+    vrs = NULL;
     InstLibs *lib, *ptr, *prev;
     while (k < l) {
         if ((k == 0 || descr[k - 1] == '\n' || descr[k - 1] == 0) &&
@@ -1283,6 +2230,13 @@ void parse_descr(char *descr, const char *fnm) {
             k = read_field_data(descr, k);
             descr[k] = 0;
         }
+        if ((k == 0 || descr[k - 1] == '\n' || descr[k - 1] == 0) &&
+            str_here(descr + k, "Version: ")) {
+            k += 9;
+            vrs = descr + k;
+            k = read_field_data(descr, k);
+            descr[k] = 0;
+        }
         k++;
     }
     if (ttl && dsc) {
@@ -1311,6 +2265,10 @@ void parse_descr(char *descr, const char *fnm) {
         lib->title = calloc(strlen(ttl) + 1, sizeof(char));
         strcpy(lib->title, ttl);
         lib->descr = calloc(strlen(dsc) + 1 - z, sizeof(char));
+        if (vrs) {
+            lib->version = calloc(strlen(vrs) + 1, sizeof(char));
+            strcpy(lib->version, vrs);
+        }
         lib->si = 1;
         m = 0;
         n = 0;
@@ -1401,11 +2359,6 @@ void update_inst_libs(void) {
 }
 
 static void read_args(void) {
-    if (more_to_build) {
-        has_args_to_read = 1;
-        return;
-    }
-
     char buf[1024];
     PkgData *pkg = pkgList;
     char *p;
@@ -1427,11 +2380,11 @@ static void read_args(void) {
         }
         pkg = pkg->next;
     }
-    has_args_to_read = 0;
 }
 
 // Read the list of libraries loaded in R, and run another R instance to build
-// the omnils_ and fun_ files in compldir.
+// the omnils_ and args_ files in compldir. The fun_ files are created by
+// load_pkg_data().
 static void build_omnils(void) {
     Log("build_omnils()");
     unsigned long nsz;
@@ -1449,14 +2402,30 @@ static void build_omnils(void) {
     memset(compl_buffer, 0, compl_buffer_size);
     char *p = compl_buffer;
 
+    // Packages whose omnils_ already exists don't need R. Build only the
+    // other packages with the highest priority now. The others will be built
+    // in the next rounds.
     PkgData *pkg = pkgList;
+    int tier = -1;
+    int cached = 0;
+    while (pkg) {
+        if (pkg->to_build == 0 && pkg->built) {
+            pkg->to_build = 1;
+            cached++;
+        } else if (pkg->to_build == 0 && pkg->priority > tier) {
+            tier = pkg->priority;
+        }
+        pkg = pkg->next;
+    }
+    build_tier = tier;
 
     // It would be easier to call R once for each library, but we will build
     // all cache files at once to avoid the cost of starting R many times.
     p = str_cat(p, "library('vimcom')\np <- c(");
     int k = 0;
+    pkg = pkgList;
     while (pkg) {
-        if (pkg->to_build == 0) {
+        if (pkg->to_build == 0 && pkg->priority == tier) {
             nsz = strlen(pkg->name) + 1024 + (p - compl_buffer);
             if (compl_buffer_size < nsz)
                 p = grow_buffer(&compl_buffer, &compl_buffer_size,
@@ -1470,20 +2439,27 @@ static void build_omnils(void) {
             else
                 snprintf(buf, sizeof(buf), ",\n  '%s'", safe_name);
             p = str_cat(p, buf);
-            pkg->to_build = 1;
+            pkg->to_build = 2;
             k++;
         }
         pkg = pkg->next;
     }
 
     if (k) {
-        // Build all the omnils_ files before beginning to build the args_
-        // files because: 1. It's about three times faster to build the
-        // omnils_ than the args_. 2. During omni completion, omnils_ is used
-        // more frequently. 3. The Object Browser only needs the omnils_.
+        // vim.buildomnils() builds the args_ file of each package right
+        // after its omnils_ file, reading the Rd database only once.
 
+        // R checks for bo_preempt before each package to let packages with
+        // higher priority be built first.
         n_omnils_build++;
-        p = str_cat(p, ")\nvimcom:::vim.buildomnils(p)\n");
+        p = str_cat(p, ")\nfor (pkg in p) {\n"
+                       "    if (file.exists(file.path(Sys.getenv('VIMR_TMPDIR'), "
+                       "'bo_preempt')))\n"
+                       "        break\n"
+                       "    vimcom:::vim.buildomnils(pkg)\n"
+                       "}\n");
+        snprintf(buf, 1023, "%s/bo_preempt", tmpdir);
+        unlink(buf);
 
         // Copy command before releasing lock — run_R_code reads the buffer
         char *r_code = strdup(compl_buffer);
@@ -1496,8 +2472,25 @@ static void build_omnils(void) {
 
         lock_state(); // Re-acquire for finish_bol (reads pkgList)
         finish_bol();
+        int preempted = access(buf, F_OK) == 0;
+        if (preempted)
+            unlink(buf);
+        pkg = pkgList;
+        while (pkg) {
+            if (pkg->to_build == 2)
+                // Packages skipped because of preemption go back to the queue
+                pkg->to_build = (preempted && !pkg->built) ? 0 : 1;
+            if (pkg->to_build == 0)
+                more_to_build = 1;
+            pkg = pkg->next;
+        }
+        build_tier = -1;
         unlock_state();
     } else {
+        build_tier = -1;
+        // Load the lists already built
+        if (cached)
+            finish_bol();
         unlock_state();
     }
     building_omnils = 0;
@@ -1509,24 +2502,6 @@ static void build_omnils(void) {
         more_to_build = 0;
         build_omnils();
     }
-
-    // Delete args_lock if it's too old
-    snprintf(buf, 1023, "%s/args_lock", compldir);
-    struct stat filestat;
-    if ((stat(buf, &filestat) == 0)) {
-        time_t t = time(&t);
-        t = t -
-            filestat.st_mtime; // st_mtime is a macro defined as st_mtim.tv_sec;
-        if (t < 3600)
-            return;
-        unlink(buf);
-    }
-
-    if (has_args_to_read) {
-        lock_state(); // read_args traverses pkgList
-        read_args();
-        unlock_state();
-    }
 }
 
 // Called asynchronously and only if an omnils_ file was actually built.
@@ -1548,6 +2523,9 @@ static void finish_bol() {
         pkg = pkg->next;
     }
 
+    // The args_ files are built along with the omnils_ ones
+    read_args();
+
     // Finally create a list of built omnils_ because libnames_ might have
     // already changed and vim-rr would try to read omnils_ files not built yet.
     snprintf(buf, 511, "%s/libs_in_nrs_%s", localtmpdir, getenv("VIMR_ID"));
@@ -1562,6 +2540,22 @@ static void finish_bol() {
         fclose(f);
     }
 
+    // Merge the lists of functions of all libraries to let Vim source a
+    // single file for syntax highlighting
+    if (snprintf(buf, 512, "%s/fun_all_%s", localtmpdir, getenv("VIMR_ID")) >= 512)
+        f = NULL;
+    else
+        f = fopen(buf, "w");
+    if (f) {
+        PkgData *pkg = pkgList;
+        while (pkg) {
+            if (pkg->loaded && pkg->built && pkg->omnils)
+                write_fun_keywords(pkg, f);
+            pkg = pkg->next;
+        }
+        fclose(f);
+    }
+
     // Message to Vim: Update both syntax and Rhelp_list
     lock_stdout();
     printf("g:UpdateSynRhlist()\n");
@@ -1607,6 +2601,8 @@ void update_pkg_list(char *libnms) {
     char *s, *nm, *vrsn;
     PkgData *pkg;
 
+    ob_gen++;
+
     // Consider that all packages were unloaded
     pkg = pkgList;
     while (pkg) {
@@ -1713,242 +2709,707 @@ void update_pkg_list(char *libnms) {
     }
 }
 
-ListStatus *search(const char *s) {
-    ListStatus *node = listTree;
-    if (!node)
-        return NULL;
-    int cmp = strcmp(node->key, s);
-    while (node && cmp != 0) {
-        if (cmp > 0)
-            node = node->right;
-        else
-            node = node->left;
-        if (node)
-            cmp = strcmp(node->key, s);
-    }
-    if (cmp == 0)
-        return node;
-    else
-        return NULL;
+static size_t ls_hash(const char *s) {
+    size_t h = 2166136261u; // FNV-1a
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
 }
 
-ListStatus *new_ListStatus(const char *s, int stt) {
-    ListStatus *p;
+// After change_all(), the status of each entry is updated only when the
+// entry is looked up: all lists are closed, or opened except libraries.
+static void ls_apply_all(ListStatus *p) {
+    if (p->gen == ls_gen)
+        return;
+    if (!(ls_all == 1 && p->key[strlen(p->key) - 1] == ':'))
+        p->status = ls_all;
+    p->gen = ls_gen;
+}
+
+ListStatus *search(const char *s) {
+    if (!lsTable)
+        return NULL;
+    ListStatus *p = lsTable[ls_hash(s) & (lsSize - 1)];
+    while (p && strcmp(p->key, s) != 0)
+        p = p->next;
+    if (p)
+        ls_apply_all(p);
+    return p;
+}
+
+ListStatus *new_ListStatus(const char *s, int stt) {
+    ListStatus *p;
     p = calloc(1, sizeof(ListStatus));
     p->key = malloc((strlen(s) + 1) * sizeof(char));
     strcpy(p->key, s);
     p->status = stt;
+    p->gen = ls_gen;
     return p;
 }
 
-ListStatus *insert(ListStatus *root, const char *s, int stt) {
-    if (!root)
-        return new_ListStatus(s, stt);
-    int cmp = strcmp(root->key, s);
-    if (cmp > 0)
-        root->right = insert(root->right, s, stt);
-    else
-        root->left = insert(root->left, s, stt);
-    return root;
+static ListStatus *insert(const char *s, int stt) {
+    if (lsCount >= lsSize) {
+        size_t nsz = lsSize ? 2 * lsSize : 256;
+        ListStatus **tbl = calloc(nsz, sizeof(ListStatus *));
+        if (!tbl)
+            return NULL;
+        for (size_t i = 0; i < lsSize; i++) {
+            ListStatus *p = lsTable[i];
+            while (p) {
+                ListStatus *nxt = p->next;
+                size_t h = ls_hash(p->key) & (nsz - 1);
+                p->next = tbl[h];
+                tbl[h] = p;
+                p = nxt;
+            }
+        }
+        free(lsTable);
+        lsTable = tbl;
+        lsSize = nsz;
+    }
+    ListStatus *p = new_ListStatus(s, stt);
+    size_t h = ls_hash(s) & (lsSize - 1);
+    p->next = lsTable[h];
+    lsTable[h] = p;
+    lsCount++;
+    return p;
+}
+
+// Remember the package whose rendered lines depend on the list status
+static void ls_set_pkg(ListStatus *p) {
+    if (ls_pkg && p->pkg != ls_pkg)
+        p->pkg = p->pkg ? LS_SHARED : ls_pkg;
 }
 
 int get_list_status(const char *s, int stt) {
-    if (listTree) {
-        ListStatus *p = search(s);
-        if (p)
-            return p->status;
-        insert(listTree, s, stt);
-        return stt;
-    }
-    listTree = new_ListStatus(s, stt);
+    ListStatus *p = search(s);
+    if (p) {
+        ls_set_pkg(p);
+        p->seen = 1;
+        return p->status;
+    }
+    if ((p = insert(s, stt))) {
+        ls_set_pkg(p);
+        p->seen = 1;
+    }
     return stt;
 }
 
+// Mark the entries of the objects in the list at p (the glbnv_buffer or an
+// omnils_) as seen.
+static void ls_mark_seen(const char *p) {
+    const char *f[7];
+    while (p && *p) {
+        ListStatus *e = search(p);
+        if (e)
+            e->seen = 1;
+        p = ob_fields(p, f);
+    }
+}
+
+// Is the library nm (of length n) installed?
+static int ls_lib_installed(const char *nm, size_t n) {
+    if (!instlibs)
+        return 1; // Don't know yet
+    for (InstLibs *il = instlibs; il; il = il->next)
+        if (strncmp(il->name, nm, n) == 0 && il->name[n] == 0)
+            return 1;
+    return 0;
+}
+
+// Drop the entries loaded from lsfile whose objects no longer exist, as far
+// as it can be known: when .GlobalEnv and all loaded libraries have their
+// lists. The status of the lists of libraries not loaded now is lost.
+static void ls_prune(void) {
+    size_t unseen = 0;
+    for (size_t i = 0; i < lsSize; i++)
+        for (ListStatus *p = lsTable[i]; p; p = p->next)
+            if (!p->seen)
+                unseen++;
+    if (!unseen || !glbnv_buffer || !pkgList || building_omnils)
+        return;
+    for (PkgData *pkg = pkgList; pkg; pkg = pkg->next)
+        if (pkg->loaded && !pkg->omnils)
+            return;
+
+    ls_mark_seen(glbnv_buffer);
+    for (PkgData *pkg = pkgList; pkg; pkg = pkg->next)
+        if (pkg->loaded)
+            ls_mark_seen(pkg->omnils);
+
+    for (size_t i = 0; i < lsSize; i++) {
+        ListStatus **pp = &lsTable[i];
+        while (*pp) {
+            ListStatus *p = *pp;
+            size_t n = strlen(p->key);
+            if (p->seen || (p->key[n - 1] == ':' &&
+                            ls_lib_installed(p->key, n - 1))) {
+                pp = &p->next;
+                continue;
+            }
+            *pp = p->next;
+            free(p->key);
+            free(p);
+            lsCount--;
+        }
+    }
+}
+
+// Save the status of lists and libraries to restore them in the next
+// session in the same directory.
+static void save_list_status(void) {
+    if (!lsfile[0])
+        return;
+    ls_prune();
+    FILE *f = fopen(lsfile, "w");
+    if (!f)
+        return;
+    for (size_t i = 0; i < lsSize; i++) {
+        for (ListStatus *p = lsTable[i]; p; p = p->next) {
+            ls_apply_all(p);
+            fprintf(f, "%d %s\n", p->status, p->key);
+        }
+    }
+    fclose(f);
+}
+
+static void load_list_status(void) {
+    char wd[512];
+    if (!compldir[0] || !getcwd(wd, sizeof(wd)))
+        return;
+    snprintf(lsfile, sizeof(lsfile), "%s/obstate_%08lx", compldir,
+             (unsigned long)(ls_hash(wd) & 0xffffffff));
+    char *b = read_file(lsfile, 0);
+    if (!b)
+        return;
+    char *s = b;
+    while (*s) {
+        char *e = s;
+        while (*e && *e != '\n')
+            e++;
+        if (*e)
+            *e++ = 0;
+        if ((s[0] == '0' || s[0] == '1') && s[1] == ' ' && s[2] &&
+            !search(s + 2))
+            insert(s + 2, s[0] == '1');
+        s = e;
+    }
+    free(b);
+}
+
 void toggle_list_status(const char *s) {
+    ob_gen++;
     ListStatus *p = search(s);
-    if (p)
-        p->status = !p->status;
+    if (!p)
+        return;
+    p->status = !p->status;
+    // Only the packages with the list have to be rendered again
+    if (p->pkg)
+        for (PkgData *pkg = pkgList; pkg; pkg = pkg->next)
+            if (p->pkg == LS_SHARED || p->pkg == pkg->id)
+                pkg->ob_valid = 0;
+    save_list_status();
 }
 
-static const char *write_ob_line(const char *p, const char *bs, char *prfx,
-                                 int closeddf, FILE *fl) {
-    char base1[128];
-    char base2[128];
-    char prefix[128];
-    char newprfx[128];
-    char nm[160];
-    char descr[160];
-    const char *f[7];
-    const char *s;    // Diagnostic pointer
-    const char *bsnm; // Name of object including its parent list, data.frame or
-                      // S4 object
-    int df;           // Is data.frame? If yes, start open unless closeddf = 1
-    int i;
-    int ne;
+#define OB_WIN_MIN 5000  // Render only a window of views longer than this
+#define OB_WIN_MARGIN 200 // Rows rendered above and below the visible ones
+
+// Line above the rendered window kept because it is the parent of a rendered
+// one (Vim reads the parents to get the full name of list elements).
+typedef struct obanc_ {
+    int row;    // Row relative to the start of the rendering
+    int col;    // Position of '#' in the line
+    char *line; // The line, ending with '\n'
+    size_t sz;  // Allocated size of line
+} ObAnc;
+
+// Text of an Object Browser view. The last version sent to Vim is kept to
+// send only the changed lines next time.
+typedef struct obbuf_ {
+    char *b;    // The lines, each one ending with '\n'
+    size_t len; // Length of the text
+    size_t sz;  // Allocated size
+    int nlines; // Number of lines
+    int sent;   // Flag: Vim's buffer has these lines
+    int dry;    // Flag: only count the lines
+    int skip;   // Lines to skip, keeping only the parents of the next one
+    int limit;  // Lines to render before only counting them (0: no limit)
+    ObAnc *anc; // Parents of the first line not skipped
+    int nanc;   // Number of parents
+    int ancsz;  // Allocated number of parents
+} ObBuf;
+
+static ObBuf ob_new;    // View being rendered
+static ObBuf ob_glbenv; // Last .GlobalEnv view sent to Vim
+static ObBuf ob_libs;   // Last Libraries view sent to Vim
+
+static void ob_reset(ObBuf *ob) {
+    ob->len = 0;
+    ob->nlines = 0;
+    ob->dry = 0;
+    ob->skip = 0;
+    ob->limit = 0;
+    ob->nanc = 0;
+}
 
-    nLibObjs--;
+// Make room for n more bytes plus the final NUL
+static int ob_reserve(ObBuf *ob, size_t n) {
+    if (ob->len + n < ob->sz)
+        return 1;
+    size_t nsz = ob->sz ? ob->sz : 32768;
+    while (ob->len + n >= nsz)
+        nsz *= 2;
+    char *tmp = realloc(ob->b, nsz);
+    if (!tmp) {
+        fprintf(stderr, "ob_reserve: realloc failed (%" PRI_SIZET " bytes)\n",
+                nsz);
+        fflush(stderr);
+        return 0;
+    }
+    ob->b = tmp;
+    ob->sz = nsz;
+    return 1;
+}
 
-    bsnm = p;
-    p += strlen(bs);
+// Position of the '#' that follows the type of object in an Object Browser
+// line (it defines the depth of the object)
+static int ob_col(const char *line) {
+    const char *h = strchr(line, '#');
+    return h ? (int)(h - line) : 0;
+}
 
-    i = 0;
-    while (i < 7) {
-        f[i] = p;
-        i++;
-        while (*p != 0)
-            p++;
-        p++;
+// Keep a line that is being skipped while it might be the parent of the next
+// lines, that is, until a line with '#' at the same or lower column comes.
+static void ob_keep_parent(ObBuf *ob, const char *line, size_t len) {
+    int col = ob_col(line);
+    while (ob->nanc > 0 && ob->anc[ob->nanc - 1].col >= col)
+        ob->nanc--;
+    if (ob->nanc == ob->ancsz) {
+        int nsz = ob->ancsz ? 2 * ob->ancsz : 32;
+        ObAnc *tmp = realloc(ob->anc, nsz * sizeof(ObAnc));
+        if (!tmp)
+            return;
+        memset(tmp + ob->ancsz, 0, (nsz - ob->ancsz) * sizeof(ObAnc));
+        ob->anc = tmp;
+        ob->ancsz = nsz;
     }
-    while (*p != '\n' && *p)
-        p++;
-    if (*p == '\n')
-        p++;
+    ObAnc *a = &ob->anc[ob->nanc];
+    if (a->sz <= len) {
+        char *tmp = realloc(a->line, len + 1);
+        if (!tmp)
+            return;
+        a->line = tmp;
+        a->sz = len + 1;
+    }
+    memcpy(a->line, line, len);
+    a->line[len] = 0;
+    a->row = ob->nlines;
+    a->col = col;
+    ob->nanc++;
+}
 
-    if (closeddf)
-        df = 0;
-    else if (f[1][0] == '$')
-        df = OpenDF;
-    else
-        df = OpenLS;
-
-    // Replace \x13 with single quote
-    i = 0;
-    s = f[0];
-    while (s[i] && i < 159) {
-        if (s[i] == '\x13')
-            nm[i] = '\'';
-        else
-            nm[i] = s[i];
-        i++;
+// Should the next line only be counted?
+static int ob_count_only(ObBuf *ob) {
+    if (ob->dry || (ob->limit && ob->nlines >= ob->limit)) {
+        ob->nlines++;
+        return 1;
     }
-    nm[i] = 0;
+    return 0;
+}
 
-    // Replace \x13 with single quote
-    if (f[1][0] == '\003')
-        s = f[5];
-    else
-        s = f[6];
-    if (s[0] == 0) {
-        descr[0] = 0;
-    } else {
-        i = 0;
-        while (s[i] && i < 159) {
-            if (s[i] == '\x13')
-                descr[i] = '\'';
-            else
-                descr[i] = s[i];
-            i++;
-        }
-        descr[i] = 0;
+// The text from len0 to the end of the buffer has nl new lines (nl = 2 for
+// the header). Lines before the window are only kept as possible parents.
+static void ob_end_line(ObBuf *ob, size_t len0, int nl) {
+    const char *line = ob->b + len0;
+    size_t n = ob->len - len0;
+    if (ob->nlines < ob->skip) {
+        ob_keep_parent(ob, line, n);
+        ob->len = len0;
+        ob->b[len0] = 0;
+        ob->nlines++;
+        return;
     }
+    if (ob->skip && ob->nlines == ob->skip) {
+        // Keep only the parents of the first rendered line
+        int col = ob_col(line);
+        while (ob->nanc > 0 && ob->anc[ob->nanc - 1].col >= col)
+            ob->nanc--;
+    }
+    ob->nlines += nl;
+}
 
-    if (!(bsnm[0] == '.' && allnames == 0)) {
-        if (f[1][0] == '\003')
-            fprintf(fl, "   %s(#%s\t%s\n", prfx, nm, descr);
-        else
-            fprintf(fl, "   %s%c#%s\t%s\n", prfx, f[1][0], nm, descr);
+// Append a line (or the two header lines) to the view
+static void ob_printf(ObBuf *ob, const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    if (ob_count_only(ob))
+        return;
+    for (;;) {
+        va_start(ap, fmt);
+        n = ob->b ? vsnprintf(ob->b + ob->len, ob->sz - ob->len, fmt, ap) : 0;
+        va_end(ap);
+        if (n < 0)
+            return;
+        if (ob->b && ob->len + n < ob->sz)
+            break;
+        if (!ob_reserve(ob, n + 1))
+            return;
     }
+    size_t len0 = ob->len;
+    int nl = 0;
+    for (int i = 0; i < n; i++)
+        if (ob->b[len0 + i] == '\n')
+            nl++;
+    ob->len += n;
+    ob_end_line(ob, len0, nl);
+}
 
-    if (*p == 0)
-        return p;
+// Append n bytes of already rendered lines to the view
+static void ob_append(ObBuf *ob, const char *s, size_t n, int nlines) {
+    if (!ob_reserve(ob, n))
+        return;
+    memcpy(ob->b + ob->len, s, n);
+    ob->len += n;
+    ob->b[ob->len] = 0;
+    ob->nlines += nlines;
+}
 
-    if (f[1][0] == '[' || f[1][0] == '$' || f[1][0] == '<' || f[1][0] == ':') {
-        s = f[6];
-        s++;
-        s++;
-        s++; // Number of elements (list)
-        if (f[1][0] == '$') {
-            while (*s && *s != ' ')
-                s++;
-            s++; // Number of columns (data.frame)
+// Write the n bytes of lines (each one ending with '\n') as a Vim list of
+// strings, with single quotes doubled. Returns a pointer to the end of the
+// list. OB_LIST_SZ() is the maximum size of the list of n bytes in nl lines.
+#define OB_LIST_SZ(n, nl) (2 * (n) + 4 * (nl) + 4)
+static char *ob_vim_list(char *p, const char *lines, size_t n) {
+    *p++ = '[';
+    for (size_t k = 0; k < n; k++) {
+        if (k == 0 || lines[k - 1] == '\n')
+            *p++ = '\'';
+        if (lines[k] == '\n') {
+            *p++ = '\'';
+            if (k + 1 < n) {
+                *p++ = ',';
+                *p++ = ' ';
+            }
+            continue;
         }
-        ne = atoi(s);
-        if (f[1][0] == '[' || f[1][0] == '$' || f[1][0] == ':') {
-            snprintf(base1, 127, "%s$", bsnm);  // Named list
-            snprintf(base2, 127, "%s[[", bsnm); // Unnamed list
-        } else {
-            snprintf(base1, 127, "%s@", bsnm); // S4 object
-            snprintf(
-                base2, 127, "%s[[",
-                bsnm); // S4 object always have names but base2 must be defined
+        if (lines[k] == '\'')
+            *p++ = '\'';
+        *p++ = lines[k];
+    }
+    *p++ = ']';
+    *p = 0;
+    return p;
+}
+
+// Send to Vim the lines of ob_new that differ from the ones in old: the
+// common lines at the beginning and at the end are skipped and the remaining
+// ones replace the old ones in the Object Browser. Returns 0 if the diff
+// would not be smaller than the whole view.
+static int ob_send_diff(const char *what, const ObBuf *old) {
+    const char *a = old->b;
+    const char *b = ob_new.b;
+    size_t k = 0, pre = 0;
+    int start = 1;
+
+    while (k < old->len && k < ob_new.len && a[k] == b[k]) {
+        if (a[k] == '\n') {
+            pre = k + 1;
+            start++;
         }
+        k++;
+    }
 
-        if (get_list_status(bsnm, df) == 0) {
-            while (str_here(p, base1) || str_here(p, base2)) {
-                while (*p != '\n' && *p)
-                    p++;
-                if (*p)
-                    p++;
-                nLibObjs--;
-            }
-            return p;
+    size_t ka = old->len, kb = ob_new.len;
+    size_t ea = ka, eb = kb;
+    while (ka > pre && kb > pre && a[ka - 1] == b[kb - 1]) {
+        ka--;
+        kb--;
+        if ((ka == pre || a[ka - 1] == '\n') &&
+            (kb == pre || b[kb - 1] == '\n')) {
+            ea = ka;
+            eb = kb;
         }
+    }
 
-        if (str_here(p, base1) == 0 && str_here(p, base2) == 0)
-            return p;
+    int ndel = 0, nins = 0;
+    for (k = pre; k < ea; k++)
+        if (a[k] == '\n')
+            ndel++;
+    for (k = pre; k < eb; k++)
+        if (b[k] == '\n')
+            nins++;
+    if (ndel == 0 && nins == 0)
+        return 1;
+    if (eb - pre > ob_new.len / 2)
+        return 0;
 
-        int len = strlen(prfx);
-        if (vimcom_is_utf8) {
-            int j = 0, i = 0;
-            while (i < len && j < (int)sizeof(newprfx) - 4) {
-                if (prfx[i] == '\xe2') {
-                    i += 3;
-                    if (prfx[i - 1] == '\x80' || prfx[i - 1] == '\x94') {
-                        newprfx[j] = ' ';
-                        j++;
-                    } else {
-                        newprfx[j] = '\xe2';
-                        j++;
-                        newprfx[j] = '\x94';
-                        j++;
-                        newprfx[j] = '\x82';
-                        j++;
-                    }
-                } else {
-                    newprfx[j] = prfx[i];
-                    i++, j++;
-                }
-            }
-            newprfx[j] = 0;
+    char *msg = malloc(OB_LIST_SZ(eb - pre, nins) + 128);
+    if (!msg)
+        return 0;
+    char *p = msg;
+    p += sprintf(p, "g:PatchOB('%s', %d, %d, %d, ", what, old->nlines, start,
+                 ndel);
+    p = ob_vim_list(p, b + pre, eb - pre);
+    p = str_cat(p, ")");
+
+    lock_stdout();
+    printf("\x11%" PRI_SIZET "\x11%s\n", (size_t)(p - msg), msg);
+    fflush(stdout);
+    unlock_stdout();
+    free(msg);
+    return 1;
+}
+
+// Send all lines of the new view to Vim
+static void ob_send_lines(const char *what) {
+    char *msg = malloc(OB_LIST_SZ(ob_new.len, ob_new.nlines) + 64);
+    if (!msg) {
+        fprintf(stderr, "ob_send_lines: malloc failed\n");
+        fflush(stderr);
+        return;
+    }
+    char *p = msg;
+    p += sprintf(p, "g:UpdateOB('%s', ", what);
+    p = ob_vim_list(p, ob_new.b, ob_new.len);
+    p = str_cat(p, ")");
+
+    lock_stdout();
+    printf("\x11%" PRI_SIZET "\x11%s\n", (size_t)(p - msg), msg);
+    fflush(stdout);
+    unlock_stdout();
+    free(msg);
+}
+
+// Save the view rendered in ob_new in fname (read by Vim when the Object
+// Browser is opened or reset) and, if tovim, update the Object Browser
+// either with a diff or, if Vim doesn't have the previous view, by asking it
+// to read the file. With ob_stream, no file is written and the whole view is
+// sent instead.
+static void ob_send(const char *what, const char *fname, ObBuf *old,
+                    int tovim) {
+    if (!ob_stream) {
+        FILE *f = fopen(fname, "w");
+        if (!f) {
+            fprintf(stderr, "Error opening \"%s\" for writing\n", fname);
+            fflush(stderr);
+            return;
+        }
+        fwrite(ob_new.b, sizeof(char), ob_new.len, f);
+        fclose(f);
+    }
+
+    if (tovim && !(old->sent && ob_send_diff(what, old))) {
+        if (ob_stream) {
+            ob_send_lines(what);
         } else {
-            if (len > (int)sizeof(newprfx) - 1)
-                len = (int)sizeof(newprfx) - 1;
-            for (int i = 0; i < len; i++) {
-                if (prfx[i] == '-' || prfx[i] == '`')
-                    newprfx[i] = ' ';
-                else
-                    newprfx[i] = prfx[i];
-            }
-            newprfx[len] = 0;
+            lock_stdout();
+            printf("g:UpdateOB('%s')\n", what);
+            fflush(stdout);
+            unlock_stdout();
         }
+    }
 
-        // Check if the next list element really is there
-        while (str_here(p, base1) || str_here(p, base2)) {
-            // Check if this is the last element in the list
-            s = p;
-            while (*s != '\n' && *s)
-                s++;
-            if (*s)
-                s++;
-            ne--;
-            if (ne == 0) {
-                snprintf(prefix, 112, "%s%s", newprfx, strL);
-            } else {
-                if (str_here(s, base1) || str_here(s, base2))
-                    snprintf(prefix, 112, "%s%s", newprfx, strT);
-                else
-                    snprintf(prefix, 112, "%s%s", newprfx, strL);
-            }
+    // Keep the new view and reuse the memory of the old one
+    char *b = old->b;
+    size_t sz = old->sz;
+    *old = ob_new;
+    old->sent = tovim;
+    old->anc = NULL; // Only the view being rendered needs the parents
+    old->nanc = 0;
+    old->ancsz = 0;
+    ob_reset(&ob_new);
+    ob_new.b = b;
+    ob_new.sz = sz;
+}
 
-            if (*p) {
-                if (str_here(p, base1))
-                    p = write_ob_line(p, base1, prefix, 0, fl);
-                else
-                    p = write_ob_line(p, bsnm, prefix, 0, fl);
+// Point f to the seven fields of the object at p (in the omnils_ or in the
+// glbnv_buffer, where the fields end with NUL) and return the next line.
+static const char *ob_fields(const char *p, const char **f) {
+    for (int i = 0; i < 7; i++) {
+        f[i] = p;
+        p += strlen(p) + 1;
+    }
+    while (*p != '\n' && *p)
+        p++;
+    if (*p == '\n')
+        p++;
+    return p;
+}
+
+static const char *ob_next_line(const char *p) {
+    const char *f[7];
+    return *p ? ob_fields(p, f) : p;
+}
+
+// If the object at p is an element of the list, data.frame or S4 object
+// named nm (of length n), return the length of the part of its name that
+// comes from the parent (including '$' or '@'). Otherwise, return 0.
+static size_t ob_child(const char *p, const char *nm, size_t n, char sep) {
+    if (strncmp(p, nm, n) != 0)
+        return 0;
+    if (p[n] == sep)
+        return n + 1;
+    if (p[n] == '[' && p[n + 1] == '[')
+        return n;
+    return 0;
+}
+
+// Number of elements of a list (or columns of a data.frame)
+static int ob_nelems(const char **f) {
+    const char *s = f[6];
+    for (int i = 0; i < 3 && *s; i++)
+        s++;
+    if (f[1][0] == '$') {
+        while (*s && *s != ' ')
+            s++;
+        if (*s)
+            s++;
+    }
+    return atoi(s);
+}
+
+// Copy s replacing \x13 with single quotes
+static char *ob_unquote(char *o, const char *s) {
+    for (; *s; s++)
+        *o++ = *s == '\x13' ? '\'' : *s;
+    return o;
+}
+
+static void ob_obj_line(ObBuf *ob, const char *prfx, size_t plen,
+                        const char **f, size_t skip) {
+    if (ob_count_only(ob))
+        return;
+    const char *nm = f[0] + skip;
+    const char *descr = f[1][0] == '\003' ? f[5] : f[6];
+    if (!ob_reserve(ob, plen + strlen(nm) + strlen(descr) + 8))
+        return;
+    size_t len0 = ob->len;
+    char *o = ob->b + len0;
+    memcpy(o, "   ", 3);
+    o += 3;
+    memcpy(o, prfx, plen);
+    o += plen;
+    *o++ = f[1][0] == '\003' ? '(' : f[1][0];
+    *o++ = '#';
+    o = ob_unquote(o, nm);
+    *o++ = '\t';
+    o = ob_unquote(o, descr);
+    *o++ = '\n';
+    *o = 0;
+    ob->len = o - ob->b;
+    ob_end_line(ob, len0, 1);
+}
+
+// A list, data.frame or S4 object whose elements are being rendered
+typedef struct obframe_ {
+    const char *nm; // Full name of the object
+    size_t len;     // Length of nm
+    char sep;       // '$' or, for S4 objects, '@'
+    int ne;         // Number of elements not rendered yet
+    size_t plen;    // Length of the prefix of the elements (without glyph)
+} ObFrame;
+
+static ObFrame *ob_stk;   // Stack of lists being rendered
+static int ob_stksz;      // Allocated size of ob_stk
+static char *ob_pfx;      // Prefix of the line being rendered
+static size_t ob_pfxsz;   // Allocated size of ob_pfx
+
+static int ob_pfx_set(size_t pos, const char *s) {
+    size_t n = strlen(s);
+    if (pos + n + 1 > ob_pfxsz) {
+        size_t nsz = ob_pfxsz ? 2 * ob_pfxsz : 256;
+        while (pos + n + 1 > nsz)
+            nsz *= 2;
+        char *tmp = realloc(ob_pfx, nsz);
+        if (!tmp)
+            return 0;
+        ob_pfx = tmp;
+        ob_pfxsz = nsz;
+    }
+    memcpy(ob_pfx + pos, s, n + 1);
+    return 1;
+}
+
+// Render the object at p and its elements that are in open lists. The
+// prefix of the object is either empty or one of strT and strL. Return the
+// line following the object's elements.
+static const char *write_ob_line(const char *p, const char *prfx,
+                                 int closeddf, ObBuf *ob) {
+    const char *f[7];
+    const char *nx = NULL; // Line after p if f already has the fields of p
+    int depth = 0;         // Number of lists in ob_stk
+    size_t skip = 0; // Part of the name that comes from the parent
+    size_t plen = strlen(prfx);
+    size_t glen = (strcmp(prfx, strL) == 0 || strcmp(prfx, strT) == 0) ? plen
+                                                                      : 0;
+    int last = strcmp(prfx, strL) == 0;
+    const char *cont = vimcom_is_utf8 ? "\xe2\x94\x82  " : "|  ";
+
+    if (!ob_pfx_set(0, prfx))
+        return p + strlen(p);
+
+    for (;;) {
+        const char *bsnm = p; // Name including its parent list
+        p = nx ? nx : ob_fields(p, f);
+        nx = NULL;
+        nLibObjs--;
+        if (!(bsnm[0] == '.' && allnames == 0))
+            ob_obj_line(ob, ob_pfx, plen, f, skip);
+
+        char t = f[1][0];
+        if (*p && (t == '[' || t == '$' || t == '<' || t == ':')) {
+            // If data.frame, start open unless closeddf = 1
+            int df = (depth == 0 && closeddf) ? 0 : t == '$' ? OpenDF : OpenLS;
+            size_t len = f[1] - bsnm - 1;
+            char sep = t == '<' ? '@' : '$';
+            if (get_list_status(bsnm, df) == 0) {
+                while (*p && ob_child(p, bsnm, len, sep)) {
+                    p = ob_next_line(p);
+                    nLibObjs--;
+                }
+            } else if (ob_child(p, bsnm, len, sep)) {
+                if (depth == ob_stksz) {
+                    int nsz = ob_stksz ? 2 * ob_stksz : 64;
+                    ObFrame *tmp = realloc(ob_stk, nsz * sizeof(ObFrame));
+                    if (!tmp)
+                        return p;
+                    ob_stk = tmp;
+                    ob_stksz = nsz;
+                }
+                ObFrame *fr = &ob_stk[depth++];
+                fr->nm = bsnm;
+                fr->len = len;
+                fr->sep = sep;
+                fr->ne = ob_nelems(f);
+                fr->plen = plen - glen;
+                if (glen) {
+                    const char *ext = last ? "   " : cont;
+                    if (!ob_pfx_set(fr->plen, ext))
+                        return p;
+                    fr->plen += strlen(ext);
+                }
             }
         }
+
+        // Next element of the innermost list that still has elements
+        while (depth > 0) {
+            ObFrame *fr = &ob_stk[depth - 1];
+            if (*p && (skip = ob_child(p, fr->nm, fr->len, fr->sep)))
+                break;
+            depth--;
+        }
+        if (depth == 0)
+            return p;
+
+        ObFrame *fr = &ob_stk[depth - 1];
+        fr->ne--;
+        nx = ob_fields(p, f);
+        last = fr->ne == 0 || !*nx || !ob_child(nx, fr->nm, fr->len, fr->sep);
+        if (!ob_pfx_set(fr->plen, last ? strL : strT))
+            return p;
+        glen = strlen(last ? strL : strT);
+        plen = fr->plen + glen;
     }
-    return p;
 }
 
 void hi_glbenv_fun(void) {
@@ -1987,33 +3448,74 @@ void hi_glbenv_fun(void) {
     unlock_stdout();
 }
 
-void update_glblenv_buffer(char *g) {
-    Log("update_glblenv_buffer()");
-    int n = 0;
-    int max;
-    int glbnv_size;
-
-    if (glbnv_buffer) {
-        if (strlen(g) > glbnv_buffer_sz) {
-            free(glbnv_buffer);
-            glbnv_buffer_sz = strlen(g) + 4096;
-            glbnv_buffer = malloc(glbnv_buffer_sz * sizeof(char));
-        }
-    } else {
-        glbnv_buffer_sz = strlen(g) + 4096;
-        glbnv_buffer = malloc(glbnv_buffer_sz * sizeof(char));
-    }
-    strcpy(glbnv_buffer, g);
-    if (check_omils_buffer(glbnv_buffer, &glbnv_size) == NULL)
-        return;
+// Top-level object of .GlobalEnv followed by its elements, as received from
+// vimcom, with the fields already split by check_omils_buffer()
+typedef struct glbblock_ {
+    char *b;    // Lines of the object
+    size_t len; // Length of b
+    int nfun;   // Number of functions
+} GlbBlock;
 
-    max = glbnv_size - 5;
+static GlbBlock *glb_blk; // Objects in the order of glbnv_buffer
+static int glb_nblk;      // Number of objects
+static int glb_blksz;     // Allocated number of objects
 
+static int count_glbenv_fun(const char *b, int size) {
+    int n = 0;
+    int max = size - 5;
     for (int i = 0; i < max; i++)
-        if (glbnv_buffer[i] == '\003') {
+        if (b[i] == '\003') {
             n++;
             i += 7;
         }
+    return n;
+}
+
+static void free_glb_blocks(GlbBlock *blk, int n) {
+    for (int i = 0; i < n; i++)
+        free(blk[i].b);
+}
+
+// Copy a top-level object received from vimcom. Return 0 if it is invalid.
+static int new_glb_block(GlbBlock *blk, const char *b, size_t len) {
+    int size;
+    blk->b = malloc(len + 1);
+    if (!blk->b)
+        return 0;
+    memcpy(blk->b, b, len);
+    blk->b[len] = 0;
+    // check_omils_buffer() frees the buffer if it is invalid
+    if (check_omils_buffer(blk->b, &size) == NULL) {
+        blk->b = NULL;
+        return 0;
+    }
+    blk->len = len;
+    blk->nfun = count_glbenv_fun(blk->b, size);
+    return 1;
+}
+
+// Assemble the glbnv_buffer from the objects
+static void glbenv_rebuild(void) {
+    size_t len = 0;
+    int n = 0;
+
+    ob_gen++;
+    glbnv_ver++;
+    for (int i = 0; i < glb_nblk; i++) {
+        len += glb_blk[i].len;
+        n += glb_blk[i].nfun;
+    }
+    if (!glbnv_buffer || len + 1 > glbnv_buffer_sz) {
+        free(glbnv_buffer);
+        glbnv_buffer_sz = len + 4096;
+        glbnv_buffer = malloc(glbnv_buffer_sz * sizeof(char));
+    }
+    char *p = glbnv_buffer;
+    for (int i = 0; i < glb_nblk; i++) {
+        memcpy(p, glb_blk[i].b, glb_blk[i].len);
+        p += glb_blk[i].len;
+    }
+    *p = 0;
 
     if (n != nGlbEnvFun) {
         nGlbEnvFun = n;
@@ -2021,93 +3523,766 @@ void update_glblenv_buffer(char *g) {
     }
 }
 
-void omni2ob(void) {
-    Log("omni2ob()");
-    FILE *f = fopen(globenv, "w");
-    if (!f) {
-        fprintf(stderr, "Error opening \"%s\" for writing\n", globenv);
+void update_glblenv_buffer(char *g) {
+    Log("update_glblenv_buffer()");
+
+    // The whole list in a single object: it cannot be patched later
+    free_glb_blocks(glb_blk, glb_nblk);
+    glb_nblk = 0;
+    glb_gen = 0;
+    if (*g) {
+        if (glb_blksz == 0) {
+            glb_blksz = 256;
+            glb_blk = malloc(glb_blksz * sizeof(GlbBlock));
+        }
+        if (new_glb_block(&glb_blk[0], g, strlen(g)))
+            glb_nblk = 1;
+    }
+    glbenv_rebuild();
+}
+
+// Apply the changes in the list of objects sent by vimcom:
+//   "<gen> <base>\n" followed by the operations on the objects of generation
+//   base (0: none): "=<n>\n" keeps the next n objects; "-<n>\n" removes
+//   them; "+<len>\n" followed by len bytes inserts an object. The objects
+//   after the last operation are kept.
+// Return 0 if the changes cannot be applied and the whole list is needed.
+static int apply_glbenv_delta(char *d) {
+    Log("apply_glbenv_delta()");
+    char *p;
+    unsigned long gen, base, n;
+    GlbBlock *nb;
+    int nn = 0;
+    int i = 0;
+    int ok = 1;
+
+    gen = strtoul(d, &p, 10);
+    if (*p != ' ')
+        return 0;
+    base = strtoul(p + 1, &p, 10);
+    if (*p != '\n' || gen == 0)
+        return 0;
+    p++;
+    if (base != 0 && base != glb_gen) {
+        Log("apply_glbenv_delta: base %lu, but generation is %u", base,
+            glb_gen);
+        return 0;
+    }
+    if (base == 0) {
+        free_glb_blocks(glb_blk, glb_nblk);
+        glb_nblk = 0;
+    }
+
+    int nsz = glb_blksz ? glb_blksz : 256;
+    nb = malloc(nsz * sizeof(GlbBlock));
+    if (!nb)
+        return 0;
+
+    while (*p && ok) {
+        char op = *p;
+        n = strtoul(p + 1, &p, 10);
+        if (*p != '\n') {
+            ok = 0;
+            break;
+        }
+        p++;
+        switch (op) {
+        case '=':
+        case '-':
+            if (n > (unsigned long)(glb_nblk - i)) {
+                ok = 0;
+                break;
+            }
+            for (; n > 0; n--, i++) {
+                if (op == '-') {
+                    free(glb_blk[i].b);
+                    continue;
+                }
+                if (nn == nsz) {
+                    GlbBlock *tmp = realloc(nb, 2 * nsz * sizeof(GlbBlock));
+                    if (!tmp) {
+                        ok = 0;
+                        break;
+                    }
+                    nb = tmp;
+                    nsz *= 2;
+                }
+                nb[nn++] = glb_blk[i];
+            }
+            break;
+        case '+':
+            if (strnlen(p, n) != n) {
+                ok = 0;
+                break;
+            }
+            if (nn == nsz) {
+                GlbBlock *tmp = realloc(nb, 2 * nsz * sizeof(GlbBlock));
+                if (!tmp) {
+                    ok = 0;
+                    break;
+                }
+                nb = tmp;
+                nsz *= 2;
+            }
+            if (!new_glb_block(&nb[nn], p, n)) {
+                ok = 0;
+                break;
+            }
+            nn++;
+            p += n;
+            break;
+        default:
+            ok = 0;
+        }
+    }
+
+    // Objects after the last operation are kept
+    for (; ok && i < glb_nblk; i++) {
+        if (nn == nsz) {
+            GlbBlock *tmp = realloc(nb, 2 * nsz * sizeof(GlbBlock));
+            if (!tmp) {
+                ok = 0;
+                break;
+            }
+            nb = tmp;
+            nsz *= 2;
+        }
+        nb[nn++] = glb_blk[i];
+    }
+
+    if (!ok) {
+        fprintf(stderr, "Invalid changes in the list of objects\n");
         fflush(stderr);
-        return;
+        // Discard everything: vimcom will send the whole list
+        free_glb_blocks(nb, nn);
+        free_glb_blocks(glb_blk + i, glb_nblk - i);
+        free(nb);
+        glb_nblk = 0;
+        glb_gen = 0;
+        glbenv_rebuild();
+        return 0;
     }
 
-    fprintf(f, ".GlobalEnv | Libraries\n\n");
+    free(glb_blk);
+    glb_blk = nb;
+    glb_nblk = nn;
+    glb_blksz = nsz;
+    glb_gen = gen;
+    glbenv_rebuild();
+    return 1;
+}
 
-    if (glbnv_buffer) {
-        const char *s = glbnv_buffer;
-        while (*s)
-            s = write_ob_line(s, "", "", 0, f);
+// Top level entry of an Object Browser view: either a package or an object
+// in .GlobalEnv or in a package. The index of entries of a view has the row
+// where each entry starts to let long views be rendered from any row.
+typedef struct obentry_ {
+    const char *src; // Object in the glbnv_buffer or omnils (NULL: package)
+    PkgData *pkg;    // Package (Libraries view)
+    int pkge;        // Index of the package entry (Libraries view)
+    int nlib;        // Value of nLibObjs before rendering the object
+    int row;         // First row of the entry
+} ObEntry;
+
+typedef struct obindex_ {
+    ObEntry *e;     // Entries
+    int n;          // Number of entries
+    int sz;         // Allocated number of entries
+    int nrows;      // Number of rows of the view
+    unsigned gen;   // Value of ob_gen when the index was built
+    int win_first;  // First row sent to Vim if the view is windowed
+    int win_last;   // Last row sent to Vim (0: view not windowed)
+} ObIndex;
+
+static ObIndex obi_glbenv; // Index of the .GlobalEnv view
+static ObIndex obi_libs;   // Index of the Libraries view
+static int ob_first = 1;   // First row visible in the Object Browser
+static int ob_last = 100;  // Last row visible in the Object Browser
+static int ob_view_glbenv = 1; // Is the Object Browser showing .GlobalEnv?
+
+static ObEntry *ob_add_entry(ObIndex *x, const char *src, PkgData *pkg,
+                             int row) {
+    if (x->n == x->sz) {
+        int nsz = x->sz ? 2 * x->sz : 1024;
+        ObEntry *tmp = realloc(x->e, nsz * sizeof(ObEntry));
+        if (!tmp)
+            return NULL;
+        x->e = tmp;
+        x->sz = nsz;
     }
+    ObEntry *e = &x->e[x->n];
+    e->src = src;
+    e->pkg = pkg;
+    e->pkge = x->n++;
+    e->nlib = 0;
+    e->row = row;
+    return e;
+}
 
-    fclose(f);
-    if (auto_obbr) {
-        lock_stdout();
-        fputs("g:UpdateOB('GlobalEnv')\n", stdout);
-        fflush(stdout);
-        unlock_stdout();
+static void ob_pkg_line(const PkgData *pkg, ObBuf *ob) {
+    if (pkg->descr)
+        ob_printf(ob, "   :#%s\t%s\n", pkg->name, pkg->descr);
+    else
+        ob_printf(ob, "   :#%s\t\n", pkg->name);
+}
+
+static void ob_render_entry(const ObEntry *e, int glbenv, ObBuf *ob) {
+    if (glbenv) {
+        write_ob_line(e->src, "", 0, ob);
+    } else if (!e->src) {
+        ob_pkg_line(e->pkg, ob);
+    } else {
+        nLibObjs = e->nlib;
+        write_ob_line(e->src, nLibObjs == 0 ? strL : strT, 1, ob);
     }
 }
 
-void lib2ob(void) {
-    Log("lib2ob()");
-    FILE *f = fopen(liblist, "w");
-    if (!f) {
-        fprintf(stderr, "Failed to open \"%s\"\n", liblist);
-        fflush(stderr);
+// Render the lines of a package in the Libraries view unless they are still
+// valid. They become invalid when one of its lists is toggled, when all lists
+// are opened or closed and when its omnils_ is loaded again.
+static void ob_pkg_block(PkgData *pkg) {
+    char lbnmc[512];
+    ObBuf blk = {0};
+
+    if (pkg->ob_valid && pkg->ob_lsgen == ls_gen)
         return;
+
+    blk.b = pkg->ob_b;
+    blk.sz = pkg->ob_sz;
+    pkg->ob_ne = 0;
+    ls_pkg = pkg->id;
+    ob_pkg_line(pkg, &blk);
+    snprintf(lbnmc, 511, "%s:", pkg->name);
+    if (pkg->omnils && pkg->nobjs > 0 && get_list_status(lbnmc, 0) == 1) {
+        const char *p = pkg->omnils;
+        nLibObjs = pkg->nobjs - 1;
+        while (*p) {
+            if (pkg->ob_ne == pkg->ob_esz) {
+                int nsz = pkg->ob_esz ? 2 * pkg->ob_esz : 256;
+                ObEntry *tmp = realloc(pkg->ob_e, nsz * sizeof(ObEntry));
+                if (!tmp)
+                    break;
+                pkg->ob_e = tmp;
+                pkg->ob_esz = nsz;
+            }
+            ObEntry *e = &pkg->ob_e[pkg->ob_ne++];
+            e->src = p;
+            e->pkg = pkg;
+            e->pkge = 0;
+            e->nlib = nLibObjs;
+            e->row = blk.nlines;
+            p = write_ob_line(p, nLibObjs == 0 ? strL : strT, 1, &blk);
+        }
     }
-    fprintf(f, "Libraries | .GlobalEnv\n\n");
+    ls_pkg = 0;
+
+    pkg->ob_b = blk.b;
+    pkg->ob_len = blk.len;
+    pkg->ob_sz = blk.sz;
+    pkg->ob_nlines = blk.nlines;
+    pkg->ob_lsgen = ls_gen;
+    pkg->ob_valid = 1;
+}
 
-    char lbnmc[512];
-    PkgData *pkg;
+// Walk through the objects of a view, counting the rows of each entry
+// without rendering them. The rows of packages come from their cached lines.
+static void ob_build_index(ObIndex *x, int glbenv) {
+    ObBuf dry = {0};
+    ObEntry *e;
     const char *p;
-    int stt;
 
-    pkg = pkgList;
-    while (pkg) {
-        if (pkg->loaded) {
-            if (pkg->descr)
-                fprintf(f, "   :#%s\t%s\n", pkg->name, pkg->descr);
-            else
-                fprintf(f, "   :#%s\t\n", pkg->name);
-            snprintf(lbnmc, 511, "%s:", pkg->name);
-            stt = get_list_status(lbnmc, 0);
-            if (pkg->omnils && pkg->nobjs > 0 && stt == 1) {
-                p = pkg->omnils;
-                nLibObjs = pkg->nobjs - 1;
-                while (*p) {
-                    if (nLibObjs == 0)
-                        p = write_ob_line(p, "", strL, 1, f);
-                    else
-                        p = write_ob_line(p, "", strT, 1, f);
+    dry.dry = 1;
+    dry.nlines = 2; // Header
+    x->n = 0;
+    if (glbenv) {
+        p = glbnv_buffer;
+        while (p && *p) {
+            if (!ob_add_entry(x, p, NULL, dry.nlines + 1))
+                break;
+            p = write_ob_line(p, "", 0, &dry);
+        }
+    } else {
+        PkgData *pkg = pkgList;
+        while (pkg) {
+            if (pkg->loaded) {
+                ob_pkg_block(pkg);
+                int pkge = x->n;
+                if (!ob_add_entry(x, NULL, pkg, dry.nlines + 1))
+                    break;
+                for (int i = 0; i < pkg->ob_ne; i++) {
+                    const ObEntry *pe = &pkg->ob_e[i];
+                    e = ob_add_entry(x, pe->src, pkg, dry.nlines + pe->row + 1);
+                    if (!e)
+                        break;
+                    e->pkge = pkge;
+                    e->nlib = pe->nlib;
                 }
+                dry.nlines += pkg->ob_nlines;
+            }
+            pkg = pkg->next;
+        }
+    }
+    x->nrows = dry.nlines;
+    x->gen = ob_gen;
+}
+
+// Send to Vim the number of rows of a long view and only the rows around the
+// visible ones, along with the header and the parents of the first rendered
+// row. The other rows are left empty in the Object Browser.
+static void ob_send_window(const char *what, ObIndex *x, int glbenv) {
+    int first = ob_first - OB_WIN_MARGIN;
+    int last = ob_last + OB_WIN_MARGIN;
+    if (last > x->nrows)
+        last = x->nrows;
+    if (first > last - 2 * OB_WIN_MARGIN)
+        first = last - 2 * OB_WIN_MARGIN;
+    if (first < 3)
+        first = 3;
+
+    // Binary search of the entry with the first row
+    int lo = 0, hi = x->n - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (x->e[mid].row <= first)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    // Start from the package line to have it as a parent
+    int k = glbenv ? lo : x->e[lo].pkge;
+    int row0 = x->e[k].row;
+
+    ob_reset(&ob_new);
+    ob_new.skip = first - row0;
+    ob_new.limit = last - row0 + 1;
+    for (int i = k; i < x->n && x->e[i].row <= last; i++)
+        ob_render_entry(&x->e[i], glbenv, &ob_new);
+
+    // The header and the parents of the first row, all ending with '\n'
+    size_t asz = 64;
+    for (int i = 0; i < ob_new.nanc; i++)
+        asz += strlen(ob_new.anc[i].line) + 1;
+    char *anc = malloc(asz);
+    char *msg = malloc(OB_LIST_SZ(asz, ob_new.nanc + 2) + 16 * ob_new.nanc +
+                       OB_LIST_SZ(ob_new.len, ob_new.nlines) + 128);
+    if (!anc || !msg) {
+        free(anc);
+        free(msg);
+        ob_reset(&ob_new);
+        return;
+    }
+    char *p = anc;
+    p += sprintf(p, "%s\n\n",
+                 glbenv ? ".GlobalEnv | Libraries" : "Libraries | .GlobalEnv");
+    for (int i = 0; i < ob_new.nanc; i++) {
+        p = str_cat(p, ob_new.anc[i].line);
+        if (p[-1] != '\n')
+            p = str_cat(p, "\n");
+    }
+
+    p = msg;
+    p += sprintf(p, "g:FillOB('%s', %d, [1, 2", what, x->nrows);
+    for (int i = 0; i < ob_new.nanc; i++)
+        p += sprintf(p, ", %d", row0 + ob_new.anc[i].row);
+    p = str_cat(p, "], ");
+    p = ob_vim_list(p, anc, strlen(anc));
+    free(anc);
+    p += sprintf(p, ", %d, ", first);
+    p = ob_vim_list(p, ob_new.b, ob_new.len);
+    p = str_cat(p, ")");
+
+    lock_stdout();
+    printf("\x11%" PRI_SIZET "\x11%s\n", (size_t)(p - msg), msg);
+    fflush(stdout);
+    unlock_stdout();
+    free(msg);
+
+    x->win_first = first;
+    x->win_last = last;
+    ob_reset(&ob_new);
+}
+
+// Filter of an Object Browser view: only the objects whose names match the
+// pattern are rendered, along with their parents.
+typedef struct obfilter_ {
+    char mode; // 'p': prefix; 's': substring; 'f': fuzzy; 0: no filter
+    char *pat; // Pattern with single quotes replaced with \x13
+    size_t len; // Length of pat
+} ObFilter;
+
+static ObFilter obf_glbenv; // Filter of the .GlobalEnv view
+static ObFilter obf_libs;   // Filter of the Libraries view
+
+// Object kept in a filtered view
+typedef struct obkept_ {
+    const char *p; // Line of the object
+    size_t skip;   // Part of the name that comes from the parent
+    int depth;     // 0: package; 1: top level object in the Libraries view
+    int last;      // Flag: last kept element of its parent
+} ObKept;
+
+static ObKept *ob_kept; // Objects kept in the filtered view being rendered
+static int ob_nkept;    // Number of kept objects
+static int ob_keptsz;   // Allocated size of ob_kept
+
+// List whose elements are being checked against the filter
+typedef struct obfltframe_ {
+    const char *nm; // Full name of the list
+    size_t len;     // Length of nm
+    char sep;       // '$' or, for S4 objects, '@'
+    size_t skip;    // Part of the name that comes from its parent
+    int kept;       // Flag: the list is already in ob_kept
+} ObFltFrame;
+
+static ObFltFrame *obf_stk; // Stack of lists
+static int obf_stksz;       // Allocated size of obf_stk
+
+// Set the filter from Vim's message: "<mode><pattern>"
+static void ob_set_filter(ObFilter *flt, const char *msg) {
+    free(flt->pat);
+    flt->pat = NULL;
+    flt->mode = 0;
+    if (!msg[0] || !msg[1])
+        return;
+    flt->mode = msg[0];
+    flt->pat = malloc(strlen(msg));
+    strcpy(flt->pat, msg + 1);
+    for (char *c = flt->pat; *c; c++)
+        if (*c == '\'')
+            *c = '\x13';
+    flt->len = strlen(flt->pat);
+}
+
+static int ob_match(const ObFilter *flt, const char *nm) {
+    switch (flt->mode) {
+    case 'p':
+        return strncmp(nm, flt->pat, flt->len) == 0;
+    case 'f': {
+        // Characters of the pattern in the same order, ignoring case
+        const char *q = flt->pat;
+        for (; *nm && *q; nm++)
+            if (tolower((unsigned char)*nm) == tolower((unsigned char)*q))
+                q++;
+        return *q == 0;
+    }
+    default:
+        return strstr(nm, flt->pat) != NULL;
+    }
+}
+
+static int ob_keep(const char *p, size_t skip, int depth) {
+    if (ob_nkept == ob_keptsz) {
+        int nsz = ob_keptsz ? 2 * ob_keptsz : 256;
+        ObKept *tmp = realloc(ob_kept, nsz * sizeof(ObKept));
+        if (!tmp)
+            return 0;
+        ob_kept = tmp;
+        ob_keptsz = nsz;
+    }
+    ObKept *k = &ob_kept[ob_nkept++];
+    k->p = p;
+    k->skip = skip;
+    k->depth = depth;
+    return 1;
+}
+
+// Walk through all objects, including the elements of closed lists, and
+// keep the ones whose names match the filter along with their parents.
+static void ob_filter_collect(const char *p, int depth0, const ObFilter *flt) {
+    const char *f[7];
+    int depth = 0;
+
+    while (*p) {
+        const char *bsnm = p;
+        p = ob_fields(p, f);
+
+        size_t skip = 0;
+        while (depth > 0) {
+            ObFltFrame *fr = &obf_stk[depth - 1];
+            if ((skip = ob_child(bsnm, fr->nm, fr->len, fr->sep)))
+                break;
+            depth--;
+        }
+        if (bsnm[0] == '.' && allnames == 0)
+            continue; // Hidden object (and its elements)
+
+        int kept = ob_match(flt, bsnm + skip);
+        if (kept) {
+            for (int i = 0; i < depth; i++)
+                if (!obf_stk[i].kept)
+                    obf_stk[i].kept =
+                        ob_keep(obf_stk[i].nm, obf_stk[i].skip, depth0 + i);
+            ob_keep(bsnm, skip, depth0 + depth);
+        }
+
+        char t = f[1][0];
+        if (t == '[' || t == '$' || t == '<' || t == ':') {
+            if (depth == obf_stksz) {
+                int nsz = obf_stksz ? 2 * obf_stksz : 64;
+                ObFltFrame *tmp = realloc(obf_stk, nsz * sizeof(ObFltFrame));
+                if (!tmp)
+                    return;
+                obf_stk = tmp;
+                obf_stksz = nsz;
             }
+            ObFltFrame *fr = &obf_stk[depth++];
+            fr->nm = bsnm;
+            fr->len = f[1] - bsnm - 1;
+            fr->sep = t == '<' ? '@' : '$';
+            fr->skip = skip;
+            fr->kept = kept;
+        }
+    }
+}
+
+// Render the kept objects, with the glyphs of the tree computed from their
+// depths.
+static void ob_filter_render(ObBuf *ob) {
+    const char *f[7];
+    const char *cont = vimcom_is_utf8 ? "\xe2\x94\x82  " : "|  ";
+    int maxd = 0;
+
+    for (int i = 0; i < ob_nkept; i++)
+        if (ob_kept[i].depth > maxd)
+            maxd = ob_kept[i].depth;
+    char *seen = calloc(maxd + 2, 1);
+    char *lastat = calloc(maxd + 2, 1);
+    if (!seen || !lastat) {
+        free(seen);
+        free(lastat);
+        return;
+    }
+    for (int i = ob_nkept - 1; i >= 0; i--) {
+        int d = ob_kept[i].depth;
+        ob_kept[i].last = !seen[d];
+        seen[d] = 1;
+        memset(seen + d + 1, 0, maxd - d); // Elements of other lists
+    }
+
+    for (int i = 0; i < ob_nkept; i++) {
+        const ObKept *k = &ob_kept[i];
+        size_t plen = 0;
+        ob_pfx_set(0, "");
+        for (int d = 1; d < k->depth; d++) {
+            const char *ext = lastat[d] ? "   " : cont;
+            ob_pfx_set(plen, ext);
+            plen += strlen(ext);
+        }
+        if (k->depth > 0) {
+            ob_pfx_set(plen, k->last ? strL : strT);
+            plen += strlen(k->last ? strL : strT);
+        }
+        lastat[k->depth] = k->last;
+        ob_fields(k->p, f);
+        ob_obj_line(ob, ob_pfx, plen, f, k->skip);
+    }
+    free(seen);
+    free(lastat);
+}
+
+// Render a filtered view into ob_new
+static void ob_render_filtered(int glbenv) {
+    ob_printf(&ob_new, glbenv ? ".GlobalEnv | Libraries\n\n"
+                              : "Libraries | .GlobalEnv\n\n");
+    ob_nkept = 0;
+    if (glbenv) {
+        if (glbnv_buffer)
+            ob_filter_collect(glbnv_buffer, 0, &obf_glbenv);
+        ob_filter_render(&ob_new);
+        return;
+    }
+    for (PkgData *pkg = pkgList; pkg; pkg = pkg->next) {
+        if (!pkg->loaded)
+            continue;
+        ob_nkept = 0;
+        if (pkg->omnils && pkg->nobjs > 0)
+            ob_filter_collect(pkg->omnils, 1, &obf_libs);
+        if (ob_nkept || ob_match(&obf_libs, pkg->name)) {
+            ob_pkg_line(pkg, &ob_new);
+            ob_filter_render(&ob_new);
+        }
+    }
+}
+
+// Render the whole view or, if it is too long, only the rows around the ones
+// visible in the Object Browser.
+static void ob_update(int glbenv, int tovim) {
+    ObIndex *x = glbenv ? &obi_glbenv : &obi_libs;
+    ObBuf *old = glbenv ? &ob_glbenv : &ob_libs;
+    const char *what = glbenv ? "GlobalEnv" : "libraries";
+
+    ob_pending &= glbenv ? ~OB_PEND_G : ~OB_PEND_L;
+    if ((glbenv ? &obf_glbenv : &obf_libs)->mode) {
+        x->win_last = 0;
+        ob_render_filtered(glbenv);
+        ob_send(what, glbenv ? globenv : liblist, old, tovim);
+        return;
+    }
+    ob_build_index(x, glbenv);
+    if (x->nrows > OB_WIN_MIN) {
+        // The globenv_ and liblist_ files are not written because Vim
+        // doesn't read them while the view is windowed.
+        if (tovim)
+            ob_send_window(what, x, glbenv);
+        old->sent = 0;
+        return;
+    }
+    x->win_last = 0;
+
+    ob_printf(&ob_new, glbenv ? ".GlobalEnv | Libraries\n\n"
+                              : "Libraries | .GlobalEnv\n\n");
+    if (glbenv) {
+        for (int i = 0; i < x->n; i++)
+            ob_render_entry(&x->e[i], glbenv, &ob_new);
+    } else {
+        for (PkgData *pkg = pkgList; pkg; pkg = pkg->next)
+            if (pkg->loaded)
+                ob_append(&ob_new, pkg->ob_b, pkg->ob_len, pkg->ob_nlines);
+    }
+    ob_send(what, glbenv ? globenv : liblist, old, tovim);
+}
+
+void omni2ob(void) {
+    Log("omni2ob()");
+    ob_update(1, auto_obbr);
+}
+
+void lib2ob(void) {
+    Log("lib2ob()");
+    ob_update(0, 1);
+}
+
+// Automatic updates of the Object Browser (after each top level command run
+// in R) are rendered at most once every ob_interval ms: the first one is
+// rendered immediately and the next ones are coalesced into a single update
+// rendered by ob_timer() at the end of the interval.
+#ifdef WIN32
+static CONDITION_VARIABLE ob_cond; // Signaled when an update is pending
+#else
+static pthread_cond_t ob_cond = PTHREAD_COND_INITIALIZER;
+#endif
+static int ob_timer_on;  // Flag: the ob_timer() thread is running
+static double ob_last_t; // Time of the last automatic update (ms)
+
+static double ob_now(void) {
+#ifdef WIN32
+    return (double)GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+#endif
+}
+
+static void ob_render_pending(void) {
+    int what = ob_pending;
+    ob_pending = 0;
+    ob_last_t = ob_now();
+    if (what & OB_PEND_G)
+        omni2ob();
+    if (what & OB_PEND_L)
+        lib2ob();
+}
+
+// Thread rendering the coalesced updates. It holds the state lock except
+// while waiting on ob_cond.
+#ifdef WIN32
+static void ob_timer(void *arg)
+#else
+static void *ob_timer(void *arg)
+#endif
+{
+    (void)arg;
+    lock_state();
+    for (;;) {
+        while (!ob_pending) {
+#ifdef WIN32
+            SleepConditionVariableCS(&ob_cond, &state_mutex, INFINITE);
+#else
+            pthread_cond_wait(&ob_cond, &state_mutex);
+#endif
+        }
+        double wait = ob_last_t + ob_interval - ob_now();
+        if (ob_pending && wait > 0 && wait <= ob_interval) {
+#ifdef WIN32
+            SleepConditionVariableCS(&ob_cond, &state_mutex, (DWORD)wait);
+#else
+            double dl = ob_now() + wait;
+            struct timespec ts;
+            ts.tv_sec = (time_t)(dl / 1000);
+            ts.tv_nsec = (long)((dl - ts.tv_sec * 1000.0) * 1e6);
+            pthread_cond_timedwait(&ob_cond, &state_mutex, &ts);
+#endif
+            continue; // Check the time again
+        }
+        if (ob_pending && auto_obbr)
+            ob_render_pending();
+        ob_pending = 0;
+    }
+#ifndef WIN32
+    return NULL;
+#endif
+}
+
+static void ob_refresh(int what) {
+    ob_pending |= what;
+    double elapsed = ob_now() - ob_last_t;
+    if (ob_interval <= 0 || elapsed < 0 || elapsed >= ob_interval) {
+        ob_render_pending();
+        return;
+    }
+    if (!ob_timer_on) {
+#ifdef WIN32
+        ob_timer_on = _beginthread(ob_timer, 0, NULL) != -1L;
+#else
+        pthread_t tid;
+        ob_timer_on = pthread_create(&tid, NULL, ob_timer, NULL) == 0;
+        if (ob_timer_on)
+            pthread_detach(tid);
+#endif
+        if (!ob_timer_on) {
+            ob_render_pending();
+            return;
         }
-        pkg = pkg->next;
     }
+#ifdef WIN32
+    WakeConditionVariable(&ob_cond);
+#else
+    pthread_cond_signal(&ob_cond);
+#endif
+}
 
-    fclose(f);
-    lock_stdout();
-    fputs("g:UpdateOB('libraries')\n", stdout);
-    fflush(stdout);
-    unlock_stdout();
+// Vim sent the range of rows visible in the Object Browser
+static void ob_scroll(const char *range) {
+    ob_first = atoi(range);
+    const char *c = strchr(range, ',');
+    ob_last = c ? atoi(c + 1) : ob_first + 100;
+
+    ObIndex *x = ob_view_glbenv ? &obi_glbenv : &obi_libs;
+    if (!auto_obbr || x->win_last == 0)
+        return;
+    if (x->gen == ob_gen && ob_first >= x->win_first &&
+        (ob_last <= x->win_last || x->win_last == x->nrows))
+        return;
+    if (x->gen != ob_gen)
+        ob_update(ob_view_glbenv, 1);
+    else
+        ob_send_window(ob_view_glbenv ? "GlobalEnv" : "libraries", x,
+                       ob_view_glbenv);
 }
 
-void change_all(ListStatus *root, int stt) {
-    if (root != NULL) {
-        // Open all but libraries
-        if (!(stt == 1 && root->key[strlen(root->key) - 1] == ':'))
-            root->status = stt;
-        change_all(root->left, stt);
-        change_all(root->right, stt);
-    }
+void change_all(int stt) {
+    ob_gen++;
+    ls_gen++;
+    ls_all = stt;
+    save_list_status();
 }
 
-void print_listTree(ListStatus *root, FILE *f) {
-    if (root != NULL) {
-        fprintf(f, "%d :: %s\n", root->status, root->key);
-        print_listTree(root->left, f);
-        print_listTree(root->right, f);
-    }
+void print_list_status(FILE *f) {
+    for (size_t i = 0; i < lsSize; i++)
+        for (ListStatus *p = lsTable[i]; p; p = p->next) {
+            ls_apply_all(p);
+            fprintf(f, "%d :: %s\n", p->status, p->key);
+        }
 }
 
 static void fill_inst_libs(void) {
@@ -2236,6 +4411,39 @@ static int generate_secret(char *buf, size_t buflen) {
     return 0;
 }
 
+// Read the list of library paths saved by before_nrs.R
+static void read_lib_paths(void) {
+    char fname[512];
+    snprintf(fname, 511, "%s/libPaths", tmpdir);
+    char *b = read_file(fname, 1);
+    if (b) {
+#ifdef WIN32
+        for (size_t i = 0, blen = strlen(b); i < blen; i++)
+            if (b[i] == '\\')
+                b[i] = '/';
+#endif
+        libpaths = calloc(1, sizeof(LibPath));
+        libpaths->path = b;
+        LibPath *p = libpaths;
+        while (*b) {
+            if (*b == '\n') {
+                while (*b == '\n' || *b == '\r') {
+                    *b = 0;
+                    b++;
+                }
+                if (*b) {
+                    p->next = calloc(1, sizeof(LibPath));
+                    p = p->next;
+                    p->path = b;
+                } else {
+                    break;
+                }
+            }
+            b++;
+        }
+    }
+}
+
 static void init(void) {
 #ifdef Debug_NRS
     time_t t;
@@ -2294,6 +4502,7 @@ static void init(void) {
     }
     localtmpdir[511] = '\0';
 #ifndef WIN32
+    use_ring = getenv("VIMR_SHM") != NULL;
     if (tmpdir[0] && !validate_dir(tmpdir)) {
         fprintf(stderr, "Unsafe tmpdir: %s\n", tmpdir);
         fflush(stderr);
@@ -2321,45 +4530,21 @@ static void init(void) {
         allnames = 1;
     else
         allnames = 0;
+    if (getenv("VIMR_OBJBR_STREAM"))
+        ob_stream = 1;
+    if (getenv("VIMR_OBJBR_INTERVAL"))
+        ob_interval = atoi(getenv("VIMR_OBJBR_INTERVAL"));
 
     // Fill immediately the list of installed libraries. Each entry still has
     // to be confirmed by listing the directories in .libPaths.
     fill_inst_libs();
 
-    // List tree sentinel
-    listTree = new_ListStatus("base:", 0);
+    // Status of lists in the Object Browser in the previous session
+    load_list_status();
 
     compl_buffer = calloc(compl_buffer_size, sizeof(char));
 
-    char fname[512];
-    snprintf(fname, 511, "%s/libPaths", tmpdir);
-    char *b = read_file(fname, 1);
-    if (b) {
-#ifdef WIN32
-        for (size_t i = 0, blen = strlen(b); i < blen; i++)
-            if (b[i] == '\\')
-                b[i] = '/';
-#endif
-        libpaths = calloc(1, sizeof(LibPath));
-        libpaths->path = b;
-        LibPath *p = libpaths;
-        while (*b) {
-            if (*b == '\n') {
-                while (*b == '\n' || *b == '\r') {
-                    *b = 0;
-                    b++;
-                }
-                if (*b) {
-                    p->next = calloc(1, sizeof(LibPath));
-                    p = p->next;
-                    p->path = b;
-                } else {
-                    break;
-                }
-            }
-            b++;
-        }
-    }
+    read_lib_paths();
     update_inst_libs();
     update_pkg_list(NULL);
     build_omnils();
@@ -2387,17 +4572,154 @@ int count_twice(const char *b1, const char *b2, const char ch) {
     return n1 == n2;
 }
 
+// Return the beginning of the line after the object at s in a buffer
+// processed by check_omils_buffer(), whose 7 fields end with a NUL byte
+static const char *next_omnils_line(const char *s) {
+    for (int i = 0; i < 7; i++)
+        s += strlen(s) + 1;
+    while (*s != '\n' && *s != 0)
+        s++;
+    if (*s == '\n')
+        s++;
+    return s;
+}
+
+// The arguments of functions in .GlobalEnv are only known after vimcom
+// evaluates them in R. Each request has an id that vimcom sends back with the
+// answer: answers to requests superseded by newer ones are not shown, and all
+// answers are cached until the list of objects in .GlobalEnv changes.
+#define ARGS_PENDING 8 // Requests waiting for an answer
+#define ARGS_CACHE 64  // Answers kept for the current .GlobalEnv
+
+typedef struct args_req_ {
+    unsigned id;  // Correlation id (0: free slot)
+    unsigned ver; // Value of glbnv_ver when the request was sent
+} ArgsReq;
+
+typedef struct args_ans_ {
+    char *fnm; // Function name
+    char *txt; // Arguments, quoted for g:FinishGlbEnvFunArgs()
+} ArgsAns;
+
+static ArgsReq args_req[ARGS_PENDING];
+static ArgsAns args_ans[ARGS_CACHE];
+static int args_nans;         // Number of cached answers
+static unsigned args_ans_ver; // Value of glbnv_ver of the cached answers
+static unsigned args_last_id; // Id of the last request
+static unsigned args_wanted;  // Id of the answer Vim is waiting for (0: none)
+
+static void args_show(const char *fnm, const char *txt) {
+    lock_stdout();
+    printf("\x11%" PRI_SIZET "\x11"
+           "call g:FinishGlbEnvFunArgs(\"%s\", \"%s\")\n",
+           strlen(fnm) + strlen(txt) + 34, fnm, txt);
+    fflush(stdout);
+    unlock_stdout();
+}
+
+static const char *args_cached(const char *fnm) {
+    if (args_ans_ver != glbnv_ver) {
+        for (int i = 0; i < args_nans; i++)
+            free(args_ans[i].fnm);
+        args_nans = 0;
+        args_ans_ver = glbnv_ver;
+    }
+    for (int i = 0; i < args_nans; i++)
+        if (strcmp(args_ans[i].fnm, fnm) == 0)
+            return args_ans[i].txt;
+    return NULL;
+}
+
+static void args_cache_add(const char *fnm, const char *txt) {
+    if (args_cached(fnm))
+        return;
+    if (args_nans == ARGS_CACHE) {
+        free(args_ans[0].fnm);
+        memmove(args_ans, args_ans + 1, (ARGS_CACHE - 1) * sizeof(ArgsAns));
+        args_nans--;
+    }
+    size_t n = strlen(fnm) + 1;
+    char *b = malloc(n + strlen(txt) + 1);
+    if (!b)
+        return;
+    strcpy(b, fnm);
+    strcpy(b + n, txt);
+    args_ans[args_nans].fnm = b;
+    args_ans[args_nans].txt = b + n;
+    args_nans++;
+}
+
+// Ask vimcom for the arguments of a function. Queued requests that were not
+// evaluated yet are replaced by this one.
+static void args_request(const char *fnm) {
+    int k = 0;
+    char msg[1024];
+
+    if (++args_last_id == 0)
+        args_last_id = 1;
+    for (int i = 0; i < ARGS_PENDING; i++) {
+        if (args_req[i].id == 0) {
+            k = i;
+            break;
+        }
+        if (args_req[i].id < args_req[k].id)
+            k = i;
+    }
+    args_req[k].id = args_last_id;
+    args_req[k].ver = glbnv_ver;
+    args_wanted = args_last_id;
+    snprintf(msg, sizeof(msg), "R%s%u %s", getenv("VIMR_ID"), args_last_id,
+             fnm);
+    send_to_vimcom(msg);
+}
+
+// Vim no longer waits for the arguments: drop the queued requests
+static void args_cancel(void) {
+    if (args_wanted) {
+        char msg[64];
+        args_wanted = 0;
+        snprintf(msg, sizeof(msg), "X%s", getenv("VIMR_ID"));
+        send_to_vimcom(msg);
+    }
+}
+
+// Answer from vimcom: "<id> <function name>\002<arguments>"
+static void args_answer(char *b) {
+    char *fnm, *txt;
+    unsigned long id = strtoul(b, &fnm, 10);
+    int k;
+
+    if (*fnm != ' ' || !(txt = strchr(fnm, '\002')))
+        return;
+    fnm++;
+    *txt = 0;
+    txt++;
+    for (k = 0; k < ARGS_PENDING; k++)
+        if (args_req[k].id && args_req[k].id == id)
+            break;
+    if (k == ARGS_PENDING)
+        return;
+    args_req[k].id = 0;
+    if (args_req[k].ver == glbnv_ver)
+        args_cache_add(fnm, txt);
+    if (id == args_wanted) {
+        args_wanted = 0;
+        args_show(fnm, txt);
+    }
+}
+
 // Return user_data of a specific item with function usage, title and
 // description to be displayed in the float window
 void completion_info(const char *wrd, const char *pkg) {
     int i;
     unsigned long nsz;
     const char *f[7];
-    char *s;
+    const char *s;
 
     if (strcmp(pkg, ".GlobalEnv") == 0) {
         s = glbnv_buffer;
     } else {
+        args_cancel();
         PkgData *pd = pkgList;
         while (pd) {
             if (strcmp(pkg, pd->name) == 0)
@@ -2430,13 +4752,18 @@ void completion_info(const char *wrd, const char *pkg) {
             if (*s == '\n')
                 s++;
 
-            if (f[1][0] == '\003' && str_here(f[4], "[\x12not_checked\x12]")) {
-                snprintf(compl_buffer, 1024,
-                         "E%svimcom:::vim.GlobalEnv.fun.args(\"%s\")\n",
-                         getenv("VIMR_ID"), wrd);
-                send_to_vimcom(compl_buffer);
+            // check_omils_buffer() replaced the \x12 quotes with '
+            if (f[1][0] == '\003' && str_here(f[4], "['not_checked']")) {
+                const char *txt = args_cached(wrd);
+                if (txt) {
+                    args_cancel();
+                    args_show(wrd, txt);
+                } else {
+                    args_request(wrd);
+                }
                 return;
             }
+            args_cancel();
 
             // Avoid buffer overflow if the information is bigger than
             // compl_buffer.
@@ -2474,11 +4801,9 @@ void completion_info(const char *wrd, const char *pkg) {
             unlock_stdout();
             return;
         }
-        while (*s != '\n' && *s)
-            s++;
-        if (*s)
-            s++;
+        s = next_omnils_line(s);
     }
+    args_cancel();
     lock_stdout();
     {
         size_t msg_len = strlen(compl_info) + 4;
@@ -2588,10 +4913,7 @@ char *parse_omnils(const char *s, const char *base, const char *pkg, char *p) {
             p = str_cat(p, "'}}, "); // Don't include fields 4, 5 and 6 because
                                      // big data will be truncated.
         } else {
-            while (*s != '\n' && *s)
-                s++;
-            if (*s)
-                s++;
+            s = next_omnils_line(s);
         }
     }
     return p;
@@ -2712,6 +5034,13 @@ void complete(const char *id, char *base, char *funcnm, char *args) {
         *base = 0;
         base++;
         base++;
+
+        // The user wants this package now: build it before the others
+        PkgData *tp = get_pkg(pkg);
+        if (tp && !tp->omnils && tp->priority < BP_HIGH) {
+            tp->priority = BP_HIGH;
+            preempt_build(tp);
+        }
     }
 
     while (pd) {
@@ -2729,14 +5058,50 @@ void complete(const char *id, char *base, char *funcnm, char *args) {
     unlock_stdout();
 }
 
+// Read a line from stdin into a buffer that grows as needed (Vim may send
+// big messages to vimcom). Lines too long are skipped. Return 0 at the end
+// of the input.
+static int read_line(char **line, size_t *sz) {
+    size_t len = 0;
+    int skip = 0;
+    for (;;) {
+        if (*sz - len < 2) {
+            if (*sz > MSG_MAX) {
+                skip = 1; // Discard the rest of the line
+                len = 0;
+            } else {
+                char *tmp = realloc(*line, *sz * 2);
+                if (!tmp) {
+                    skip = 1;
+                    len = 0;
+                } else {
+                    *line = tmp;
+                    *sz *= 2;
+                }
+            }
+        }
+        if (!fgets(*line + len, (int)(*sz - len), stdin))
+            return len > 0 && !skip;
+        len += strlen(*line + len);
+        if (len && (*line)[len - 1] == '\n') {
+            if (!skip)
+                return 1;
+            fprintf(stderr, "Line from Vim too long\n");
+            fflush(stderr);
+            skip = 0;
+            len = 0;
+        }
+    }
+}
+
 void stdin_loop() {
-    char line[1024];
+    size_t lsz = 1024;
+    char *line = malloc(lsz);
     FILE *f;
     char *msg;
     char t;
-    memset(line, 0, 1024);
 
-    while (fgets(line, 1023, stdin)) {
+    while (line && read_line(&line, &lsz)) {
 
         for (unsigned int i = 0; line[i]; i++)
             if (line[i] == '\n' || line[i] == '\r')
@@ -2758,10 +5123,14 @@ void stdin_loop() {
             switch (*msg) {
             case '1': // Update GlobalEnv
                 auto_obbr = 1;
+                ob_view_glbenv = 1;
+                ob_glbenv.sent = 0; // The Object Browser was opened or reset
                 omni2ob();
                 break;
             case '2': // Update Libraries
                 auto_obbr = 1;
+                ob_view_glbenv = 0;
+                ob_libs.sent = 0;
                 lib2ob();
                 break;
             case '3': // Open/Close list
@@ -2777,18 +5146,33 @@ void stdin_loop() {
             case '4': // Close/Open all
                 msg++;
                 if (*msg == 'O')
-                    change_all(listTree, 1);
+                    change_all(1);
                 else
-                    change_all(listTree, 0);
+                    change_all(0);
                 msg++;
                 if (*msg == 'G')
                     omni2ob();
                 else
                     lib2ob();
                 break;
+            case '5': // Filter: "G|L" + "p|s|f" (prefix, substring, fuzzy)
+                      // + pattern. Without pattern, remove the filter.
+                msg++;
+                t = *msg;
+                msg++;
+                ob_set_filter(t == 'G' ? &obf_glbenv : &obf_libs, msg);
+                if (t == 'G')
+                    omni2ob();
+                else
+                    lib2ob();
+                break;
+            case '8': // Rows visible in the Object Browser: "first,last"
+                msg++;
+                ob_scroll(msg);
+                break;
             case '7':
                 f = fopen("/tmp/listTree", "w");
-                print_listTree(listTree, f);
+                print_list_status(f);
                 fclose(f);
                 break;
             }
@@ -2809,6 +5193,10 @@ void stdin_loop() {
                 if (auto_obbr)
                     omni2ob();
                 break;
+            case '4': // Libraries loaded in the buffer
+                msg++;
+                set_build_priorities(msg);
+                break;
             }
             unlock_state();
             break;
@@ -2902,6 +5290,8 @@ void stdin_loop() {
             break;
 #endif
         case '9': // Quit now
+            save_list_status();
+            remove_socket_file();
             exit(0);
             break;
         default:
@@ -2910,19 +5300,322 @@ void stdin_loop() {
             fflush(stderr);
             break;
         }
-        memset(line, 0, 1024);
     }
 }
 
+// Batch mode: vimrserver --build-cache [--jobs N] [--all | pkg ...]
+//
+// Build the omnils_, args_ and fun_ files of installed libraries without Vim,
+// running up to N instances of R in parallel.
+
+static void set_env(const char *nm, const char *vl) {
+#ifdef WIN32
+    char *b = malloc(strlen(nm) + strlen(vl) + 2);
+    sprintf(b, "%s=%s", nm, vl);
+    putenv(b); // The string becomes part of the environment
+#else
+    setenv(nm, vl, 1);
+#endif
+}
+
+static int make_batch_tmpdir(void) {
+#ifdef WIN32
+    const char *t = getenv("TEMP");
+    snprintf(tmpdir, 511, "%s/vimrserver-%d", t ? t : ".", getpid());
+    for (char *p = tmpdir; *p; p++)
+        if (*p == '\\')
+            *p = '/';
+    return mkdir(tmpdir) == 0;
+#else
+    const char *t = getenv("TMPDIR");
+    snprintf(tmpdir, 511, "%s/vimrserver-XXXXXX", t && *t ? t : "/tmp");
+    return mkdtemp(tmpdir) != NULL;
+#endif
+}
+
+static void remove_batch_tmpdir(void) {
+    char fname[1024];
+    struct dirent *dir;
+    DIR *d = opendir(tmpdir);
+    if (d) {
+        while ((dir = readdir(d)) != NULL) {
+            if (dir->d_name[0] == '.')
+                continue;
+            snprintf(fname, 1023, "%s/%s", tmpdir, dir->d_name);
+            unlink(fname);
+        }
+        closedir(d);
+    }
+    rmdir(tmpdir);
+}
+
+// Are the omnils_ or args_ files of an installed library missing or outdated?
+// The fun_ file isn't checked because it is created without running R.
+static int cache_is_stale(InstLibs *il, time_t readme_mtime) {
+    char buf[1024];
+    struct stat st;
+
+    snprintf(buf, 1023, "%s/args_%s_%s", compldir, il->name, il->version);
+    if (access(buf, F_OK) != 0)
+        return 1;
+    snprintf(buf, 1023, "%s/omnils_%s_%s", compldir, il->name, il->version);
+    if (stat(buf, &st) != 0)
+        return 1;
+    return st.st_mtime < readme_mtime;
+}
+
+// R code to build the cache files of n libraries. Each library is built
+// within try() to let the others be built if one of them fails to load.
+static char *worker_code(InstLibs **libs, int n) {
+    size_t sz = 128;
+    for (int i = 0; i < n; i++)
+        sz += strlen(libs[i]->name) + 8;
+    char *b = calloc(sz, sizeof(char));
+    char *p = str_cat(b, "library('vimcom')\np <- c(");
+    for (int i = 0; i < n; i++) {
+        if (i)
+            p = str_cat(p, ",\n  ");
+        p = str_cat(p, "'");
+        p = str_cat(p, libs[i]->name);
+        p = str_cat(p, "'");
+    }
+    str_cat(p, ")\nfor (pkg in p)\n    try(vimcom:::vim.buildomnils(pkg))\n");
+    return b;
+}
+
+// Build the cache files of n libraries with up to jobs instances of R. Each
+// instance receives a small chunk of the list to balance the load.
+static void run_cache_workers(InstLibs **libs, int n, int jobs) {
+#ifdef WIN32
+    // No fork() on Windows: build everything with a single instance of R.
+    char *code = worker_code(libs, n);
+    for (int i = 0; i < n; i++)
+        printf("Building cache for %s\n", libs[i]->name);
+    fflush(stdout);
+    run_R_code(code, 0);
+    free(code);
+#else
+    char fnm[1024], outfnm[1024];
+    int chunk = n / (jobs * 4);
+    int next = 0;
+    int running = 0;
+    pid_t *pid = calloc(jobs, sizeof(pid_t));
+
+    if (chunk < 1)
+        chunk = 1;
+    for (;;) {
+        for (int i = 0; i < jobs && next < n; i++) {
+            if (pid[i])
+                continue;
+            int k = n - next < chunk ? n - next : chunk;
+            snprintf(fnm, 1023, "%s/bc_code_%d.R", tmpdir, i);
+            snprintf(outfnm, 1023, "%s/bc_stdout_%d", tmpdir, i);
+            FILE *f = fopen(fnm, "w");
+            if (!f) {
+                fprintf(stderr, "Failed to write \"%s\"\n", fnm);
+                fflush(stderr);
+                next = n;
+                break;
+            }
+            char *code = worker_code(libs + next, k);
+            fwrite(code, sizeof(char), strlen(code), f);
+            fclose(f);
+            free(code);
+
+            pid[i] = spawn_R(fnm, outfnm, NULL);
+            if (pid[i] < 0) {
+                pid[i] = 0;
+                next = n;
+                break;
+            }
+            for (int j = next; j < next + k; j++)
+                printf("Building cache for %s\n", libs[j]->name);
+            fflush(stdout);
+            next += k;
+            running++;
+        }
+        if (running == 0)
+            break;
+
+        int status;
+        pid_t p = waitpid(-1, &status, 0);
+        if (p < 0)
+            break;
+        for (int i = 0; i < jobs; i++) {
+            if (pid[i] == p) {
+                pid[i] = 0;
+                running--;
+                break;
+            }
+        }
+    }
+    free(pid);
+#endif
+}
+
+static int build_cache(int argc, char **argv) {
+    char buf[1024];
+    int jobs = 0;
+    int all = 0;
+    int nsel = 0;
+    int nfail = 0;
+    int i;
+
+    for (i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            jobs = atoi(argv[++i]);
+            if (jobs < 1) {
+                fprintf(stderr, "Invalid number of jobs: %s\n", argv[i]);
+                return 2;
+            }
+        } else if (strcmp(argv[i], "--all") == 0) {
+            all = 1;
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "Usage: vimrserver --build-cache [--jobs N] "
+                            "[--all | pkg ...]\n");
+            return 2;
+        } else {
+            nsel++;
+        }
+    }
+#ifndef WIN32
+    if (jobs == 0)
+        jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (jobs < 1)
+        jobs = 1;
+
+    if (!getenv("VIMR_COMPLDIR")) {
+        fprintf(stderr, "VIMR_COMPLDIR is not set\n");
+        return 1;
+    }
+    strncpy(compldir, getenv("VIMR_COMPLDIR"), 511);
+    compldir[511] = '\0';
+
+    // vim-rr deletes all cache files if the README is missing or outdated.
+    struct stat st;
+    snprintf(buf, 1023, "%s/README", compldir);
+    if (stat(buf, &st) != 0) {
+        fprintf(stderr,
+                "\"%s\" not found. Start vim-rr once to create the cache "
+                "directory.\n",
+                buf);
+        return 1;
+    }
+    time_t readme_mtime = st.st_mtime;
+
+    if (!make_batch_tmpdir()) {
+        fprintf(stderr, "Failed to create a temporary directory\n");
+        return 1;
+    }
+    strcpy(localtmpdir, tmpdir);
+    if (!getenv("VIMR_RPATH"))
+        set_env("VIMR_RPATH", "R");
+    set_env("VIMR_TMPDIR", tmpdir);
+    set_env("VIMR_REMOTE_TMPDIR", tmpdir);
+    set_env("VIMR_REMOTE_COMPLDIR", compldir);
+
+    // Save the library paths as before_nrs.R does
+    run_R_code(
+        "libp <- unique(c(unlist(strsplit(Sys.getenv('R_LIBS_USER'),\n"
+        "                                 .Platform$path.sep)), .libPaths()))\n"
+        "if (file.access(R.home(), mode = 2) == 0)\n"
+        "    libp <- unique(c(file.path(R.home(), 'site-library'), libp))\n"
+        "cat(libp, sep = '\\n', file = file.path(Sys.getenv('VIMR_TMPDIR'), "
+        "'libPaths'))\n",
+        0);
+    read_lib_paths();
+    if (!libpaths) {
+        fprintf(stderr, "Failed to get the library paths from R\n");
+        remove_batch_tmpdir();
+        return 1;
+    }
+
+    // Read the DESCRIPTION of all installed libraries and update inst_libs.
+    update_inst_libs();
+
+    // Select the libraries and find the ones whose cache is stale
+    int nlibs = 0;
+    InstLibs *il = instlibs;
+    while (il) {
+        nlibs++;
+        il = il->next;
+    }
+    InstLibs **sel = calloc(nlibs + 1, sizeof(InstLibs *));
+    InstLibs **todo = calloc(nlibs + 1, sizeof(InstLibs *));
+    int n = 0;
+    if (nsel && !all) {
+        for (i = 2; i < argc; i++) {
+            if (argv[i][0] == '-') {
+                if (strcmp(argv[i], "--jobs") == 0)
+                    i++;
+                continue;
+            }
+            il = instlibs;
+            while (il && strcmp(il->name, argv[i]) != 0)
+                il = il->next;
+            if (il && il->version) {
+                sel[n++] = il;
+            } else {
+                fprintf(stderr, "Library not installed: %s\n", argv[i]);
+                nfail++;
+            }
+        }
+    } else {
+        il = instlibs;
+        while (il) {
+            if (il->version)
+                sel[n++] = il;
+            il = il->next;
+        }
+    }
+
+    int ntodo = 0;
+    for (i = 0; i < n; i++)
+        if (cache_is_stale(sel[i], readme_mtime))
+            todo[ntodo++] = sel[i];
+
+    printf("%d of %d libraries need their cache files built\n", ntodo, n);
+    fflush(stdout);
+    if (ntodo)
+        run_cache_workers(todo, ntodo, jobs);
+
+    // Create the missing fun_ files from the omnils_ ones
+    for (i = 0; i < n; i++) {
+        if (cache_is_stale(sel[i], readme_mtime)) {
+            fprintf(stderr, "Failed to build the cache for %s\n", sel[i]->name);
+            nfail++;
+            continue;
+        }
+        snprintf(buf, 1023, "%s/fun_%s_%s", compldir, sel[i]->name,
+                 sel[i]->version);
+        if (access(buf, F_OK) != 0) {
+            PkgData *pd = new_pkg_data(sel[i]->name, sel[i]->version);
+            load_pkg_data(pd);
+            pkg_delete(pd);
+        }
+    }
+
+    free(sel);
+    free(todo);
+    remove_batch_tmpdir();
+    return nfail ? 1 : 0;
+}
+
 int main(int argc, char **argv) {
 #ifdef WIN32
     InitializeCriticalSection(&stdout_mutex);
     InitializeCriticalSection(&state_mutex);
+    InitializeCriticalSection(&conn_mutex);
+    InitializeConditionVariable(&ob_cond);
 #endif
+    if (argc > 1 && strcmp(argv[1], "--build-cache") == 0)
+        return build_cache(argc, argv);
     init();
 #ifdef WIN32
     Windows_setup();
 #endif
     stdin_loop();
+    remove_socket_file();
     return 0;
 }
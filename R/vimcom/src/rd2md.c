@@ -390,12 +390,8 @@ static void pre_rd_md(char **b1, char **b2, char *maxp) {
     *p1 = 0;
 }
 
-SEXP rd2md(SEXP txt) {
-    if (Rf_isNull(txt))
-        return R_NilValue;
-
-    const char *s = CHAR(STRING_ELT(txt, 0));
-
+// Convert the Rd string `s` into markdown. The returned string must be freed.
+static char *rd2md_str(const char *s) {
     // \R is the only command that expands for more characters than the
     // command itself: from two (\R) to three (*R*), but string2 might be much
     // longer than string1 in \href{string1}{string2}. We decrease the risk of
@@ -494,21 +490,27 @@ SEXP rd2md(SEXP txt) {
         p1++;
     }
 
+    free(a);
+    return b;
+}
+
+SEXP rd2md(SEXP txt) {
+    if (Rf_isNull(txt))
+        return R_NilValue;
+
+    char *b = rd2md_str(CHAR(STRING_ELT(txt, 0)));
+
     SEXP ans;
     PROTECT(ans = NEW_CHARACTER(1));
     SET_STRING_ELT(ans, 0, mkChar(b));
     UNPROTECT(1);
-    free(a);
     free(b);
     return ans;
 }
 
-SEXP get_section(SEXP rtxt, SEXP rsec) {
-    if (Rf_isNull(rtxt) || Rf_isNull(rsec))
-        return R_NilValue;
-
-    const char *str = CHAR(STRING_ELT(rtxt, 0));
-    const char *sec = CHAR(STRING_ELT(rsec, 0));
+// Get the contents of the section `sec` of the Rd string `str`. The returned
+// string (empty if the section was not found) must be freed.
+static char *find_section(const char *str, const char *sec) {
     char *a = calloc(sizeof(char), (strlen(str) + 1));
     char *b = malloc(sizeof(char) * (strlen(str) + 1));
     strcpy(b, str);
@@ -544,6 +546,16 @@ SEXP get_section(SEXP rtxt, SEXP rsec) {
             p++;
         }
     }
+    free(b);
+    return a;
+}
+
+SEXP get_section(SEXP rtxt, SEXP rsec) {
+    if (Rf_isNull(rtxt) || Rf_isNull(rsec))
+        return R_NilValue;
+
+    char *a =
+        find_section(CHAR(STRING_ELT(rtxt, 0)), CHAR(STRING_ELT(rsec, 0)));
 
     SEXP ans = R_NilValue;
     if (*a) {
@@ -553,6 +565,249 @@ SEXP get_section(SEXP rtxt, SEXP rsec) {
         UNPROTECT(2);
     }
     free(a);
-    free(b);
     return ans;
 }
+
+// Output buffer of vimcom_build_args()
+typedef struct args_buf_ {
+    char *b;
+    size_t len;
+    size_t size;
+    int failed;
+} ArgsBuf;
+
+static void abuf_cat(ArgsBuf *o, const char *s, size_t n) {
+    if (o->failed)
+        return;
+    if (o->len + n + 1 > o->size) {
+        size_t nsz = o->size;
+        while (o->len + n + 1 > nsz)
+            nsz *= 2;
+        char *tmp = realloc(o->b, nsz);
+        if (!tmp) {
+            o->failed = 1;
+            return;
+        }
+        o->b = tmp;
+        o->size = nsz;
+    }
+    memcpy(o->b + o->len, s, n);
+    o->len += n;
+    o->b[o->len] = 0;
+}
+
+// Append `s` escaped as vim.fix.string() does
+static void abuf_cat_fixed(ArgsBuf *o, const char *s) {
+    const char *p = s;
+    while (*p) {
+        const char *r = NULL;
+        switch (*p) {
+        case '\n':
+            r = "\\n";
+            break;
+        case '\r':
+            r = "\\r";
+            break;
+        case '\t':
+            r = "\\t";
+            break;
+        case '\'':
+            r = "\x13";
+            break;
+        case '"':
+            r = "\\\"";
+            break;
+        }
+        if (r) {
+            abuf_cat(o, s, p - s);
+            abuf_cat(o, r, strlen(r));
+            s = p + 1;
+        }
+        p++;
+    }
+    abuf_cat(o, s, p - s);
+}
+
+// An \item{names}{description} of an \arguments section
+typedef struct rd_item_ {
+    int nm;    // offset of names
+    int nmlen; // length of names
+    int it;    // offset of the whole \item
+    int itlen; // length of the whole \item
+} RdItem;
+
+// The \arguments section of an Rd file, parsed only once even if the Rd file
+// documents many functions
+typedef struct rd_args_ {
+    int parsed;
+    char *sec;
+    int n;
+    RdItem *item;
+} RdArgs;
+
+static void parse_rd_args(RdArgs *ra, const char *rdtxt) {
+    int nalloc = 0;
+    ra->parsed = 1;
+    ra->sec = find_section(rdtxt, "arguments");
+    char *p = ra->sec;
+    int depth = 0;
+    while (*p) {
+        if (*p == '\\' && depth == 0 && str_here(p, "\\item{")) {
+            char *s = p;
+            p += 6;
+            int i = find_matching_bracket(p);
+            if (p[i] != '}')
+                break;
+            int nm = p - ra->sec;
+            int nmlen = i;
+            p += i + 1;
+            if (*p != '{')
+                continue;
+            p++;
+            i = find_matching_bracket(p);
+            if (p[i] != '}')
+                break;
+            p += i + 1;
+            if (ra->n == nalloc) {
+                nalloc = nalloc ? 2 * nalloc : 16;
+                RdItem *tmp = realloc(ra->item, nalloc * sizeof(RdItem));
+                if (!tmp)
+                    break;
+                ra->item = tmp;
+            }
+            ra->item[ra->n].nm = nm;
+            ra->item[ra->n].nmlen = nmlen;
+            ra->item[ra->n].it = s - ra->sec;
+            ra->item[ra->n].itlen = p - s;
+            ra->n++;
+            continue;
+        }
+        if (*p == '\\' && p[1])
+            p++;
+        else if (*p == '{')
+            depth++;
+        else if (*p == '}')
+            depth--;
+        p++;
+    }
+}
+
+// Check if `arg` is one of the comma separated names of an \item
+static int item_has_arg(const char *nm, int len, const char *arg) {
+    const char *e = nm + len;
+    size_t alen = strlen(arg);
+    int isdots = strcmp(arg, "...") == 0;
+    while (nm < e) {
+        while (nm < e && (*nm == ' ' || *nm == '\n' || *nm == '\t'))
+            nm++;
+        const char *q = nm;
+        while (q < e && *q != ',')
+            q++;
+        const char *r = q;
+        while (r > nm && (r[-1] == ' ' || r[-1] == '\n' || r[-1] == '\t'))
+            r--;
+        size_t n = r - nm;
+        if (n == alen && strncmp(nm, arg, n) == 0)
+            return 1;
+        if (isdots && ((n == 5 && strncmp(nm, "\\dots", 5) == 0) ||
+                       (n == 6 && strncmp(nm, "\\ldots", 6) == 0)))
+            return 1;
+        nm = q + 1;
+    }
+    return 0;
+}
+
+// Append the description of the argument `arg` from the \arguments section.
+static void add_arg_descr(ArgsBuf *o, ArgsBuf *tmp, RdArgs *ra,
+                          const char *arg) {
+    tmp->len = 0;
+    if (tmp->b)
+        tmp->b[0] = 0;
+    for (int k = 0; k < ra->n; k++) {
+        if (item_has_arg(ra->sec + ra->item[k].nm, ra->item[k].nmlen, arg)) {
+            if (tmp->len)
+                abuf_cat(tmp, " ", 1);
+            abuf_cat(tmp, ra->sec + ra->item[k].it, ra->item[k].itlen);
+        }
+    }
+    if (tmp->len == 0 || tmp->failed)
+        return;
+    char *md = rd2md_str(tmp->b);
+    abuf_cat_fixed(o, md);
+    free(md);
+}
+
+/*
+ * Build the args_ file of a library. The Rd database is read only once by
+ * vim.buildargs() which sends here the Rd text of each documentation page.
+ *
+ * afile: full path of the args_ file.
+ * objs:  names of functions.
+ * argl:  list with the names of the arguments of each function.
+ * rdidx: index of the Rd text of each function in `rdtxt` (NA if the
+ *        function is not documented).
+ * rdtxt: Rd text of the documentation pages of the library.
+ */
+SEXP vimcom_build_args(SEXP afile, SEXP objs, SEXP argl, SEXP rdidx,
+                       SEXP rdtxt) {
+    int nrd = length(rdtxt);
+    RdArgs *cache = calloc(nrd ? nrd : 1, sizeof(RdArgs));
+    ArgsBuf o = {malloc(65536), 0, 65536, 0};
+    ArgsBuf tmp = {malloc(4096), 0, 4096, 0};
+    if (!cache || !o.b || !tmp.b) {
+        free(cache);
+        free(o.b);
+        free(tmp.b);
+        REprintf("vimcom: malloc failed in vimcom_build_args\n");
+        return ScalarInteger(-1);
+    }
+    o.b[0] = 0;
+
+    int n = length(objs);
+    for (int i = 0; i < n; i++) {
+        const char *obj = CHAR(STRING_ELT(objs, i));
+        abuf_cat(&o, obj, strlen(obj));
+        abuf_cat(&o, "\006", 1);
+        int j = INTEGER(rdidx)[i];
+        if (j != NA_INTEGER && j > 0 && j <= nrd) {
+            RdArgs *ra = &cache[j - 1];
+            if (!ra->parsed)
+                parse_rd_args(ra, CHAR(STRING_ELT(rdtxt, j - 1)));
+            SEXP args = VECTOR_ELT(argl, i);
+            for (int k = 0; k < length(args); k++) {
+                const char *arg = CHAR(STRING_ELT(args, k));
+                if (k)
+                    abuf_cat(&o, "\006", 1);
+                abuf_cat(&o, arg, strlen(arg));
+                abuf_cat(&o, "\005", 1);
+                add_arg_descr(&o, &tmp, ra, arg);
+            }
+        }
+        abuf_cat(&o, "\006\n", 2);
+    }
+
+    for (int i = 0; i < nrd; i++) {
+        free(cache[i].sec);
+        free(cache[i].item);
+    }
+    free(cache);
+    free(tmp.b);
+
+    if (o.failed) {
+        free(o.b);
+        REprintf("vimcom: not enough memory to build args_\n");
+        return ScalarInteger(-1);
+    }
+
+    const char *fnm = CHAR(STRING_ELT(afile, 0));
+    FILE *f = fopen(fnm, "w");
+    if (!f) {
+        free(o.b);
+        REprintf("vimcom: could not write \"%s\"\n", fnm);
+        return ScalarInteger(-1);
+    }
+    fwrite(o.b, sizeof(char), o.len, f);
+    fclose(f);
+    free(o.b);
+    return ScalarInteger(n);
+}
@@ -8,6 +8,8 @@
 #endif
 
 #include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -28,11 +30,15 @@
 #endif
 #else
 #include <arpa/inet.h> // inet_addr()
+#include <fcntl.h>
 #include <netdb.h>
+#include <netinet/tcp.h> // TCP_NODELAY
 #include <pthread.h>
 #include <signal.h>
-#include <stdint.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #endif
 
 #ifndef WIN32
@@ -56,6 +62,8 @@ static int allnames = 0; // Show hidden objects in omni completion and
                          // Object Browser?
 static int nlibs = 0;    // Number of loaded libraries.
 static int needs_lib_msg = 0;    // Did the number of libraries change?
+static unsigned lib_gen = 0;     // Generation of the list of libraries last
+                                 // sent to vimrserver.
 static int needs_glbenv_msg = 0; // Did .GlobalEnv change?
 
 static char nrs_port[16]; // vimrserver port.
@@ -65,12 +73,30 @@ static char *glbnvbuf1;   // Temporary buffer used to store the list of
                           // .GlobalEnv objects.
 static char *glbnvbuf2;   // Temporary buffer used to store the list of
                           // .GlobalEnv objects.
-static char *send_ge_buf; // Temporary buffer used to store the list of
-                          // .GlobalEnv objects.
+static char *send_ge_buf; // Temporary buffer used to store the message with
+                          // the changes in the list of .GlobalEnv objects.
+static size_t send_ge_bufsz; // Size of send_ge_buf.
 
 static unsigned long lastglbnvbsz;         // Previous size of glbnvbuf2.
 static unsigned long glbnvbufsize = 32768; // Current size of glbnvbuf2.
 
+/**
+ * @brief Offsets of the top-level objects in glbnvbuf1 or glbnvbuf2. Each
+ * object is followed by the lines of its elements.
+ */
+typedef struct glbnv_blocks_ {
+    size_t *off; // Offset of the first line of each object.
+    int n;       // Number of objects.
+    int size;    // Allocated number of offsets.
+    int failed;  // Did a memory allocation fail?
+} GlbnvBlocks;
+
+static GlbnvBlocks glbnvblk1; // Objects in glbnvbuf1.
+static GlbnvBlocks glbnvblk2; // Objects in glbnvbuf2.
+static unsigned glbenv_gen;   // Generation of the list last sent to
+                              // vimrserver (0: none).
+static int glbenv_resync;     // Did vimrserver ask for the whole list?
+
 static unsigned long tcp_header_len; // Lenght of vimsecr + 9. Stored in a
                                      // variable to avoid repeatedly calling
                                      // strlen().
@@ -93,6 +119,10 @@ static int setwidth = 0; // Set the option width after each command is executed
 static int oldcolwd = 0; // Last set width.
 
 static int flag_glbenv = 0; // Do we have to list objects from .GlobalEnv?
+static int flag_resume = 0; // Did vimrserver tell what it has after a
+                            // reconnection?
+static unsigned srv_lib_gen; // Generations of the lists of libraries and of
+static unsigned srv_glb_gen; // objects that vimrserver has.
 #ifndef WIN32
 static int flag_debug = 0; // Do we need to get file name and line information
                            // of debugging function?
@@ -109,12 +139,14 @@ static pthread_mutex_t flag_mutex = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
 // Linked-list queue for deferred eval commands. Commands are enqueued by the
-// TCP thread (case 'E' / 'L') and drained by vimcom_task (Windows) or
+// TCP thread (case 'E' / 'L' / 'R' / 'S') and drained by vimcom_task (Windows) or
 // vimcom_exec (Unix) on the main R thread.
-#define MAX_EVAL_CMD 65536
+#define MAX_EVAL_CMD 67108864 // Big code is received in parts (see below).
 
 typedef struct eval_node {
     struct eval_node *next;
+    unsigned long req; // Id of the request from vimrserver (0: none)
+    char kind;         // 'E': expression; 'S': code to be sourced
     char cmd[]; // flexible array member — allocated inline with node
 } eval_node_t;
 
@@ -124,26 +156,55 @@ static eval_node_t *eval_tail = NULL;
 /**
  * @brief Enqueue a command for deferred execution.
  * Must be called under FLAG_LOCK.
+ *
+ * @return The new node or NULL on failure.
  */
-static void eval_queue_push(const char *cmd) {
+static eval_node_t *eval_queue_push(const char *cmd) {
     size_t len = strlen(cmd);
     if (len > MAX_EVAL_CMD) {
         REprintf("vimcom: command too long (%zu bytes, max %d)\n", len,
                  MAX_EVAL_CMD);
-        return;
+        return NULL;
     }
     eval_node_t *node = malloc(sizeof(eval_node_t) + len + 1);
     if (!node) {
         REprintf("vimcom: malloc failed for eval queue node\n");
-        return;
+        return NULL;
     }
     memcpy(node->cmd, cmd, len + 1);
     node->next = NULL;
+    node->req = 0;
+    node->kind = 'E';
     if (eval_tail)
         eval_tail->next = node;
     else
         eval_head = node;
     eval_tail = node;
+    return node;
+}
+
+/**
+ * @brief Remove from the queue the requests from vimrserver that were not
+ * evaluated yet. Must be called under FLAG_LOCK.
+ */
+static void eval_queue_drop_requests(void) {
+    eval_node_t *prev = NULL;
+    eval_node_t *node = eval_head;
+    while (node) {
+        eval_node_t *next = node->next;
+        if (node->req) {
+            if (prev)
+                prev->next = next;
+            else
+                eval_head = next;
+            if (eval_tail == node)
+                eval_tail = prev;
+            free(node);
+        } else {
+            prev = node;
+        }
+        node = next;
+    }
 }
 
 /**
@@ -205,6 +266,7 @@ typedef struct lib_info_ {
 static LibInfo *libList; // Linked list of loaded libraries information (names
                          // and version numbers).
 
+SEXP rd2md(SEXP txt); // Defined in rd2md.c.
 static void vimcom_checklibs(void);
 static void send_to_vim(char *msg);
 static void vimcom_eval_expr(const char *buf);
@@ -220,6 +282,18 @@ static int sfd = -1;  // File descriptor of socket used in the TCP connection
 static pthread_t tid; // Identifier of thread running TCP connection loop.
 #endif
 
+// If the connection is lost while R is running, client_loop_thread() tries to
+// connect again to the same address for up to RECONNECT_MAX seconds. The
+// first message of each connection is "+H<session>", and vimrserver answers
+// with the generations of the lists of libraries and of objects that it got
+// from this session, so that only the lists that changed are sent again.
+#define RECONNECT_MAX 60
+static struct sockaddr_in srv_addr; // TCP address of vimrserver.
+static int srv_local;               // Connected to the Unix domain socket?
+static char session[64];            // Identifier of this R session.
+static int stopping;                // Was vimcom_Stop() called?
+static int resuming;                // Reconnected and waiting for 'H'?
+
 static void escape_str(char *s) {
     while (*s) {
         if (*s == '\n')
@@ -252,14 +326,12 @@ static char *vimcom_strcat(char *dest, const char *src) {
 static char *vimcom_grow_buffers(void) {
     unsigned long new_size = glbnvbufsize + 32768;
 
-    // Allocate all three buffers atomically — commit or roll back
+    // Allocate both buffers atomically — commit or roll back
     char *new1 = (char *)calloc(new_size, sizeof(char));
     char *new2 = (char *)calloc(new_size, sizeof(char));
-    char *new3 = (char *)calloc(new_size + 64, sizeof(char));
-    if (!new1 || !new2 || !new3) {
+    if (!new1 || !new2) {
         free(new1);
         free(new2);
-        free(new3);
         REprintf("vimcom: grow_buffers failed\n");
         return (glbnvbuf2 + strlen(glbnvbuf2));
     }
@@ -272,28 +344,536 @@ static char *vimcom_grow_buffers(void) {
     free(glbnvbuf2);
     glbnvbuf2 = new2;
 
-    free(send_ge_buf);
-    send_ge_buf = new3;
-
     lastglbnvbsz = glbnvbufsize;
     glbnvbufsize = new_size;
     return (glbnvbuf2 + strlen(glbnvbuf2));
 }
 
+// Messages to vimrserver are framed on the calling thread and written to the
+// socket by sender_thread(), so that R never waits for a busy vimrserver.
+typedef struct send_node {
+    struct send_node *next;
+    char kind;  // 'G': list of objects in .GlobalEnv; 'L': list of
+                // libraries; 0: anything else.
+    unsigned long long ring_prev; // ring_head before the message was written
+    unsigned long long ring_end;  // Position after the message in the ring
+                                  // (0: the message is in buf).
+    size_t len; // Length of the framed message.
+    char buf[]; // Header, message and final \x11.
+} send_node_t;
+
+#define SEND_QUEUE_MAX 67108864 // Maximum number of bytes waiting to be sent.
+
+static send_node_t *sq_head = NULL;
+static send_node_t *sq_tail = NULL;
+static size_t sq_bytes = 0; // Number of bytes in the queue.
+static int sq_stop = 0;     // Should sender_thread() quit?
+static int sq_dead = 1;     // Is the sender not running or the socket broken?
+static int sq_started = 0;  // Was sender_thread() started?
+static int sq_busy = 0;     // Is sender_thread() writing to the socket?
+
+#ifdef WIN32
+static CRITICAL_SECTION sq_mutex;
+static HANDLE sq_event; // Auto-reset event signaled when a message is queued.
+static HANDLE sq_tid;   // Identifier of thread sending messages.
+#define SQ_LOCK() EnterCriticalSection(&sq_mutex)
+#define SQ_UNLOCK() LeaveCriticalSection(&sq_mutex)
+#define SQ_SIGNAL() SetEvent(sq_event)
+#define SQ_WAIT()                                                              \
+    do {                                                                       \
+        LeaveCriticalSection(&sq_mutex);                                       \
+        WaitForSingleObject(sq_event, INFINITE);                               \
+        EnterCriticalSection(&sq_mutex);                                       \
+    } while (0)
+#else
+static pthread_mutex_t sq_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sq_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t sq_tid; // Identifier of thread sending messages.
+#define SQ_LOCK() pthread_mutex_lock(&sq_mutex)
+#define SQ_UNLOCK() pthread_mutex_unlock(&sq_mutex)
+#define SQ_SIGNAL() pthread_cond_signal(&sq_cond)
+#define SQ_WAIT() pthread_cond_wait(&sq_cond, &sq_mutex)
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// With a remote vimrserver ($VIMR_IP_ADDRESS), the messages queued during a
+// short tick are sent together and the big ones are compressed.
+static int remote = 0;   // Is vimrserver on another machine?
+static int compress = 1; // Compress big messages to a remote vimrserver?
+#define SQ_TICK_MS 5       // Time to wait for more messages (remote only).
+#define SQ_BATCH_SIZE 65536 // Small messages are joined up to this size.
+#define LZ_MIN 4096         // Smaller messages are not compressed.
+#define LZ_HASH_BITS 14
+
+#ifndef WIN32
+// Big messages to a local vimrserver are written to a ring buffer that both
+// processes map from a file in the private tmpdir (in /dev/shm on Linux), and
+// only their position in the ring is sent through the socket.
+#define RING_HDR 4096      // Size of the header of the ring file.
+#define RING_SIZE 33554432 // Size of the ring.
+#define RING_MIN 65536     // Smaller messages are sent through the socket.
+
+typedef struct ring_hdr {
+    char magic[8];           // "vimcomR1"
+    unsigned long long size; // Size of the ring after the header.
+    unsigned long long tail; // Position up to which vimrserver has read the
+                             // ring. Only vimrserver writes it.
+} RingHdr;
+
+static char *ring;                   // Mapped ring file (NULL: none).
+static char ring_path[576];          // Path of the ring file.
+static unsigned long long ring_head; // Position after the last message.
+static int ring_ok;                  // Did vimrserver map the ring?
+#endif
+
+/**
+ * @brief Unlink from the queue the messages of the given kind.
+ * Must be called under SQ_LOCK.
+ *
+ * @return Number of messages removed.
+ */
+static int sq_remove_kind(char kind) {
+    send_node_t *prev = NULL;
+    send_node_t *node = sq_head;
+    int n = 0;
+    while (node) {
+        send_node_t *next = node->next;
+        if (node->kind == kind) {
+            if (prev)
+                prev->next = next;
+            else
+                sq_head = next;
+            if (sq_tail == node)
+                sq_tail = prev;
+            sq_bytes -= node->len;
+#ifndef WIN32
+            // vimrserver will not read the message: reuse its space in the
+            // ring if nothing was written after it.
+            if (node->ring_end && node->ring_end == ring_head)
+                ring_head = node->ring_prev;
+#endif
+            free(node);
+            n++;
+        } else {
+            prev = node;
+        }
+        node = next;
+    }
+    return n;
+}
+
+/**
+ * @brief Discard the list of objects in .GlobalEnv that was not sent yet.
+ *
+ * The changes in the next list are relative to the discarded one, which
+ * vimrserver will never receive. So, if this function returns 1, the next
+ * list must be sent whole.
+ */
+static int sq_drop_glbenv(void) {
+    SQ_LOCK();
+    int n = sq_remove_kind('G');
+    SQ_UNLOCK();
+    return n > 0;
+}
+
+/**
+ * @brief Free the messages that were not sent. Must be called under SQ_LOCK.
+ */
+static void sq_clear(void) {
+    while (sq_head) {
+        send_node_t *tmp = sq_head;
+        sq_head = sq_head->next;
+        free(tmp);
+    }
+    sq_tail = NULL;
+    sq_bytes = 0;
+}
+
+/**
+ * @brief Write the whole buffer to the socket.
+ *
+ * @return 0 on success and -1 if the connection is broken.
+ */
+static int send_all(const char *b, size_t len) {
+    while (len > 0) {
+        int sent = send(sfd, b, len > 1073741824 ? 1073741824 : (int)len,
+                        MSG_NOSIGNAL);
+        if (sent <= 0) {
+#ifndef WIN32
+            if (sent == -1 && errno == EINTR)
+                continue;
+#endif
+            return -1;
+        }
+        b += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+static uint32_t lz_read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static int lz_putlen(unsigned char *dst, size_t *op, size_t cap, size_t n) {
+    while (n >= 255) {
+        if (*op >= cap)
+            return 0;
+        dst[(*op)++] = 255;
+        n -= 255;
+    }
+    if (*op >= cap)
+        return 0;
+    dst[(*op)++] = (unsigned char)n;
+    return 1;
+}
+
+/**
+ * @brief Compress a buffer with a simple LZ77 codec (decoded by
+ * lz_decompress() in vimrserver). Each sequence is a token byte with the
+ * number of literals (high nibble) and the length of the match minus 4 (low
+ * nibble), the extra bytes of the number of literals if it is >= 15, the
+ * literals, the offset of the match (2 bytes, little endian) and the extra
+ * bytes of the length of the match if it is >= 19. The last sequence has
+ * only literals.
+ *
+ * @param in Data to compress.
+ * @param n Size of the data.
+ * @param out Buffer for the compressed data.
+ * @param cap Size of out.
+ * @return The size of the compressed data or 0 if it would not fit in out.
+ */
+static size_t lz_compress(const char *in, size_t n, char *out, size_t cap) {
+    const unsigned char *src = (const unsigned char *)in;
+    unsigned char *dst = (unsigned char *)out;
+    size_t ip = 0, anchor = 0, op = 0, lit;
+    unsigned misses = 0;
+    uint32_t *tab = calloc((size_t)1 << LZ_HASH_BITS, sizeof(uint32_t));
+    if (!tab)
+        return 0;
+
+    while (ip + 4 <= n) {
+        uint32_t h = (lz_read32(src + ip) * 2654435761U) >> (32 - LZ_HASH_BITS);
+        size_t ref = tab[h]; // Position + 1 of the last string with this hash
+        tab[h] = (uint32_t)(ip + 1);
+        if (!ref || ip + 1 - ref > 65535 ||
+            lz_read32(src + ref - 1) != lz_read32(src + ip)) {
+            ip += 1 + (misses++ >> 6); // Skip faster incompressible data
+            continue;
+        }
+        misses = 0;
+        ref--;
+        size_t mlen = 4;
+        while (ip + mlen < n && src[ref + mlen] == src[ip + mlen])
+            mlen++;
+
+        lit = ip - anchor;
+        if (op >= cap)
+            goto fail;
+        dst[op++] = (unsigned char)((lit < 15 ? lit : 15) << 4 |
+                                    (mlen - 4 < 15 ? mlen - 4 : 15));
+        if (lit >= 15 && !lz_putlen(dst, &op, cap, lit - 15))
+            goto fail;
+        if (op + lit + 2 > cap)
+            goto fail;
+        memcpy(dst + op, src + anchor, lit);
+        op += lit;
+        dst[op++] = (unsigned char)((ip - ref) & 255);
+        dst[op++] = (unsigned char)((ip - ref) >> 8);
+        if (mlen - 4 >= 15 && !lz_putlen(dst, &op, cap, mlen - 19))
+            goto fail;
+        ip += mlen;
+        anchor = ip;
+    }
+
+    lit = n - anchor;
+    if (op >= cap)
+        goto fail;
+    dst[op++] = (unsigned char)((lit < 15 ? lit : 15) << 4);
+    if (lit >= 15 && !lz_putlen(dst, &op, cap, lit - 15))
+        goto fail;
+    if (op + lit > cap)
+        goto fail;
+    memcpy(dst + op, src + anchor, lit);
+    op += lit;
+    free(tab);
+    return op;
+
+fail:
+    free(tab);
+    return 0;
+}
+
+/**
+ * @brief Replace a framed message with "+Z<size> <compressed message>" if
+ * this makes it at least 1/8 smaller. Called by sender_thread().
+ *
+ * @return The node to be sent.
+ */
+static send_node_t *sq_compress(send_node_t *node) {
+    size_t len = node->len - tcp_header_len - 1;
+    size_t cap = len - len / 8;
+    send_node_t *z = malloc(sizeof(send_node_t) + tcp_header_len + cap + 2);
+    if (!z)
+        return node;
+    char *b = z->buf + tcp_header_len;
+    int h = snprintf(b, cap, "+Z%zu ", len);
+    size_t zlen = lz_compress(node->buf + tcp_header_len, len, b + h, cap - h);
+    if (!zlen) {
+        free(z);
+        return node;
+    }
+    zlen += h;
+    char hdr[32];
+    snprintf(hdr, sizeof(hdr), "%09zu", zlen);
+    memcpy(z->buf, vimsecr, tcp_header_len - 9);
+    memcpy(z->buf + tcp_header_len - 9, hdr, 9);
+    z->buf[tcp_header_len + zlen] = '\x11';
+    z->len = tcp_header_len + zlen + 1;
+    z->next = node->next;
+    if (verbose > 3)
+        REprintf("vimcom: message compressed from %zu to %zu bytes\n", len,
+                 zlen);
+    free(node);
+    return z;
+}
+
+#ifdef WIN32
+static DWORD WINAPI sender_thread(__attribute__((unused)) void *arg)
+#else
+/**
+ * @brief Send the queued messages to vimrserver in the order they were
+ * queued. Each time, all the queued messages are taken and the small ones are
+ * sent together.
+ *
+ * @param unused Unused parameter.
+ */
+static void *sender_thread(__attribute__((unused)) void *arg)
+#endif
+{
+    char *batch = malloc(SQ_BATCH_SIZE);
+    for (;;) {
+        SQ_LOCK();
+        while (!sq_head && !sq_stop)
+            SQ_WAIT();
+        if (remote && !sq_stop) {
+            // Messages sent by the same top level command will go together
+            SQ_UNLOCK();
+#ifdef WIN32
+            Sleep(SQ_TICK_MS);
+#else
+            usleep(SQ_TICK_MS * 1000);
+#endif
+            SQ_LOCK();
+        }
+        if (sq_stop) {
+            SQ_UNLOCK();
+            break;
+        }
+        send_node_t *node = sq_head;
+        sq_head = sq_tail = NULL;
+        sq_bytes = 0;
+        sq_busy = 1;
+        SQ_UNLOCK();
+
+        int r = 0;
+        size_t blen = 0;
+        while (node) {
+            if (remote && compress && node->len > tcp_header_len + LZ_MIN)
+                node = sq_compress(node);
+            send_node_t *next = node->next;
+            if (r == 0 && batch && blen + node->len > SQ_BATCH_SIZE &&
+                blen > 0) {
+                r = send_all(batch, blen);
+                blen = 0;
+            }
+            if (r == 0) {
+                if (batch && node->len <= SQ_BATCH_SIZE) {
+                    memcpy(batch + blen, node->buf, node->len);
+                    blen += node->len;
+                } else {
+                    r = send_all(node->buf, node->len);
+                }
+            }
+            free(node);
+            node = next;
+        }
+        if (r == 0 && blen > 0)
+            r = send_all(batch, blen);
+        SQ_LOCK();
+        sq_busy = 0;
+        if (r != 0) {
+            // vimrserver is gone: stop queuing messages until
+            // client_loop_thread() connects again.
+            sq_dead = 1;
+            sq_clear();
+#ifdef WIN32
+            shutdown(sfd, SD_BOTH);
+#else
+            shutdown(sfd, SHUT_RDWR);
+#endif
+        }
+        SQ_UNLOCK();
+    }
+    free(batch);
+#ifdef WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+/**
+ * @brief Start the thread that sends messages to vimrserver.
+ */
+static void sender_start(void) {
+#ifdef WIN32
+    InitializeCriticalSection(&sq_mutex);
+    sq_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    DWORD ti;
+    sq_tid = CreateThread(NULL, 0, sender_thread, NULL, 0, &ti);
+    sq_started = sq_tid != NULL;
+#else
+    sq_started = pthread_create(&sq_tid, NULL, sender_thread, NULL) == 0;
+#endif
+    sq_dead = !sq_started;
+    if (!sq_started)
+        REprintf("vimcom: failed to start the sender thread\n");
+}
+
+/**
+ * @brief Stop the sender thread, discarding the messages not sent yet. The
+ * socket must have been shut down before, so that a blocked send() returns.
+ */
+static void sender_stop(void) {
+    if (!sq_started)
+        return;
+    SQ_LOCK();
+    sq_stop = 1;
+    sq_dead = 1;
+    sq_clear();
+    SQ_SIGNAL();
+    SQ_UNLOCK();
+#ifdef WIN32
+    if (WaitForSingleObject(sq_tid, 5000) == WAIT_TIMEOUT)
+        TerminateThread(sq_tid, 0);
+    CloseHandle(sq_tid);
+    CloseHandle(sq_event);
+#else
+    pthread_join(sq_tid, NULL);
+#endif
+    sq_started = 0;
+}
+
+#ifndef WIN32
+/**
+ * @brief Create the ring buffer and ask vimrserver to map it. The ring is
+ * used after vimrserver confirms it (message 'M').
+ */
+static void ring_create(void) {
+    if (!tmpdir[0])
+        return;
+    snprintf(ring_path, sizeof(ring_path), "%s/vimcom_ring_%d", tmpdir,
+             (int)getpid());
+    unlink(ring_path); // Left by an R that crashed
+    int fd = open(ring_path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1)
+        return;
+    char *r = MAP_FAILED;
+    if (ftruncate(fd, RING_HDR + RING_SIZE) == 0)
+        r = mmap(NULL, RING_HDR + RING_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_SHARED, fd, 0);
+    close(fd);
+    if (r == MAP_FAILED) {
+        unlink(ring_path);
+        return;
+    }
+    RingHdr *h = (RingHdr *)r;
+    memcpy(h->magic, "vimcomR1", 8);
+    h->size = RING_SIZE;
+    h->tail = 0;
+    ring = r;
+    ring_head = 0;
+
+    char msg[640];
+    snprintf(msg, sizeof(msg), "+M%d %s", RING_SIZE, ring_path);
+    send_to_vim(msg);
+}
+
+/**
+ * @brief Unmap the ring buffer. The sender thread must not be running.
+ */
+static void ring_destroy(void) {
+    if (ring) {
+        munmap(ring, RING_HDR + RING_SIZE);
+        unlink(ring_path); // If vimrserver did not remove it
+        ring = NULL;
+    }
+    ring_ok = 0;
+}
+
+/**
+ * @brief Reserve contiguous space in the ring. Must be called under SQ_LOCK.
+ *
+ * @param n Number of bytes.
+ * @return Position of the space or -1 if the ring is full.
+ */
+static long long ring_alloc(size_t n) {
+    RingHdr *h = (RingHdr *)ring;
+    unsigned long long tail = __atomic_load_n(&h->tail, __ATOMIC_ACQUIRE);
+    unsigned long long pos = ring_head;
+
+    if (pos % RING_SIZE + n > RING_SIZE) // Don't split the message
+        pos += RING_SIZE - pos % RING_SIZE;
+    if (pos + n - tail > RING_SIZE)
+        return -1;
+    ring_head = pos + n;
+    return (long long)pos;
+}
+#endif
+
+/**
+ * @brief Frame a message to be sent through the socket.
+ *
+ * @return The new node of the send queue or NULL if out of memory.
+ */
+static send_node_t *sq_node_new(const char *msg, size_t len) {
+    size_t flen = tcp_header_len + len + 1;
+    send_node_t *node = malloc(sizeof(send_node_t) + flen + 1);
+    if (!node) {
+        REprintf("vimcom: malloc failed for a message of %zu bytes\n", len);
+        return NULL;
+    }
+    snprintf(node->buf, tcp_header_len + 1, "%s%09zu", vimsecr, len);
+    memcpy(node->buf + tcp_header_len, msg, len);
+    node->buf[flen - 1] = '\x11';
+    node->len = flen;
+    node->next = NULL;
+    node->kind = 0;
+    node->ring_prev = 0;
+    node->ring_end = 0;
+    return node;
+}
+
 /**
  * @brief Send string to vimrserver.
  *
- * The function sends a string to vimrserver through the TCP connection
- * established at `vimcom_Start()`.
+ * The message is queued and sent by sender_thread() through the TCP
+ * connection established at `vimcom_Start()`. Messages are sent in the order
+ * they were queued, except that a list of libraries or of objects in
+ * .GlobalEnv that was not sent yet is replaced by a newer one.
  *
  * @param msg The message to be sent.
  */
 static void send_to_vim(char *msg) {
-    if (sfd == -1)
+    if (sfd == -1 || !sq_started)
         return;
 
-    int sent;
-    char b[192];
     size_t len;
 
     if (verbose > 2) {
@@ -318,61 +898,73 @@ static void send_to_vim(char *msg) {
 
        - The time to save the file at /dev/shm is bigger than the time to send
          the buffer through a TCP connection.
-
-       - When the msg is very big, it's faster to send the final message in
-         three pieces than to call snprintf() to assemble everything in a
-         single string.
     */
 
-    // Send the header
-    snprintf(b, sizeof(b), "%s%09zu", vimsecr, len);
-    sent = send(sfd, b, tcp_header_len, 0);
-    if (sent < 0 || (size_t)sent != tcp_header_len) {
-        if (sent == -1)
-            REprintf("Error sending message header to Vim-R: -1\n");
-        else
-            REprintf("Error sending message header to Vim-R: %lu x %d\n",
-                     tcp_header_len, sent);
-#ifdef WIN32
-        closesocket(sfd);
-        WSACleanup();
-#else
-        close(sfd);
-#endif
-        sfd = -1;
-        strcpy(nrs_port, "0");
-        return;
-    }
-
-    // based on code found on php source
-    // Send the message
-    char *pCur = msg;
-    char *pEnd = msg + len;
-    int loop = 0;
-    while (pCur < pEnd) {
-        sent = send(sfd, pCur, pEnd - pCur, 0);
-        if (sent >= 0) {
-            pCur += sent;
-        } else if (sent == -1) {
-            REprintf("Error sending message to Vim-R: %zu x %zu\n", len,
-                     pCur - msg);
-            return;
+    send_node_t *node = NULL;
+#ifndef WIN32
+    long long rpos = -1;
+    unsigned long long rprev = 0;
+    if (len >= RING_MIN) {
+        SQ_LOCK();
+        if (ring_ok && !sq_dead) {
+            rprev = ring_head;
+            rpos = ring_alloc(len + 1);
         }
-        loop++;
-        if (loop == 100) {
-            // The goal here is to avoid infinite loop.
-            // TODO: Maybe delete this check because php code does not have
-            // something similar
-            REprintf("Too many attempts to send message to Vim-R: %zu x %d\n",
-                     len, sent);
-            return;
+        SQ_UNLOCK();
+    }
+    if (rpos >= 0) {
+        // The message is copied only once, to the ring, and vimrserver is
+        // told where it is
+        char b[64];
+        memcpy(ring + RING_HDR + rpos % RING_SIZE, msg, len + 1);
+        snprintf(b, sizeof(b), "+S%lld %zu", rpos, len);
+        node = sq_node_new(b, strlen(b));
+        if (node) {
+            node->ring_prev = rprev;
+            node->ring_end = rpos + len + 1;
+        } else {
+            SQ_LOCK();
+            if (ring_head == rpos + len + 1)
+                ring_head = rprev;
+            SQ_UNLOCK();
         }
+    } else
+#endif
+        node = sq_node_new(msg, len);
+    if (!node)
+        return;
+    if (msg[0] == '+' && (msg[1] == 'G' || msg[1] == 'D'))
+        node->kind = 'G';
+    else if (msg[0] == '+' && msg[1] == 'L')
+        node->kind = 'L';
+
+    SQ_LOCK();
+    if (sq_dead || sq_bytes + node->len > SEND_QUEUE_MAX) {
+        int dead = sq_dead;
+#ifndef WIN32
+        if (node->ring_end && node->ring_end == ring_head)
+            ring_head = node->ring_prev;
+#endif
+        SQ_UNLOCK();
+        // Lists of objects in .GlobalEnv sent later will not match the
+        // generation known by vimrserver, which will ask for the whole list.
+        if (!dead)
+            REprintf("vimcom: vimrserver is not reading messages; message "
+                     "of %zu bytes discarded\n",
+                     len);
+        free(node);
+        return;
     }
-
-    // End the message with \x11
-    sent = send(sfd, "\x11", 1, 0);
-    if (sent != 1)
-        REprintf("Error sending final byte to Vim-R: 1 x %d\n", sent);
+    if (node->kind)
+        sq_remove_kind(node->kind);
+    if (sq_tail)
+        sq_tail->next = node;
+    else
+        sq_head = node;
+    sq_tail = node;
+    sq_bytes += node->len;
+    SQ_SIGNAL();
+    SQ_UNLOCK();
 }
 
 /**
@@ -741,6 +1333,23 @@ static char *vimcom_glbnv_line(SEXP *x, const char *xname, const char *curenv,
     return p;
 }
 
+/**
+ * @brief Register the offset of a top-level object in the list of objects.
+ */
+static void glbnv_add_block(GlbnvBlocks *blk, size_t o) {
+    if (blk->n == blk->size) {
+        int nsz = blk->size ? 2 * blk->size : 256;
+        size_t *tmp = (size_t *)realloc(blk->off, nsz * sizeof(size_t));
+        if (!tmp) {
+            blk->failed = 1;
+            return;
+        }
+        blk->off = tmp;
+        blk->size = nsz;
+    }
+    blk->off[blk->n++] = o;
+}
+
 /**
  * @brief Generate a list of objects in .GlobalEnv and store it in the
  * glbnvbuf2 buffer. The string stored in glbnvbuf2 represents a file with the
@@ -759,8 +1368,11 @@ static void vimcom_globalenv_list(void) {
 
     memset(glbnvbuf2, 0, glbnvbufsize);
     char *p = glbnvbuf2;
+    size_t o;
 
     curdepth = 0;
+    glbnvblk2.n = 0;
+    glbnvblk2.failed = 0;
 
     PROTECT(envVarsSEXP = R_lsInternal(R_GlobalEnv, allnames));
     for (int i = 0; i < Rf_length(envVarsSEXP); i++) {
@@ -774,7 +1386,10 @@ static void vimcom_globalenv_list(void) {
         }
         if (varSEXP != R_UnboundValue) {
             // should never be unbound
+            o = p - glbnvbuf2;
             p = vimcom_glbnv_line(&varSEXP, varName, "", p, 0);
+            if ((size_t)(p - glbnvbuf2) > o)
+                glbnv_add_block(&glbnvblk2, o);
         } else {
             REprintf("vimcom_globalenv_list: Unexpected R_UnboundValue.\n");
         }
@@ -792,7 +1407,7 @@ static void vimcom_globalenv_list(void) {
             changed = 1;
     }
 
-    if (changed)
+    if (changed || glbenv_resync)
         needs_glbenv_msg = 1;
 
     double tmdiff = 1000 * ((double)clock() - tm) / CLOCKS_PER_SEC;
@@ -809,46 +1424,876 @@ static void vimcom_globalenv_list(void) {
 }
 
 /**
- * @brief Send to Vim-R the string containing the list of objects in
- * .GlobalEnv.
+ * @brief Growable buffer where the contents of an `omnils_` file are stored
+ * before being written with a single call to fwrite().
  */
-static void send_glb_env(void) {
-    clock_t t1;
+typedef struct bol_buf_ {
+    char *b;     // The buffer.
+    size_t len;  // Number of bytes in use.
+    size_t size; // Allocated size.
+    int failed;  // Did a memory allocation fail?
+} BolBuf;
 
-    t1 = clock();
+/**
+ * @brief Information on objects from the documentation of a library: a hash
+ * table of the names of the character vector with "\006title\006description"
+ * of each object built by vim.bol().
+ */
+typedef struct bol_info_ {
+    SEXP names;  // Object names.
+    SEXP descr;  // Title and description of objects.
+    int *slot;   // Hash table with (index + 1) of names (0 means empty).
+    int nslots;  // Size of hash table (power of two).
+} BolInfo;
 
-    strcpy(send_ge_buf, "+G");
-    strcat(send_ge_buf, glbnvbuf2);
-    send_to_vim(send_ge_buf);
+/**
+ * @brief Make room for `n` more bytes in the buffer.
+ *
+ * @return 1 on success and 0 if memory allocation failed.
+ */
+static int bol_grow(BolBuf *o, size_t n) {
+    if (o->failed)
+        return 0;
+    if (o->len + n + 1 <= o->size)
+        return 1;
+    size_t nsz = o->size;
+    while (o->len + n + 1 > nsz)
+        nsz *= 2;
+    char *tmp = realloc(o->b, nsz);
+    if (!tmp) {
+        o->failed = 1;
+        return 0;
+    }
+    o->b = tmp;
+    o->size = nsz;
+    return 1;
+}
 
-    if (verbose > 3)
-        REprintf("Time to send message to Vim-R: %f\n",
-                 1000 * ((double)clock() - t1) / CLOCKS_PER_SEC);
+static void bol_cat(BolBuf *o, const char *s) {
+    size_t n = strlen(s);
+    if (!bol_grow(o, n))
+        return;
+    memcpy(o->b + o->len, s, n + 1);
+    o->len += n;
+}
 
-    char *tmp = glbnvbuf1;
-    glbnvbuf1 = glbnvbuf2;
-    glbnvbuf2 = tmp;
+/**
+ * @brief Append a string escaped as vim.fix.string() does.
+ *
+ * @param o The buffer.
+ * @param s The string.
+ * @param edq Whether double quotes should be escaped. If not, leading
+ * spaces are removed.
+ */
+static void bol_cat_fixed(BolBuf *o, const char *s, int edq) {
+    if (!bol_grow(o, 2 * strlen(s)))
+        return;
+    char *p = o->b + o->len;
+    if (!edq)
+        while (*s == ' ' || *s == '\f' || *s == '\v')
+            s++;
+    while (*s) {
+        switch (*s) {
+        case '\n':
+            *p++ = '\\';
+            *p++ = 'n';
+            break;
+        case '\r':
+            *p++ = '\\';
+            *p++ = 'r';
+            break;
+        case '\t':
+            *p++ = '\\';
+            *p++ = 't';
+            break;
+        case '\'':
+            *p++ = '\x13';
+            break;
+        case '"':
+            if (edq)
+                *p++ = '\\';
+            *p++ = '"';
+            break;
+        default:
+            *p++ = *s;
+        }
+        s++;
+    }
+    *p = 0;
+    o->len = p - o->b;
+}
+
+static unsigned long bol_hash(const char *s) {
+    unsigned long h = 5381;
+    while (*s)
+        h = h * 33 + (unsigned char)*s++;
+    return h;
+}
+
+static void bol_info_init(BolInfo *bi, SEXP info) {
+    bi->slot = NULL;
+    bi->nslots = 0;
+    bi->descr = info;
+    bi->names = getAttrib(info, R_NamesSymbol);
+    if (TYPEOF(info) != STRSXP || isNull(bi->names))
+        return;
+    int n = length(info);
+    bi->nslots = 64;
+    while (bi->nslots < 2 * n)
+        bi->nslots *= 2;
+    bi->slot = calloc(bi->nslots, sizeof(int));
+    if (!bi->slot) {
+        bi->nslots = 0;
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        if (STRING_ELT(info, i) == NA_STRING)
+            continue;
+        unsigned long h = bol_hash(CHAR(STRING_ELT(bi->names, i)));
+        int j = h & (bi->nslots - 1);
+        while (bi->slot[j])
+            j = (j + 1) & (bi->nslots - 1);
+        bi->slot[j] = i + 1;
+    }
 }
 
 /**
- * @brief Evaluate an R expression.
+ * @brief Get the "\006title\006description" string of an object.
  *
- * @param buf The expression to be evaluated.
+ * @return The string or NULL if the object is not documented.
  */
-static void vimcom_eval_expr(const char *buf) {
-    if (verbose > 3)
-        Rprintf("vimcom_eval_expr: '%s'\n", buf);
+static const char *bol_info_get(BolInfo *bi, const char *nm) {
+    if (!bi->nslots)
+        return NULL;
+    int j = bol_hash(nm) & (bi->nslots - 1);
+    while (bi->slot[j]) {
+        int i = bi->slot[j] - 1;
+        if (strcmp(CHAR(STRING_ELT(bi->names, i)), nm) == 0)
+            return CHAR(STRING_ELT(bi->descr, i));
+        j = (j + 1) & (bi->nslots - 1);
+    }
+    return NULL;
+}
 
-    char rep[256];
+/**
+ * @brief Call an R function with a single (quoted) argument.
+ *
+ * @return The unprotected result or NULL on error.
+ */
+static SEXP bol_call(const char *fun, SEXP x) {
+    int er = 0;
+    SEXP cl, ans;
+    PROTECT(cl = lang2(install(fun), lang2(install("quote"), x)));
+    ans = R_tryEvalSilent(cl, R_GlobalEnv, &er);
+    UNPROTECT(1);
+    return er ? NULL : ans;
+}
 
-    SEXP cmdSexp, cmdexpr, ans;
+/**
+ * @brief Parse and evaluate a string, as `try(eval(parse(text = s)))`.
+ *
+ * @return The unprotected result or NULL on error.
+ */
+static SEXP bol_eval_str(const char *s) {
     ParseStatus status;
+    SEXP cmd, expr, ans = NULL;
     int er = 0;
+    PROTECT(cmd = mkString(s));
+    PROTECT(expr = R_ParseVector(cmd, -1, &status, R_NilValue));
+    if (status == PARSE_OK) {
+        for (int i = 0; i < length(expr); i++) {
+            ans = R_tryEvalSilent(VECTOR_ELT(expr, i), R_GlobalEnv, &er);
+            if (er) {
+                ans = NULL;
+                break;
+            }
+        }
+    }
+    UNPROTECT(2);
+    return ans;
+}
+
+static int bol_isalnum(char c) {
+    return (unsigned char)c > 127 || isalnum((unsigned char)c);
+}
+
+static int bol_ispunct(char c) {
+    return (unsigned char)c < 128 && ispunct((unsigned char)c);
+}
+
+/**
+ * @brief Check if the name of a list element or S4 slot would not be
+ * evaluated by vim.omni.line().
+ */
+static int bol_haspunct(const char *x) {
+    if (strchr(x, ' '))
+        return 1;
+
+    char *c = malloc(strlen(x) + 1);
+    if (!c)
+        return 1;
+    int n = 0;
+    for (const char *s = x; *s; s++)
+        if (*s != '$' && *s != '_')
+            c[n++] = *s;
+    c[n] = 0;
+
+    int hp = 0;
+    for (int i = 0; i < n; i++)
+        if (bol_ispunct(c[i]))
+            hp = 1;
+    if (hp) {
+        int ok = 0;
+        for (int i = 1; i < n - 1; i++)
+            if (c[i] == '.' && bol_isalnum(c[i - 1]) && bol_isalnum(c[i + 1]))
+                ok = 1;
+        if (ok) {
+            hp = 0;
+            for (int i = 1; i < n; i++)
+                if (bol_ispunct(c[i - 1]) && bol_ispunct(c[i]))
+                    hp = 1;
+        }
+    }
+    free(c);
+    return hp;
+}
+
+/**
+ * @brief Get the group of an object as vim.omni.line() does.
+ */
+static char bol_group(SEXP x) {
+    if (isFunction(x))
+        return '\003';
+    int isnum;
+    if (OBJECT(x)) {
+        SEXP r = bol_call("is.numeric", x);
+        isnum = r && asLogical(r) == 1;
+    } else {
+        isnum = TYPEOF(x) == INTSXP || TYPEOF(x) == REALSXP;
+    }
+    if (isnum)
+        return '{';
+    if (inherits(x, "factor"))
+        return '!';
+    if (TYPEOF(x) == STRSXP)
+        return '~';
+    if (TYPEOF(x) == LGLSXP)
+        return '%';
+    if (inherits(x, "data.frame"))
+        return '$';
+    if (TYPEOF(x) == VECSXP || TYPEOF(x) == LISTSXP)
+        return '[';
+    if (TYPEOF(x) == ENVSXP)
+        return ':';
+    return '*';
+}
+
+/**
+ * @brief Append a vector converted by as.character(), with its elements
+ * separated by ", ".
+ */
+static void bol_cat_as_char(BolBuf *o, SEXP x) {
+    SEXP s;
+    PROTECT(s = coerceVector(x, STRSXP));
+    for (int i = 0; i < length(s); i++) {
+        if (i)
+            bol_cat(o, ", ");
+        bol_cat(o, CHAR(STRING_ELT(s, i)));
+    }
+    UNPROTECT(1);
+}
+
+/**
+ * @brief Append the result of `length(x)`, dispatching methods for classed
+ * objects.
+ */
+static void bol_cat_length(BolBuf *o, SEXP x) {
+    SEXP l = OBJECT(x) ? bol_call("length", x) : ScalarInteger(length(x));
+    if (l) {
+        PROTECT(l);
+        bol_cat_as_char(o, l);
+        UNPROTECT(1);
+    }
+}
+
+/**
+ * @brief Append the list of arguments of a function in the format of the
+ * output of `vim.args(x, pkg = pkg)`.
+ *
+ * @param o The buffer.
+ * @param env The package environment.
+ * @param nm The function name.
+ */
+static void bol_args(BolBuf *o, SEXP env, const char *nm) {
+    int er = 0;
+    size_t len = strlen(nm) + 9;
+    char *dflt = malloc(len);
+    if (!dflt)
+        return;
+    snprintf(dflt, len, "%s.default", nm);
+    SEXP ff = R_tryEvalSilent(install(dflt), env, &er);
+    free(dflt);
+    if (er)
+        ff = R_tryEvalSilent(install(nm), env, &er);
+    if (er)
+        return;
+    PROTECT(ff);
+
+    SEXP frm = R_NilValue;
+    if (isPrimitive(ff)) {
+        SEXP a = bol_call("args", ff);
+        if (!a || isNull(a)) {
+            UNPROTECT(1);
+            return;
+        }
+        UNPROTECT(1);
+        PROTECT(ff = a);
+        frm = FORMALS(a);
+    } else if (TYPEOF(ff) == CLOSXP) {
+        frm = FORMALS(ff);
+    }
+
+    size_t len0 = o->len;
+    for (SEXP a = frm; a != R_NilValue; a = CDR(a)) {
+        const char *field = CHAR(PRINTNAME(TAG(a)));
+        SEXP v = CAR(a);
+        switch (TYPEOF(v)) {
+        case STRSXP:
+            for (int i = 0; i < length(v) || i == 0; i++) {
+                bol_cat(o, "[\x12");
+                bol_cat(o, field);
+                bol_cat(o, "\x12, \x12\"");
+                if (i < length(v))
+                    bol_cat_fixed(o, CHAR(STRING_ELT(v, i)), 1);
+                bol_cat(o, "\"\x12], ");
+            }
+            break;
+        case LGLSXP:
+        case INTSXP:
+        case REALSXP: {
+            SEXP s;
+            PROTECT(s = coerceVector(v, STRSXP));
+            for (int i = 0; i < length(s); i++) {
+                bol_cat(o, "[\x12");
+                bol_cat(o, field);
+                bol_cat(o, "\x12, \x12");
+                bol_cat(o, CHAR(STRING_ELT(s, i)));
+                bol_cat(o, "\x12], ");
+            }
+            UNPROTECT(1);
+            break;
+        }
+        case NILSXP:
+            bol_cat(o, "[\x12");
+            bol_cat(o, field);
+            bol_cat(o, "\x12, \x12NULL\x12], ");
+            break;
+        case LANGSXP: {
+            SEXP dp = bol_call("deparse", v);
+            bol_cat(o, "[\x12");
+            bol_cat(o, field);
+            bol_cat(o, "\x12, \x12");
+            if (dp) {
+                PROTECT(dp);
+                for (int i = 0; i < length(dp); i++)
+                    bol_cat_fixed(o, CHAR(STRING_ELT(dp, i)), 0);
+                UNPROTECT(1);
+            }
+            bol_cat(o, "\x12], ");
+            break;
+        }
+        default: // symbol
+            bol_cat(o, "[\x12");
+            bol_cat(o, field);
+            bol_cat(o, "\x12], ");
+        }
+    }
+    if (o->len == len0)
+        bol_cat(o, "[]");
+    UNPROTECT(1);
+}
+
+static void bol_line(BolBuf *o, SEXP x, const char *nm, const char *pkg,
+                     SEXP env, int level, BolInfo *bi);
+
+/**
+ * @brief Add the line of an element of a list or environment or of a slot
+ * of an S4 object.
+ */
+static void bol_child(BolBuf *o, const char *nm, char sep, const char *k,
+                      const char *pkg, SEXP env, BolInfo *bi) {
+    size_t n = strlen(nm) + strlen(k) + 2;
+    char *cn = malloc(n);
+    if (!cn)
+        return;
+    snprintf(cn, n, "%s%c%s", nm, sep, k);
+    SEXP cx = bol_haspunct(cn) ? NULL : bol_eval_str(cn);
+    if (cx) {
+        PROTECT(cx);
+        bol_line(o, cx, cn, pkg, env, 1, bi);
+        UNPROTECT(1);
+    } else {
+        bol_line(o, NULL, cn, pkg, env, 1, bi);
+    }
+    free(cn);
+}
+
+/**
+ * @brief Add the `omnils_` line of an object (and of its elements) to the
+ * buffer. This is a port of vim.omni.line() with maxlevel = 0.
+ *
+ * @param o The buffer.
+ * @param x The object or NULL if it could not be evaluated.
+ * @param nm The object name.
+ * @param pkg The library name.
+ * @param env The package environment.
+ * @param level Current level in lists, environments and S4 objects.
+ * @param bi Information from the library documentation.
+ */
+static void bol_line(BolBuf *o, SEXP x, const char *nm, const char *pkg,
+                     SEXP env, int level, BolInfo *bi) {
+    char grp[2] = {'*', 0};
+    const char *cls = NULL;
+    SEXP xcls = R_NilValue;
+    int iscontainer = 0;
+    const char *info;
+
+    if (x && !isNull(x)) {
+        if (strcmp(nm, "break") == 0 || strcmp(nm, "next") == 0 ||
+            strcmp(nm, "for") == 0 || strcmp(nm, "if") == 0 ||
+            strcmp(nm, "repeat") == 0 || strcmp(nm, "while") == 0) {
+            grp[0] = ';';
+            cls = "flow-control";
+        } else {
+            grp[0] = bol_group(x);
+            xcls = R_data_class(x, FALSE);
+        }
+        iscontainer = TYPEOF(x) == VECSXP || TYPEOF(x) == LISTSXP ||
+                      TYPEOF(x) == ENVSXP;
+    } else {
+        x = NULL;
+    }
+    PROTECT(xcls);
+    if (length(xcls) > 0)
+        cls = CHAR(STRING_ELT(xcls, 0));
+
+    bol_cat_fixed(o, nm, 1);
+    if (grp[0] == '\003') {
+        bol_cat(o, "\006\003\006\006");
+        bol_cat(o, pkg);
+        if (level == 0) {
+            bol_cat(o, "\006");
+            bol_args(o, env, nm);
+            info = bol_info_get(bi, nm);
+            bol_cat(o, info ? info : "\006\006");
+            bol_cat(o, "\006\n");
+        } else {
+            // some libraries have functions as list elements
+            bol_cat(o, "\006Unknown arguments\006\006\006\n");
+        }
+    } else {
+        bol_cat(o, "\006");
+        bol_cat(o, grp);
+        bol_cat(o, "\006");
+        if (cls)
+            bol_cat(o, cls);
+        bol_cat(o, "\006");
+        bol_cat(o, pkg);
+        bol_cat(o, "\006");
+        if (iscontainer && level > 0) {
+            bol_cat(o, "[]\006\006\006\n");
+        } else {
+            info = bol_info_get(bi, nm);
+            if (iscontainer) {
+                if (grp[0] == '$') {
+                    SEXP d = bol_call("dim", x);
+                    bol_cat(o, "[");
+                    if (d) {
+                        PROTECT(d);
+                        bol_cat_as_char(o, d);
+                        UNPROTECT(1);
+                    }
+                    bol_cat(o, "]");
+                } else if (TYPEOF(x) == ENVSXP) {
+                    bol_cat(o, "[]");
+                } else {
+                    bol_cat_length(o, x);
+                }
+                bol_cat(o, info ? info : "\006\006");
+            } else {
+                bol_cat(o, "[]");
+                if (info && strcmp(info, "\006\006") != 0) {
+                    bol_cat(o, info);
+                } else {
+                    bol_cat(o, "\006\006");
+                    SEXP lbl = x ? getAttrib(x, install("label")) : R_NilValue;
+                    if (isString(lbl) && length(lbl) == 1) {
+                        SEXP md;
+                        PROTECT(md = rd2md(lbl));
+                        if (!isNull(md))
+                            bol_cat(o, CHAR(STRING_ELT(md, 0)));
+                        UNPROTECT(1);
+                    }
+                }
+            }
+            bol_cat(o, "\006\n");
+        }
+    }
+    UNPROTECT(1);
+
+    if (level > 0 || !x)
+        return;
+
+    SEXP cn;
+    if (iscontainer) {
+        if (TYPEOF(x) == ENVSXP)
+            PROTECT(cn = R_lsInternal3(x, TRUE, FALSE));
+        else
+            PROTECT(cn = getAttrib(x, R_NamesSymbol));
+        if (length(x) > 0)
+            for (int i = 0; i < length(cn); i++)
+                bol_child(o, nm, '$', CHAR(STRING_ELT(cn, i)), pkg, env, bi);
+        UNPROTECT(1);
+    } else if (Rf_isS4(x)) {
+        cn = bol_call("slotNames", x);
+        if (cn && isString(cn)) {
+            PROTECT(cn);
+            for (int i = 0; i < length(cn); i++)
+                bol_child(o, nm, '@', CHAR(STRING_ELT(cn, i)), pkg, env, bi);
+            UNPROTECT(1);
+        }
+    }
+}
+
+/**
+ * @brief Build the `omnils_` file of a library. This is called by vim.bol()
+ * and is equivalent to calling vim.omni.line() for each object of
+ * `package:pkg`, but the whole file is built in memory and written at once.
+ *
+ * @param pkg Library name. The library must be attached.
+ * @param path Full path of the `omnils_` file.
+ * @param alln Whether to include objects whose names begin with a dot.
+ * @param info Named character vector with "\006title\006description" of
+ * documented objects.
+ * @return The number of objects in the library or -1 on error.
+ */
+SEXP vimcom_build_omnils(SEXP pkg, SEXP path, SEXP alln, SEXP info) {
+    const char *pkgnm = CHAR(STRING_ELT(pkg, 0));
+    const char *fnm = CHAR(STRING_ELT(path, 0));
+    SEXP env, objs;
+    int er = 0;
+    char buf[256];
+
+    snprintf(buf, 255, "package:%s", pkgnm);
+    SEXP cl;
+    PROTECT(cl = lang2(install("as.environment"), mkString(buf)));
+    env = R_tryEvalSilent(cl, R_GlobalEnv, &er);
+    UNPROTECT(1);
+    if (er)
+        return ScalarInteger(-1);
+    PROTECT(env);
+
+    BolBuf o;
+    o.size = 65536;
+    o.len = 0;
+    o.failed = 0;
+    o.b = malloc(o.size);
+    if (!o.b) {
+        UNPROTECT(1);
+        return ScalarInteger(-1);
+    }
+    o.b[0] = 0;
+
+    BolInfo bi;
+    bol_info_init(&bi, info);
+
+    int n = 0;
+    PROTECT(objs = R_lsInternal3(env, asLogical(alln) == 1, TRUE));
+    for (int i = 0; i < length(objs); i++) {
+        const char *nm = CHAR(STRING_ELT(objs, i));
+        // Same as filter.objlist()
+        if (strchr("[({:;<=>?@%/+$|~*&!^-", nm[0]) ||
+            strncmp(nm, ".__", 3) == 0)
+            continue;
+        n++;
+        SEXP x = R_tryEvalSilent(install(nm), env, &er);
+        if (er)
+            continue;
+        PROTECT(x);
+        bol_line(&o, x, nm, pkgnm, env, 0, &bi);
+        UNPROTECT(1);
+    }
+    UNPROTECT(2);
+    free(bi.slot);
+
+    if (n == 0)
+        bol_cat(&o, "\n");
+
+    if (o.failed) {
+        free(o.b);
+        REprintf("vimcom: not enough memory to build \"%s\"\n", fnm);
+        return ScalarInteger(-1);
+    }
+
+    FILE *f = fopen(fnm, "w");
+    if (!f) {
+        free(o.b);
+        REprintf("vimcom: could not write \"%s\"\n", fnm);
+        return ScalarInteger(-1);
+    }
+    fwrite(o.b, sizeof(char), o.len, f);
+    fclose(f);
+    free(o.b);
+    return ScalarInteger(n);
+}
+
+/**
+ * @brief Make room for len more bytes in send_ge_buf.
+ *
+ * @return Pointer to the end of the message or NULL if out of memory.
+ */
+static char *ge_reserve(char *p, size_t len) {
+    size_t used = send_ge_buf ? (size_t)(p - send_ge_buf) : 0;
+    if (used + len + 1 > send_ge_bufsz) {
+        size_t nsz = 2 * send_ge_bufsz + len + 64;
+        char *tmp = (char *)realloc(send_ge_buf, nsz);
+        if (!tmp)
+            return NULL;
+        send_ge_buf = tmp;
+        send_ge_bufsz = nsz;
+    }
+    return send_ge_buf + used;
+}
+
+/**
+ * @brief Append an operation of the .GlobalEnv delta message: keep ('=') or
+ * remove ('-') the next n objects of the previous list or insert ('+') an
+ * object of n bytes.
+ */
+static char *ge_op(char *p, char op, size_t n, const char *b) {
+    if (!p || !(p = ge_reserve(p, 32 + (op == '+' ? n : 0))))
+        return NULL;
+    p += sprintf(p, "%c%zu\n", op, n);
+    if (op == '+') {
+        memcpy(p, b, n);
+        p += n;
+    }
+    *p = 0;
+    return p;
+}
+
+static size_t glbnv_blk_end(const char *buf, const GlbnvBlocks *blk, int i,
+                            size_t buflen) {
+    return i + 1 < blk->n ? blk->off[i + 1] : buflen;
+}
+
+/**
+ * @brief Hash of the name of the object in the first field of a line.
+ */
+static unsigned glbnv_name_hash(const char *s) {
+    unsigned h = 2166136261u;
+    while (*s && *s != '\006')
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+static int glbnv_same_name(const char *a, const char *b) {
+    while (*a == *b && *a != '\006' && *a)
+        a++, b++;
+    return *a == *b || ((*a == '\006' || !*a) && (*b == '\006' || !*b));
+}
+
+/**
+ * @brief Build in send_ge_buf the message with the objects added, removed or
+ * changed in glbnvbuf2 since glbnvbuf1 was sent to vimrserver. The objects of
+ * both lists are sorted in the same order because both were listed by
+ * R_lsInternal().
+ *
+ * Message: "+D<gen> <base>\n" followed by the operations, where base is the
+ * generation of glbnvbuf1 or 0 if the message has the whole list.
+ *
+ * @return Pointer to the end of the message or NULL if the whole list should
+ * be sent instead.
+ */
+static char *glbnv_delta(unsigned gen) {
+    static int *tbl = NULL; // Open addressing table: index of each object
+    static unsigned tblsz = 0;
+    size_t len1 = strlen(glbnvbuf1);
+    size_t len2 = strlen(glbnvbuf2);
+    int n1 = glbnvblk1.n;
+    char *p;
+
+    if (n1 == 0 || glbnvblk1.failed)
+        return NULL;
+
+    if (tblsz < 2 * (unsigned)n1) {
+        unsigned nsz = 1024;
+        while (nsz < 2 * (unsigned)n1)
+            nsz *= 2;
+        int *tmp = (int *)realloc(tbl, nsz * sizeof(int));
+        if (!tmp)
+            return NULL;
+        tbl = tmp;
+        tblsz = nsz;
+    }
+    memset(tbl, -1, tblsz * sizeof(int));
+    for (int i = 0; i < n1; i++) {
+        unsigned h = glbnv_name_hash(glbnvbuf1 + glbnvblk1.off[i]);
+        while (tbl[h & (tblsz - 1)] != -1)
+            h++;
+        tbl[h & (tblsz - 1)] = i;
+    }
+
+    if (!(p = ge_reserve(send_ge_buf, 64)))
+        return NULL;
+    p += sprintf(p, "+D%u %u\n", gen, glbenv_gen);
+
+    char pend = 0; // Pending keep or remove operation
+    size_t npend = 0;
+    int i = 0; // Next object of the previous list
+    for (int j = 0; j < glbnvblk2.n && p; j++) {
+        const char *b2 = glbnvbuf2 + glbnvblk2.off[j];
+        size_t l2 = glbnv_blk_end(glbnvbuf2, &glbnvblk2, j, len2) -
+                    glbnvblk2.off[j];
+        unsigned h = glbnv_name_hash(b2);
+        int k;
+        while ((k = tbl[h & (tblsz - 1)]) != -1 &&
+               !glbnv_same_name(glbnvbuf1 + glbnvblk1.off[k], b2))
+            h++;
+
+        if (k != -1 && k < i)
+            return NULL; // Not in the same order
+        if (k != -1 && k > i) {
+            if (pend && pend != '-')
+                p = ge_op(p, pend, npend, NULL), npend = 0;
+            pend = '-';
+            npend += k - i;
+            i = k;
+        }
+        if (k != -1 &&
+            glbnv_blk_end(glbnvbuf1, &glbnvblk1, k, len1) - glbnvblk1.off[k] ==
+                l2 &&
+            memcmp(glbnvbuf1 + glbnvblk1.off[k], b2, l2) == 0) {
+            if (pend && pend != '=')
+                p = ge_op(p, pend, npend, NULL), npend = 0;
+            pend = '=';
+            npend++;
+            i++;
+            continue;
+        }
+        if (k != -1) { // Changed
+            if (pend && pend != '-')
+                p = ge_op(p, pend, npend, NULL), npend = 0;
+            pend = '-';
+            npend++;
+            i++;
+        }
+        if (pend)
+            p = ge_op(p, pend, npend, NULL);
+        pend = 0;
+        npend = 0;
+        p = ge_op(p, '+', l2, b2);
+    }
+    // Objects after the last operation are kept
+    if (i < n1) {
+        if (pend == '=')
+            p = ge_op(p, pend, npend, NULL), npend = 0;
+        pend = '-';
+        npend += n1 - i;
+    }
+    if (pend == '-')
+        p = ge_op(p, pend, npend, NULL);
+
+    // Not worth it if the changes are almost everything
+    if (p && (size_t)(p - send_ge_buf) > len2 + len2 / 2 + 64)
+        return NULL;
+    return p;
+}
+
+/**
+ * @brief Send to Vim-R the list of objects in .GlobalEnv. Only the objects
+ * that changed are sent, unless vimrserver does not have the previous list.
+ */
+static void send_glb_env(void) {
+    clock_t t1;
+    char *p = NULL;
+    int resync;
+    unsigned gen = glbenv_gen + 1;
+
+    if (gen == 0)
+        gen = 1;
+
+    t1 = clock();
+
+    FLAG_LOCK();
+    resync = glbenv_resync;
+    glbenv_resync = 0;
+    FLAG_UNLOCK();
+
+    // The previous list is still in the queue: replace it with the whole list.
+    if (sq_drop_glbenv())
+        resync = 1;
+
+    if (glbnvblk2.failed) {
+        // The objects could not be registered: send the whole list in the old
+        // format, which vimrserver cannot patch later.
+        p = ge_reserve(send_ge_buf, strlen(glbnvbuf2) + 8);
+        if (p) {
+            strcpy(p, "+G");
+            strcat(p, glbnvbuf2);
+            send_to_vim(send_ge_buf);
+        }
+        gen = 0;
+    } else {
+        if (!resync && glbenv_gen)
+            p = glbnv_delta(gen);
+        if (!p && (p = ge_reserve(send_ge_buf, 64))) {
+            p += sprintf(p, "+D%u 0\n", gen);
+            for (int j = 0; j < glbnvblk2.n && p; j++)
+                p = ge_op(p, '+',
+                          glbnv_blk_end(glbnvbuf2, &glbnvblk2, j,
+                                        strlen(glbnvbuf2)) -
+                              glbnvblk2.off[j],
+                          glbnvbuf2 + glbnvblk2.off[j]);
+        }
+        if (p)
+            send_to_vim(send_ge_buf);
+        else
+            gen = 0;
+    }
+    glbenv_gen = gen;
+
+    if (verbose > 3)
+        REprintf("Time to send message to Vim-R: %f\n",
+                 1000 * ((double)clock() - t1) / CLOCKS_PER_SEC);
+
+    char *tmp = glbnvbuf1;
+    glbnvbuf1 = glbnvbuf2;
+    glbnvbuf2 = tmp;
+    GlbnvBlocks tblk = glbnvblk1;
+    glbnvblk1 = glbnvblk2;
+    glbnvblk2 = tblk;
+}
+
+/**
+ * @brief Evaluate an R expression.
+ *
+ * @param buf The expression to be evaluated.
+ */
+static void vimcom_eval_expr(const char *buf) {
+    if (verbose > 3)
+        Rprintf("vimcom_eval_expr: '%s'\n", buf);
+
+    char rep[256];
+
+    SEXP cmdSexp, cmdexpr, ans;
+    ParseStatus status;
+    int er = 0;
+
+    PROTECT(cmdSexp = allocVector(STRSXP, 1));
+    SET_STRING_ELT(cmdSexp, 0, mkChar(buf));
+    PROTECT(cmdexpr = R_ParseVector(cmdSexp, -1, &status, R_NilValue));
 
-    PROTECT(cmdSexp = allocVector(STRSXP, 1));
-    SET_STRING_ELT(cmdSexp, 0, mkChar(buf));
-    PROTECT(cmdexpr = R_ParseVector(cmdSexp, -1, &status, R_NilValue));
-
     char buf2[80];
     vimcom_squo(buf, buf2, 80);
     if (status == PARSE_OK) {
@@ -871,13 +2316,103 @@ static void vimcom_eval_expr(const char *buf) {
     UNPROTECT(2);
 }
 
+/**
+ * @brief Source code sent by Vim-R without writing it to a file or pasting it
+ * in R's console.
+ *
+ * @param buf "<call>\002<code>", where <code> has its lines separated by
+ * \x14 and <call> is an R function call, such as
+ * "vimcom:::VimR.source.exprs(echo = TRUE)". The code is parsed with source
+ * references, so that it can be echoed as typed, and the expressions are
+ * passed to the function as its first argument, "exprs".
+ */
+static void vimcom_source(const char *buf) {
+    if (verbose > 3)
+        Rprintf("vimcom_source: %zu bytes\n", strlen(buf));
+
+    const char *code = strchr(buf, '\002');
+    if (!code)
+        return;
+    size_t clen = code - buf;
+    code++;
+
+    SEXP lines, fnm, sfcall, srcfile, exprs, cs, fcall, call;
+    ParseStatus status;
+    int er = 0;
+    int n = 1;
+
+    for (const char *s = code; *s; s++)
+        if (*s == '\x14')
+            n++;
+    PROTECT(lines = allocVector(STRSXP, n));
+    const char *s = code;
+    for (int i = 0; i < n; i++) {
+        const char *e = strchr(s, '\x14');
+        if (!e)
+            e = s + strlen(s);
+        SET_STRING_ELT(lines, i, mkCharLen(s, (int)(e - s)));
+        s = e + 1;
+    }
+
+    PROTECT(fnm = mkString("vim-rr"));
+    PROTECT(sfcall = lang3(install("srcfilecopy"), fnm, lines));
+    srcfile = R_tryEval(sfcall, R_BaseEnv, &er);
+    PROTECT(srcfile = er ? R_NilValue : srcfile);
+
+    PROTECT(exprs = R_ParseVector(lines, -1, &status, srcfile));
+    if (status != PARSE_OK) {
+        // Let R report the syntax error as it would for pasted code
+        SEXP pcall;
+        PROTECT(pcall = lang2(install("parse"), lines));
+        SET_TAG(CDR(pcall), install("text"));
+        R_tryEval(pcall, R_BaseEnv, &er);
+        UNPROTECT(6);
+        return;
+    }
+
+    PROTECT(cs = allocVector(STRSXP, 1));
+    SET_STRING_ELT(cs, 0, mkCharLen(buf, (int)clen));
+    PROTECT(fcall = R_ParseVector(cs, -1, &status, R_NilValue));
+    if (status != PARSE_OK || Rf_length(fcall) != 1 ||
+        TYPEOF(VECTOR_ELT(fcall, 0)) != LANGSXP) {
+        if (verbose > 1) {
+            char rep[128];
+            char buf2[80];
+            vimcom_squo(CHAR(STRING_ELT(cs, 0)), buf2, 80);
+            snprintf(rep, sizeof(rep), "g:RWarningMsg('Invalid call: %s')",
+                     buf2);
+            send_to_vim(rep);
+        }
+        UNPROTECT(7);
+        return;
+    }
+    call = VECTOR_ELT(fcall, 0);
+    PROTECT(call = LCONS(CAR(call), CONS(exprs, CDR(call))));
+    SET_TAG(CDR(call), install("exprs"));
+    R_tryEval(call, R_GlobalEnv, &er);
+    UNPROTECT(8);
+}
+
+/**
+ * @brief Run a command from the eval queue.
+ *
+ * @param kind 'S' if the command is code to be sourced, 'E' otherwise.
+ * @param cmd The command.
+ */
+static void vimcom_run(char kind, const char *cmd) {
+    if (kind == 'S')
+        vimcom_source(cmd);
+    else
+        vimcom_eval_expr(cmd);
+}
+
 /**
  * @brief Send the names and version numbers of currently loaded libraries to
  * Vim-R.
  */
 static void send_libnames(void) {
     LibInfo *lib;
-    unsigned long totalsz = 9;
+    unsigned long totalsz = 20;
     char *libbuf;
     lib = libList;
     do {
@@ -887,8 +2422,10 @@ static void send_libnames(void) {
 
     libbuf = malloc(totalsz + 1);
 
-    libbuf[0] = 0;
-    vimcom_strcat(libbuf, "+L");
+    lib_gen++;
+    if (lib_gen == 0)
+        lib_gen = 1;
+    snprintf(libbuf, totalsz, "+L%u ", lib_gen);
     lib = libList;
     do {
         vimcom_strcat(libbuf, lib->name);
@@ -966,6 +2503,40 @@ static void vimcom_checklibs(void) {
     return;
 }
 
+/**
+ * @brief Send again to vimrserver, after a reconnection, the lists that
+ * changed while the connection was lost or that were lost with it.
+ *
+ * @param lg Generation of the list of libraries that vimrserver has.
+ * @param gg Generation of the list of objects that vimrserver has.
+ */
+static void vimcom_resume(unsigned lg, unsigned gg) {
+    if (verbose > 1)
+        REprintf("vimcom: reconnected (libraries %u/%u, objects %u/%u)\n", lg,
+                 lib_gen, gg, glbenv_gen);
+#ifndef WIN32
+    // The ring was unmapped by vimrserver when the connection was lost
+    if (srv_local) {
+        ring_destroy();
+        ring_create();
+    }
+#endif
+    vimcom_checklibs();
+    if (needs_lib_msg || lg != lib_gen)
+        send_libnames();
+    needs_lib_msg = 0;
+    FLAG_LOCK();
+    if (gg != glbenv_gen || gg == 0)
+        glbenv_resync = 1;
+    FLAG_UNLOCK();
+    if (autoglbenv) {
+        vimcom_globalenv_list();
+        if (needs_glbenv_msg)
+            send_glb_env();
+        needs_glbenv_msg = 0;
+    }
+}
+
 /**
  * @brief Function registered to be called by R after completing each top-level
  * task. See R documentation on addTaskCallback.
@@ -1016,13 +2587,17 @@ void vimcom_task(void) {
     eval_node_t *queue = eval_queue_drain();
     int local_glbenv = flag_glbenv;
     flag_glbenv = 0;
+    int resume = flag_resume;
+    flag_resume = 0;
     FLAG_UNLOCK();
+    if (resume)
+        vimcom_resume(srv_lib_gen, srv_glb_gen);
 
     // Execute all queued commands in FIFO order (outside lock)
     while (queue) {
         eval_node_t *tmp = queue;
         queue = queue->next;
-        vimcom_eval_expr(tmp->cmd);
+        vimcom_run(tmp->kind, tmp->cmd);
         free(tmp); // matches malloc in eval_queue_push
     }
     if (local_glbenv)
@@ -1043,6 +2618,8 @@ void vimcom_task(void) {
  */
 static void vimcom_exec(__attribute__((unused)) void *nothing) {
     int local_glbenv = 0;
+    int sourced = 0;
+    int resume;
 
     FLAG_LOCK();
     eval_node_t *queue = eval_queue_drain();
@@ -1050,18 +2627,42 @@ static void vimcom_exec(__attribute__((unused)) void *nothing) {
         local_glbenv = 1;
         flag_glbenv = 0;
     }
+    resume = flag_resume;
+    flag_resume = 0;
     FLAG_UNLOCK();
 
+    if (resume)
+        vimcom_resume(srv_lib_gen, srv_glb_gen);
+
     // Execute all queued commands in FIFO order (outside lock)
     while (queue) {
         eval_node_t *tmp = queue;
         queue = queue->next;
-        vimcom_eval_expr(tmp->cmd);
+        if (tmp->kind == 'S')
+            sourced = 1;
+        vimcom_run(tmp->kind, tmp->cmd);
         free(tmp);
     }
 
-    if (local_glbenv)
+    // Sourced code is not a top level task: vimcom_task won't be called.
+    if (sourced && nrs_port[0] != 0) {
+        vimcom_checklibs();
+        if (needs_lib_msg)
+            send_libnames();
+        needs_lib_msg = 0;
+        if (autoglbenv)
+            local_glbenv = 1;
+    }
+
+    if (local_glbenv) {
         vimcom_globalenv_list();
+        // Don't wait for the next top level command. There will be none
+        // after sourced code.
+        if (needs_glbenv_msg && (sourced || glbenv_resync)) {
+            send_glb_env();
+            needs_glbenv_msg = 0;
+        }
+    }
 
     if (flag_debug) {
         SrcrefInfo();
@@ -1204,6 +2805,65 @@ static void vimcom_send_running_info(const char *r_info, const char *nvv) {
     send_to_vim(msg);
 }
 
+/**
+ * @brief Evaluate an expression received from vimrserver as soon as R can do
+ * it.
+ *
+ * @param cmd The expression.
+ * @param req Id of the request whose answer vimrserver waits for (0: none).
+ * Queued requests not evaluated yet are dropped: only the last one matters.
+ * @param kind 'E' for an expression, 'S' for code to be sourced.
+ */
+static void vimcom_queue_eval(const char *cmd, unsigned long req, char kind) {
+#ifdef WIN32
+    // On Windows (RStudio), 'E' must execute immediately on the TCP
+    // thread — deferring to vimcom_task deadlocks because R is idle
+    // waiting for console input. Temporarily set R_CStackStart to
+    // the current stack frame so R_CheckStack sees a small delta
+    // instead of a garbage ~1.6 GB value (BUG-62).
+    FLAG_LOCK();
+    int busy = r_is_busy;
+    // Auto-reset stale r_is_busy after 5 seconds. This recovers
+    // from RStudio interrupt killing the task callback, which
+    // would otherwise leave r_is_busy stuck at 1 permanently.
+    if (busy && difftime(time(NULL), busy_since) > 5.0) {
+        if (verbose > 1)
+            REprintf("vimcom: auto-reset stale r_is_busy "
+                     "(stuck for >5s)\n");
+        busy = 0;
+    }
+    if (!busy) {
+        r_is_busy = 1;
+        busy_since = time(NULL);
+    }
+    FLAG_UNLOCK();
+    if (!busy) {
+        uintptr_t saved_stack_start = R_CStackStart;
+        R_CStackStart = (uintptr_t)&saved_stack_start;
+        vimcom_run(kind, cmd);
+        R_CStackStart = saved_stack_start;
+        // Do NOT set r_is_busy = 0 here. sendToConsole is async --
+        // R's main thread may still be executing the queued code.
+        // vimcom_task sets r_is_busy = 0 when R is truly idle.
+        return;
+    }
+    // R is busy (vimcom_task or prior eval). Enqueue for main
+    // thread. vimcom_task drains the queue each cycle.
+#endif
+    FLAG_LOCK();
+    if (req)
+        eval_queue_drop_requests();
+    eval_node_t *node = eval_queue_push(cmd);
+    if (node) {
+        node->req = req;
+        node->kind = kind;
+    }
+    FLAG_UNLOCK();
+#ifndef WIN32
+    vimcom_fire();
+#endif
+}
+
 /**
  * @brief Parse messages received from vimrserver
  *
@@ -1237,6 +2897,15 @@ static void vimcom_parse_received_msg(char *buf) {
         FLAG_UNLOCK();
 #ifndef WIN32
         vimcom_fire();
+#endif
+        break;
+    case 'F': // vimrserver cannot apply the changes: send the whole list
+        FLAG_LOCK();
+        glbenv_resync = 1;
+        flag_glbenv = 1;
+        FLAG_UNLOCK();
+#ifndef WIN32
+        vimcom_fire();
 #endif
         break;
 #ifdef WIN32
@@ -1280,53 +2949,71 @@ static void vimcom_parse_received_msg(char *buf) {
         p++;
         if (strstr(p, vimr_id) == p) {
             p += strlen(vimr_id);
-#ifdef WIN32
-            // On Windows (RStudio), 'E' must execute immediately on the TCP
-            // thread — deferring to vimcom_task deadlocks because R is idle
-            // waiting for console input. Temporarily set R_CStackStart to
-            // the current stack frame so R_CheckStack sees a small delta
-            // instead of a garbage ~1.6 GB value (BUG-62).
-            FLAG_LOCK();
-            int busy = r_is_busy;
-            // Auto-reset stale r_is_busy after 5 seconds. This recovers
-            // from RStudio interrupt killing the task callback, which
-            // would otherwise leave r_is_busy stuck at 1 permanently.
-            if (busy && difftime(time(NULL), busy_since) > 5.0) {
-                if (verbose > 1)
-                    REprintf("vimcom: auto-reset stale r_is_busy "
-                             "(stuck for >5s)\n");
-                busy = 0;
-            }
-            if (!busy) {
-                r_is_busy = 1;
-                busy_since = time(NULL);
-            }
-            FLAG_UNLOCK();
-            if (!busy) {
-                uintptr_t saved_stack_start = R_CStackStart;
-                R_CStackStart = (uintptr_t)&saved_stack_start;
-                vimcom_eval_expr(p);
-                R_CStackStart = saved_stack_start;
-                // Do NOT set r_is_busy = 0 here. sendToConsole is async --
-                // R's main thread may still be executing the queued code.
-                // vimcom_task sets r_is_busy = 0 when R is truly idle.
-            } else {
-                // R is busy (vimcom_task or prior eval). Enqueue for main
-                // thread. vimcom_task drains the queue each cycle.
-                FLAG_LOCK();
-                eval_queue_push(p);
-                FLAG_UNLOCK();
+            vimcom_queue_eval(p, 0, 'E');
+        } else {
+            REprintf("vimcom: received invalid VIMR_ID\n");
+        }
+        break;
+    case 'S': // source code: "<call>\002<code>"
+        p = buf;
+        p++;
+        if (strstr(p, vimr_id) == p) {
+            p += strlen(vimr_id);
+            vimcom_queue_eval(p, 0, 'S');
+        } else {
+            REprintf("vimcom: received invalid VIMR_ID\n");
+        }
+        break;
+    case 'R': // Request for the arguments of a function: "<id> <name>"
+        p = buf;
+        p++;
+        if (strstr(p, vimr_id) == p) {
+            char *nm;
+            p += strlen(vimr_id);
+            unsigned long req = strtoul(p, &nm, 10);
+            if (req && *nm == ' ') {
+                char req_cmd[512];
+                snprintf(req_cmd, sizeof(req_cmd),
+                         "vimcom:::vim.GlobalEnv.fun.args(\"%s\", %lu)",
+                         nm + 1, req);
+                vimcom_queue_eval(req_cmd, req, 'E');
             }
-#else
+        }
+        break;
+    case 'H': // Answer to "+H": "<libraries generation> <objects generation>"
+        p = buf;
+        p++;
+        if (strstr(p, vimr_id) == p) {
+            unsigned lg, gg;
+            p += strlen(vimr_id);
+            if (sscanf(p, "%u %u", &lg, &gg) != 2)
+                break;
             FLAG_LOCK();
-            eval_queue_push(p);
+            if (resuming) { // Ignored after the first connection
+                resuming = 0;
+                srv_lib_gen = lg;
+                srv_glb_gen = gg;
+                flag_resume = 1;
+            }
             FLAG_UNLOCK();
+#ifndef WIN32
             vimcom_fire();
 #endif
-        } else {
-            REprintf("vimcom: received invalid VIMR_ID\n");
         }
         break;
+    case 'X': // The answers to previous requests are no longer needed
+        FLAG_LOCK();
+        eval_queue_drop_requests();
+        FLAG_UNLOCK();
+        break;
+#ifndef WIN32
+    case 'M': // vimrserver mapped the ring buffer
+        SQ_LOCK();
+        if (ring)
+            ring_ok = 1;
+        SQ_UNLOCK();
+        break;
+#endif
     default: // do nothing
         REprintf("\nError [vimcom]: Invalid message received: %s\n", buf);
         break;
@@ -1348,10 +3035,185 @@ static int recv_exact(int fd, char *buf, int n) {
     return total;
 }
 
+/**
+ * @brief Add a part of a big message from vimrserver to the message being
+ * reassembled: "P<VIMR_ID><number> <bytes>", or "Q..." for the last part.
+ *
+ * @param body The part.
+ * @param len Its size.
+ * @param bm Buffer with the message being reassembled.
+ * @param bm_len Number of bytes in the buffer.
+ * @param bm_cap Size of the buffer.
+ * @param bm_id Number of the message in the buffer.
+ * @return 1 if the message is complete.
+ */
+static int reassemble(const char *body, size_t len, char **bm, size_t *bm_len,
+                      size_t *bm_cap, unsigned long *bm_id) {
+    const char *vimr_id = getenv("VIMR_ID");
+    size_t idl = vimr_id ? strlen(vimr_id) : 0;
+    char *p;
+
+    if (!vimr_id || len < idl + 3 || memcmp(body + 1, vimr_id, idl) != 0)
+        return 0;
+    unsigned long id = strtoul(body + 1 + idl, &p, 10);
+    if (*p != ' ')
+        return 0;
+    p++;
+    size_t n = len - (p - body);
+
+    if (id != *bm_id) { // Parts of an incomplete message are discarded
+        *bm_id = id;
+        *bm_len = 0;
+    }
+    if (*bm_len + n + 1 > MAX_EVAL_CMD) {
+        REprintf("vimcom: message from vimrserver too big\n");
+        *bm_id = 0;
+        return 0;
+    }
+    if (*bm_len + n + 1 > *bm_cap) {
+        size_t cap = *bm_cap ? *bm_cap : 65536;
+        while (cap < *bm_len + n + 1)
+            cap *= 2;
+        char *tmp = realloc(*bm, cap);
+        if (!tmp) {
+            REprintf("vimcom: realloc failed for %zu bytes\n", cap);
+            *bm_id = 0;
+            return 0;
+        }
+        *bm = tmp;
+        *bm_cap = cap;
+    }
+    memcpy(*bm + *bm_len, p, n);
+    *bm_len += n;
+    if (body[0] != 'Q')
+        return 0;
+    (*bm)[*bm_len] = 0;
+    *bm_id = 0;
+    return 1;
+}
+
+/**
+ * @brief Connect again to vimrserver after the connection was lost. Nothing
+ * is sent while there is no connection. The first message in the new
+ * connection is the greeting "+H<session>" (see RECONNECT_MAX).
+ *
+ * @return 1 if connected and 0 if vimcom is stopping or the time is over.
+ */
+static int vimcom_reconnect(void) {
+    int closed = 0;
+    char msg[80];
+
+    SQ_LOCK();
+    sq_dead = 1;
+    sq_clear();
+#ifndef WIN32
+    ring_ok = 0;
+    shutdown(sfd, SHUT_RDWR); // The sender might be waiting to write
+#else
+    shutdown(sfd, SD_BOTH);
+#endif
+    SQ_UNLOCK();
+    if (verbose > 1)
+        REprintf("vimcom: connection with vimrserver lost\n");
+
+    for (int t = 0; t < RECONNECT_MAX * 2; t++) {
+        // Close the old socket only after the sender stopped writing to it
+        SQ_LOCK();
+        int stop = stopping;
+        if (!stop && !closed && !sq_busy) {
+#ifdef WIN32
+            closesocket(sfd);
+#else
+            close(sfd);
+#endif
+            sfd = -1;
+            closed = 1;
+        }
+        SQ_UNLOCK();
+        if (stop)
+            return 0;
+#ifdef WIN32
+        Sleep(500);
+        SOCKET fd;
+#else
+        usleep(500000);
+        int fd;
+#endif
+        if (!closed)
+            continue;
+
+#ifndef WIN32
+        if (srv_local) {
+            struct sockaddr_un su;
+            const char *nrs_sock = getenv("VIMR_SOCKET");
+            if (!nrs_sock || strlen(nrs_sock) >= sizeof(su.sun_path))
+                return 0;
+            memset(&su, '\0', sizeof(su));
+            su.sun_family = AF_UNIX;
+            strcpy(su.sun_path, nrs_sock);
+            fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd == -1)
+                continue;
+            if (connect(fd, (struct sockaddr *)&su, sizeof(su)) != 0) {
+                close(fd);
+                continue;
+            }
+        } else
+#endif
+        {
+            fd = socket(AF_INET, SOCK_STREAM, 0);
+            if (fd == -1)
+                continue;
+            if (connect(fd, (struct sockaddr *)&srv_addr, sizeof(srv_addr)) !=
+                0) {
+#ifdef WIN32
+                closesocket(fd);
+#else
+                close(fd);
+#endif
+                continue;
+            }
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const char *)&one,
+                       sizeof(one));
+        }
+
+        snprintf(msg, sizeof(msg), "+H%s", session);
+        send_node_t *node = sq_node_new(msg, strlen(msg));
+        SQ_LOCK();
+        if (stopping || !node) {
+            SQ_UNLOCK();
+            free(node);
+#ifdef WIN32
+            closesocket(fd);
+#else
+            close(fd);
+#endif
+            return 0;
+        }
+        sfd = fd;
+        sq_dead = 0;
+        sq_head = sq_tail = node;
+        sq_bytes = node->len;
+        SQ_SIGNAL();
+        SQ_UNLOCK();
+        FLAG_LOCK();
+        resuming = 1;
+        FLAG_UNLOCK();
+        if (verbose > 1)
+            REprintf("vimcom: connected again to vimrserver\n");
+        return 1;
+    }
+    if (verbose > 1)
+        REprintf("vimcom: could not connect again to vimrserver\n");
+    return 0;
+}
+
 #ifdef WIN32
 /**
  * @brief Loop to receive TCP messages from vimrserver.
- * Messages are framed: 8-byte hex length header + body.
+ * Messages are framed: 8-byte hex length header + body. Messages bigger than
+ * 16 KB are received in parts and reassembled.
  *
  * @param unused Unused parameter.
  */
@@ -1359,7 +3221,8 @@ static DWORD WINAPI client_loop_thread(__attribute__((unused)) void *arg)
 #else
 /**
  * @brief Loop to receive TCP messages from vimrserver.
- * Messages are framed: 8-byte hex length header + body.
+ * Messages are framed: 8-byte hex length header + body. Messages bigger than
+ * 16 KB are received in parts and reassembled.
  *
  * @param unused Unused parameter.
  */
@@ -1369,11 +3232,19 @@ static void *client_loop_thread(__attribute__((unused)) void *arg)
     char header[9];
     char *body = NULL;
     size_t body_cap = 0;
+    char *bm = NULL; // Big message being reassembled
+    size_t bm_len = 0, bm_cap = 0;
+    unsigned long bm_id = 0;
 
     for (;;) {
         // 1. Read 8-byte hex length header
-        if (recv_exact(sfd, header, 8) <= 0)
+        if (recv_exact(sfd, header, 8) <= 0) {
+            if (vimcom_reconnect()) {
+                bm_id = 0; // The rest of a big message will not come
+                continue;
+            }
             break;
+        }
         header[8] = '\0';
 
         // 2. Parse length (hard upper limit: 64 KB)
@@ -1394,8 +3265,13 @@ static void *client_loop_thread(__attribute__((unused)) void *arg)
         }
 
         // 4. Read exactly msg_len bytes
-        if (recv_exact(sfd, body, (int)msg_len) <= 0)
+        if (recv_exact(sfd, body, (int)msg_len) <= 0) {
+            if (vimcom_reconnect()) {
+                bm_id = 0;
+                continue;
+            }
             break;
+        }
         body[msg_len] = '\0';
 
         // 5. Check for shutdown command (Windows)
@@ -1405,10 +3281,21 @@ static void *client_loop_thread(__attribute__((unused)) void *arg)
 #endif
 
         // 6. Dispatch
-        vimcom_parse_received_msg(body);
+        if (body[0] == 'P' || body[0] == 'Q') {
+            if (reassemble(body, msg_len, &bm, &bm_len, &bm_cap, &bm_id))
+                vimcom_parse_received_msg(bm);
+            if (bm_cap > 1048576 && !bm_id) { // Don't keep a huge buffer
+                free(bm);
+                bm = NULL;
+                bm_cap = bm_len = 0;
+            }
+        } else {
+            vimcom_parse_received_msg(body);
+        }
     }
 
     free(body);
+    free(bm);
     // Free any queued commands that will never be executed
     FLAG_LOCK();
     eval_node_t *abandoned = eval_queue_drain();
@@ -1443,12 +3330,15 @@ static void *client_loop_thread(__attribute__((unused)) void *arg)
  * @param dbg Should detect when `broser()` is running and start debugging
  * mode? (`R_debug` in init.vim)
  *
+ * @param cmp Should big messages to a remote vimrserver be compressed?
+ * (`R_remote_compress` in init.vim)
+ *
  * @param nvv vimcom version
  *
  * @param rinfo Information on R to be passed to vim.
  */
 SEXP vimcom_Start(SEXP vrb, SEXP anm, SEXP swd, SEXP age, SEXP dbg, SEXP imd,
-                  SEXP szl, SEXP tml, SEXP nvv, SEXP rinfo) {
+                  SEXP szl, SEXP tml, SEXP cmp, SEXP nvv, SEXP rinfo) {
     verbose = *INTEGER(vrb);
     allnames = *INTEGER(anm);
     setwidth = *INTEGER(swd);
@@ -1458,6 +3348,7 @@ SEXP vimcom_Start(SEXP vrb, SEXP anm, SEXP swd, SEXP age, SEXP dbg, SEXP imd,
     maxdepth = *INTEGER(imd);
     sizelimit = *INTEGER(szl);
     timelimit = (double)*INTEGER(tml);
+    compress = *INTEGER(cmp);
 
     if (getenv("VIMR_TMPDIR")) {
         strncpy(tmpdir, getenv("VIMR_TMPDIR"), 500);
@@ -1491,6 +3382,8 @@ SEXP vimcom_Start(SEXP vrb, SEXP anm, SEXP swd, SEXP age, SEXP dbg, SEXP imd,
             REprintf("  VIMR_IP_ADDRESS: %s\n", getenv("VIMR_IP_ADDRESS"));
         }
         REprintf("  VIMR_PORT: %s\n", nrs_port);
+        if (getenv("VIMR_SOCKET"))
+            REprintf("  VIMR_SOCKET: %s\n", getenv("VIMR_SOCKET"));
         REprintf("  VIMR_ID: %s\n", getenv("VIMR_ID"));
         REprintf("  VIMR_TMPDIR: %s\n", tmpdir);
         REprintf("  VIMR_COMPLDIR: %s\n", getenv("VIMR_COMPLDIR"));
@@ -1500,8 +3393,7 @@ SEXP vimcom_Start(SEXP vrb, SEXP anm, SEXP swd, SEXP age, SEXP dbg, SEXP imd,
     tcp_header_len = strlen(vimsecr) + 9;
     glbnvbuf1 = (char *)calloc(glbnvbufsize, sizeof(char));
     glbnvbuf2 = (char *)calloc(glbnvbufsize, sizeof(char));
-    send_ge_buf = (char *)calloc(glbnvbufsize + 64, sizeof(char));
-    if (!glbnvbuf1 || !glbnvbuf2 || !send_ge_buf)
+    if (!glbnvbuf1 || !glbnvbuf2)
         REprintf("vimcom: Error allocating memory.\n");
 
 #ifndef WIN32
@@ -1517,9 +3409,37 @@ SEXP vimcom_Start(SEXP vrb, SEXP anm, SEXP swd, SEXP age, SEXP dbg, SEXP imd,
 #endif
 
     static int failure = 0;
+    int connected = 0;
+
+#ifndef WIN32
+    int local = 0;
+
+    // Local sessions connect to the Unix domain socket of vimrserver, which
+    // is in the tmpdir only accessible by the user.
+    const char *nrs_sock = getenv("VIMR_SOCKET");
+    if (nrs_sock && nrs_sock[0] && !getenv("VIMR_IP_ADDRESS")) {
+        struct sockaddr_un su;
+        sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sfd != -1 && strlen(nrs_sock) < sizeof(su.sun_path)) {
+            memset(&su, '\0', sizeof(su));
+            su.sun_family = AF_UNIX;
+            strcpy(su.sun_path, nrs_sock);
+            if (connect(sfd, (struct sockaddr *)&su, sizeof(su)) == 0)
+                connected = local = 1;
+        }
+        if (!connected) {
+            REprintf("vimcom: connection with the server failed (%s)\n",
+                     nrs_sock);
+            if (sfd != -1)
+                close(sfd);
+            sfd = -1;
+            failure = 1;
+        }
+    }
+#endif
 
-    if (atoi(nrs_port) > 0) {
-        struct sockaddr_in servaddr;
+    if (!connected && !failure && atoi(nrs_port) > 0) {
+        struct sockaddr_in *servaddr = &srv_addr;
 #ifdef WIN32
         InitializeCriticalSection(&flag_mutex);
         WSADATA d;
@@ -1531,27 +3451,26 @@ SEXP vimcom_Start(SEXP vrb, SEXP anm, SEXP swd, SEXP age, SEXP dbg, SEXP imd,
         // socket create and verification
         sfd = socket(AF_INET, SOCK_STREAM, 0);
         if (sfd != -1) {
-            memset(&servaddr, '\0', sizeof(servaddr));
+            memset(servaddr, '\0', sizeof(*servaddr));
 
             // assign IP, PORT
-            servaddr.sin_family = AF_INET;
+            servaddr->sin_family = AF_INET;
             if (getenv("VIMR_IP_ADDRESS"))
-                servaddr.sin_addr.s_addr = inet_addr(getenv("VIMR_IP_ADDRESS"));
+                servaddr->sin_addr.s_addr =
+                    inet_addr(getenv("VIMR_IP_ADDRESS"));
             else
-                servaddr.sin_addr.s_addr = inet_addr("127.0.0.1");
-            servaddr.sin_port = htons(atoi(nrs_port));
+                servaddr->sin_addr.s_addr = inet_addr("127.0.0.1");
+            servaddr->sin_port = htons(atoi(nrs_port));
 
             // connect the client socket to server socket
-            if (connect(sfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) ==
+            if (connect(sfd, (struct sockaddr *)servaddr, sizeof(*servaddr)) ==
                 0) {
-#ifdef WIN32
-                DWORD ti;
-                tid = CreateThread(NULL, 0, client_loop_thread, NULL, 0, &ti);
-#else
-                pthread_create(&tid, NULL, client_loop_thread, NULL);
-#endif
-                vimcom_send_running_info(CHAR(STRING_ELT(rinfo, 0)),
-                                         CHAR(STRING_ELT(nvv, 0)));
+                connected = 1;
+                remote = getenv("VIMR_IP_ADDRESS") != NULL;
+                // Each message is written at once: don't wait for ACKs
+                int one = 1;
+                setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, (const char *)&one,
+                           sizeof(one));
             } else {
                 REprintf("vimcom: connection with the server failed (%s)\n",
                          nrs_port);
@@ -1563,6 +3482,28 @@ SEXP vimcom_Start(SEXP vrb, SEXP anm, SEXP swd, SEXP age, SEXP dbg, SEXP imd,
         }
     }
 
+    if (connected) {
+        char hello[80];
+        snprintf(session, sizeof(session), "%d.%ld", (int)getpid(),
+                 (long)time(NULL));
+        snprintf(hello, sizeof(hello), "+H%s", session);
+        sender_start();
+        send_to_vim(hello);
+#ifndef WIN32
+        srv_local = local;
+        if (local)
+            ring_create();
+#endif
+#ifdef WIN32
+        DWORD ti;
+        tid = CreateThread(NULL, 0, client_loop_thread, NULL, 0, &ti);
+#else
+        pthread_create(&tid, NULL, client_loop_thread, NULL);
+#endif
+        vimcom_send_running_info(CHAR(STRING_ELT(rinfo, 0)),
+                                 CHAR(STRING_ELT(nvv, 0)));
+    }
+
     if (failure == 0) {
         initialized = 1;
 #ifdef WIN32
@@ -1607,10 +3548,19 @@ void vimcom_Stop(void) {
 #endif
 
     if (initialized) {
+        // client_loop_thread() must not connect again
+        if (sq_started) {
+            SQ_LOCK();
+            stopping = 1;
+            SQ_UNLOCK();
+        } else {
+            stopping = 1;
+        }
 #ifdef WIN32
         // Signal the thread to exit by closing the socket, which causes
         // recv_exact to return -1, breaking client_loop_thread's loop.
         closesocket(sfd);
+        sender_stop();
         sfd = -1;
         if (WaitForSingleObject(tid, 5000) == WAIT_TIMEOUT)
             TerminateThread(tid, 0);
@@ -1624,9 +3574,12 @@ void vimcom_Stop(void) {
 #else
         if (debug_r)
             ptr_R_ReadConsole = save_ptr_R_ReadConsole;
+        shutdown(sfd, SHUT_RDWR);
+        sender_stop();
         close(sfd);
         pthread_cancel(tid);
         pthread_join(tid, NULL);
+        ring_destroy();
         // Free any queued commands that will never be executed
         FLAG_LOCK();
         eval_node_t *abandoned_unix = eval_queue_drain();
@@ -1648,8 +3601,9 @@ void vimcom_Stop(void) {
             free(glbnvbuf1);
         if (glbnvbuf2)
             free(glbnvbuf2);
-        if (send_ge_buf)
-            free(send_ge_buf);
+        free(send_ge_buf);
+        free(glbnvblk1.off);
+        free(glbnvblk2.off);
         if (verbose)
             REprintf("vimcom stopped\n");
     }
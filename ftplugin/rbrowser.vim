@@ -9,6 +9,8 @@ endif
 b:did_ftplugin = 1
 
 g:rplugin.ob_upobcnt = 0
+g:rplugin.ob_viewport = ''
+g:rplugin.ob_filled = []
 
 var cpo_save = &cpo
 set cpo&vim
@@ -38,7 +40,9 @@ endif
 if !exists("g:did_vimr_rbrowser_functions")
     g:did_vimr_rbrowser_functions = 1
 
-    def g:UpdateOB(what: string): string
+    # vimrserver sends the lines when g:R_objbr_stream is set. Otherwise,
+    # they are read from the globenv_ or liblist_ file.
+    def g:UpdateOB(what: string, lines: list<string> = []): string
         var wht: string
         if what == "both"
             wht = g:rplugin.curview
@@ -62,17 +66,19 @@ if !exists("g:did_vimr_rbrowser_functions")
             return "Object_Browser not listed"
         endif
 
-        var fcntt: list<string>
-        try
-            if wht == "GlobalEnv"
-                fcntt = readfile(g:rplugin.localtmpdir .. "/globenv_" .. $VIMR_ID)
-            else
-                fcntt = readfile(g:rplugin.localtmpdir .. "/liblist_" .. $VIMR_ID)
-            endif
-        catch
-            g:rplugin.ob_upobcnt = 0
-            return "Error reading OB file: " .. v:exception
-        endtry
+        var fcntt = lines
+        if empty(fcntt)
+            try
+                if wht == "GlobalEnv"
+                    fcntt = readfile(g:rplugin.localtmpdir .. "/globenv_" .. $VIMR_ID)
+                else
+                    fcntt = readfile(g:rplugin.localtmpdir .. "/liblist_" .. $VIMR_ID)
+                endif
+            catch
+                g:rplugin.ob_upobcnt = 0
+                return "Error reading OB file: " .. v:exception
+            endtry
+        endif
         if has_key(g:rplugin, "curbuf") && g:rplugin.curbuf != "Object_Browser"
             savesb = &switchbuf
             set switchbuf=useopen,usetab
@@ -99,6 +105,96 @@ if !exists("g:did_vimr_rbrowser_functions")
         return ""
     enddef
 
+    # Replace ndel lines starting at line start with new lines. vimrserver
+    # sends only the lines that changed since the last update; if the buffer
+    # doesn't have the oldn lines it had then, the whole view is read again.
+    def g:PatchOB(what: string, oldn: number, start: number, ndel: number, lines: list<string>): string
+        if g:rplugin.curview != what
+            return "curview != what"
+        endif
+        if g:rplugin.ob_upobcnt
+            return "OB called twice"
+        endif
+        var bnr = bufnr("Object_Browser")
+        if bnr < 0
+            return "Object_Browser not listed"
+        endif
+        if getbufinfo(bnr)[0].linecount != oldn
+            if !get(g:, 'R_objbr_stream', 0)
+                return g:UpdateOB(what)
+            endif
+            # There is no file to read: ask for all lines
+            if g:IsJobRunning("Server")
+                g:JobStdin(g:rplugin.jobs["Server"], what == "GlobalEnv" ? "31\n" : "32\n")
+            endif
+            return "resend"
+        endif
+
+        var nset = min([ndel, len(lines)])
+        setbufvar(bnr, "&modifiable", 1)
+        if nset > 0
+            setbufline(bnr, start, lines[0 : nset - 1])
+        endif
+        if ndel > nset
+            deletebufline(bnr, start + nset, start + ndel - 1)
+        elseif len(lines) > nset
+            appendbufline(bnr, start + nset - 1, lines[nset :])
+        endif
+        setbufvar(bnr, "&modifiable", 0)
+        return ""
+    enddef
+
+    # Views too long are rendered by vimrserver only around the visible rows:
+    # the buffer gets nrows lines, but only the header, the parents of the
+    # first rendered row (arows and alines) and the rows starting at first
+    # are filled. The other ones are left empty.
+    def g:FillOB(what: string, nrows: number, arows: list<number>, alines: list<string>, first: number, lines: list<string>): string
+        if g:rplugin.curview != what
+            return "curview != what"
+        endif
+        if g:rplugin.ob_upobcnt
+            return "OB called twice"
+        endif
+        var bnr = bufnr("Object_Browser")
+        if bnr < 0
+            return "Object_Browser not listed"
+        endif
+
+        setbufvar(bnr, "&modifiable", 1)
+        var n = getbufinfo(bnr)[0].linecount
+        if n > nrows
+            deletebufline(bnr, nrows + 1, "$")
+        elseif n < nrows
+            appendbufline(bnr, n, repeat([""], nrows - n))
+        endif
+        # Clear the rows filled last time
+        for r in get(g:rplugin, "ob_filled", [])
+            if r[0] <= nrows
+                setbufline(bnr, r[0], repeat([""], min([r[1], nrows]) - r[0] + 1))
+            endif
+        endfor
+        for i in range(len(arows))
+            setbufline(bnr, arows[i], alines[i])
+        endfor
+        setbufline(bnr, first, lines)
+        g:rplugin.ob_filled = [[first, first + len(lines) - 1]] + mapnew(arows, (_, r) => [r, r])
+        setbufvar(bnr, "&modifiable", 0)
+        return ""
+    enddef
+
+    # Tell vimrserver what rows are visible for it to render them if the view
+    # is too long to be entirely rendered.
+    def g:OBViewport()
+        var vp = line("w0") .. "," .. line("w$")
+        if vp == get(g:rplugin, "ob_viewport", "")
+            return
+        endif
+        g:rplugin.ob_viewport = vp
+        if g:IsJobRunning("Server")
+            g:JobStdin(g:rplugin.jobs["Server"], "38" .. vp .. "\n")
+        endif
+    enddef
+
     def g:RBrowserDoubleClick()
         if line(".") == 2
             return
@@ -308,6 +404,28 @@ if !exists("g:did_vimr_rbrowser_functions")
             g:JobStdin(g:rplugin.jobs["Server"], "37\n")
         endif
     enddef
+
+    # Show only the objects whose names match the pattern, and their parents:
+    # "^pat" matches the start of names, "~pat" matches the characters of pat
+    # in the same order (ignoring case) and "pat" matches any part of names.
+    # Without pattern, all objects are shown again.
+    def g:RObjFilter(pattern: string)
+        var mode = "s"
+        var pat = pattern
+        if pat =~ '^\^'
+            mode = "p"
+            pat = pat[1 :]
+        elseif pat =~ '^\~'
+            mode = "f"
+            pat = pat[1 :]
+        endif
+        var view = g:rplugin.curview == "GlobalEnv" ? "G" : "L"
+        if g:IsJobRunning("Server")
+            g:JobStdin(g:rplugin.jobs["Server"], "35" .. view .. mode .. pat .. "\n")
+        endif
+    enddef
+
+    command -nargs=? RObjFilter g:RObjFilter(<q-args>)
 endif
 
 nnoremap <buffer><silent> <CR> :call g:RBrowserDoubleClick()<CR>
@@ -327,6 +445,10 @@ endif
 
 autocmd BufEnter <buffer> stopinsert
 autocmd BufUnload <buffer> g:OnOBBufUnload()
+autocmd CursorMoved <buffer> g:OBViewport()
+if exists('##WinScrolled')
+    autocmd WinScrolled <buffer> g:OBViewport()
+endif
 
 g:rplugin.ob_reserved = '\(if\|else\|repeat\|while\|function\|for\|in\|next\|break\|TRUE\|FALSE\|NULL\|Inf\|NaN\|NA\|NA_integer_\|NA_real_\|NA_complex_\|NA_character_\)'
 g:rplugin.ob_punct = '\(!\|''\|"\|#\|%\|&\|(\|)\|\*\|+\|,\|-\|/\|\\\|:\|;\|<\|=\|>\|?\|@\|\[\|/\|\]\|\^\|\$\|{\||\|}\|\~\)'
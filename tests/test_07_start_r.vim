@@ -196,6 +196,22 @@ for srline in start_r_lines
 endfor
 g:Assert(rpid_guard_found, 'SetSendCmdToR must guard against stale timers via R_pid check')
 
+# ========================================================================
+# RSetMyPort must export the Unix domain socket of local sessions
+# ========================================================================
+var in_setmyport = false
+var exports_socket = false
+for spline in start_r_lines
+  if spline =~ 'def g:RSetMyPort('
+    in_setmyport = true
+  elseif in_setmyport && spline =~ '^\s*enddef\s*$'
+    break
+  elseif in_setmyport && spline =~ '\$VIMR_SOCKET = sock'
+    exports_socket = true
+  endif
+endfor
+g:Assert(exports_socket, 'RSetMyPort must set $VIMR_SOCKET for vimcom')
+
 # ========================================================================
 # SetVimcomInfo must cancel the vimcom timeout timer
 # ========================================================================
@@ -98,6 +98,44 @@ if has_key(g:rplugin, 'update_glbenv')
   g:rplugin.update_glbenv = 0
 endif
 
+# g:PatchOB (defined by ftplugin/rbrowser.vim) applies vimrserver's diffs
+if exists('*g:PatchOB')
+  var save_curview = get(g:rplugin, 'curview', 'None')
+  g:rplugin.curview = 'GlobalEnv'
+  enew
+  setlocal buftype=nofile bufhidden=wipe
+  file Object_Browser
+  setline(1, ['.GlobalEnv | Libraries', '', '   {#a', '   {#b', '   {#c'])
+  setlocal nomodifiable
+  g:AssertEqual(g:PatchOB('GlobalEnv', 5, 4, 1, ["   {#b'", '   {#bb']), '', 'PatchOB: change and insert')
+  g:AssertEqual(getline(1, '$'), ['.GlobalEnv | Libraries', '', '   {#a', "   {#b'", '   {#bb', '   {#c'], 'PatchOB: lines after insert')
+  g:PatchOB('GlobalEnv', 6, 3, 2, [])
+  g:AssertEqual(getline(1, '$'), ['.GlobalEnv | Libraries', '', '   {#bb', '   {#c'], 'PatchOB: lines after delete')
+  g:Assert(!&modifiable, 'PatchOB: buffer left nomodifiable')
+  g:AssertEqual(g:PatchOB('libraries', 4, 3, 1, []), 'curview != what', 'PatchOB: other view ignored')
+
+  # g:FillOB fills only the header, the parents and the rendered window
+  g:rplugin.ob_filled = []
+  g:FillOB('GlobalEnv', 10, [1, 2, 4], ['.GlobalEnv | Libraries', '', '   [#lst'], 7, ['   |- {#x', '   `- {#y'])
+  g:AssertEqual(line('$'), 10, 'FillOB: buffer has nrows lines')
+  g:AssertEqual(getline(4), '   [#lst', 'FillOB: parent row filled')
+  g:AssertEqual(getline(7, 8), ['   |- {#x', '   `- {#y'], 'FillOB: window filled')
+  g:FillOB('GlobalEnv', 6, [1, 2], ['.GlobalEnv | Libraries', ''], 3, ['   {#z'])
+  g:AssertEqual(getline(1, '$'), ['.GlobalEnv | Libraries', '', '   {#z', '', '', ''], 'FillOB: old rows cleared')
+
+  # g:UpdateOB uses the lines streamed by vimrserver instead of reading a file
+  var save_upobcnt = get(g:rplugin, 'ob_upobcnt', 0)
+  var save_curbuf = get(g:rplugin, 'curbuf', '')
+  g:rplugin.ob_upobcnt = 0
+  g:rplugin.curbuf = 'Object_Browser'
+  g:AssertEqual(g:UpdateOB('GlobalEnv', ['.GlobalEnv | Libraries', '', '   {#s']), '', 'UpdateOB: streamed lines')
+  g:AssertEqual(getline(1, '$'), ['.GlobalEnv | Libraries', '', '   {#s'], 'UpdateOB: buffer replaced')
+  g:rplugin.ob_upobcnt = save_upobcnt
+  g:rplugin.curbuf = save_curbuf
+  g:rplugin.curview = save_curview
+  bwipeout!
+endif
+
 # ========================================================================
 # syntax/rdocpreview.vim (sourced explicitly by the plugin, not by ft)
 # ========================================================================
@@ -0,0 +1,221 @@
+vim9script
+# Integration test of the connection between vimrserver and vimcom. The
+# server is built from R/vimcom/src/apps/vimrserver.c and this Vim plays the
+# role of vimcom through a raw TCP channel.
+
+g:SetSuite('vimrserver')
+
+var src = expand('<sfile>:p:h:h') .. '/R/vimcom/src/apps/vimrserver.c'
+var cc = executable('cc') ? 'cc' : (executable('gcc') ? 'gcc' : '')
+
+var srv_out = ''
+var tcp_in = ''
+var secret = ''
+var requests: list<string> = []
+var parts: list<string> = []
+var streamed = ''
+var sourced: list<string> = []
+var hellos: list<string> = []
+var order: list<string> = []
+var bigmsg = ''
+
+def SrvOut(_ch: channel, msg: string)
+  srv_out ..= msg
+enddef
+
+def SendToServer(ch: channel, body: string)
+  ch_sendraw(ch, secret .. printf('%09d', len(body)) .. body .. "\x11")
+enddef
+
+# Answer each message from vimrserver at once, as vimcom would do, except
+# the requests for function arguments, which are answered by the test, and
+# the parts of big messages, which are reassembled.
+def TcpIn(ch: channel, msg: string)
+  tcp_in ..= msg
+  while len(tcp_in) >= 8
+    var n = str2nr(tcp_in[0 : 7], 16)
+    if len(tcp_in) < 8 + n
+      break
+    endif
+    var body = tcp_in[8 : 7 + n]
+    tcp_in = tcp_in[8 + n :]
+    if body =~ '^[PQ]test15'
+      add(parts, body)
+      streamed ..= matchstr(body, '^.test15\d\+ \zs.*')
+      bigmsg ..= matchstr(body, '^.test15\d\+ \zs.*')
+      if body[0] == 'Q'
+        add(order, 'big')
+        if bigmsg =~ '^Stest15'
+          add(sourced, bigmsg[7 :])
+        endif
+        bigmsg = ''
+      endif
+    elseif body =~ '^Rtest15'
+      add(requests, body[7 :])
+    elseif body =~ '^Stest15'
+      add(sourced, body[7 :])
+    elseif body =~ '^Htest15'
+      add(hellos, body[7 :])
+    elseif body[0] != 'X'
+      add(order, body)
+      SendToServer(ch, 'g:Pong(' .. body .. ')')
+    endif
+  endwhile
+enddef
+
+def WaitRequests(n: number): bool
+  var t = reltime()
+  while len(requests) < n && reltimefloat(reltime(t)) < 2
+    sleep 1m
+  endwhile
+  return len(requests) >= n
+enddef
+
+# Greet vimrserver as vimcom does on each connection and get the answer
+def Hello(c: channel, session: string): string
+  hellos = []
+  SendToServer(c, '+H' .. session)
+  var t = reltime()
+  while hellos == [] && reltimefloat(reltime(t)) < 2
+    sleep 1m
+  endwhile
+  return get(hellos, 0, '')
+enddef
+
+def WaitFor(pat: string, ms: number): bool
+  var t = reltime()
+  while srv_out !~ pat && reltimefloat(reltime(t)) * 1000 < ms
+    sleep 1m
+  endwhile
+  return srv_out =~ pat
+enddef
+
+if !has('channel') || has('win32') || cc == '' || !filereadable(src)
+  echomsg 'vimrserver: skipped (no channel support or C compiler)'
+else
+  var dir = tempname()
+  mkdir(dir, 'p', 0o700)
+  var bin = dir .. '/vimrserver'
+  system(cc .. ' -pthread -std=gnu99 -O2 ' .. shellescape(src) .. ' -o ' .. shellescape(bin))
+  g:AssertEqual(v:shell_error, 0, 'vimrserver builds')
+
+  var job = job_start([bin], {
+    out_mode: 'raw', out_cb: SrvOut, err_io: 'null',
+    env: {VIMR_ID: 'test15', VIMR_TMPDIR: dir, VIMR_COMPLDIR: dir,
+          VIMR_IP_ADDRESS: '127.0.0.1'}})
+  ch_sendraw(job, "1\n")
+  g:Assert(WaitFor("RSetMyPort('[0-9]\\+')", 5000), 'server listens on TCP')
+  secret = matchstr(srv_out, "\\$VIMR_SECRET = '\\zs[^']*")
+  var port = matchstr(srv_out, "RSetMyPort('\\zs[0-9]\\+")
+
+  var ch = ch_open('127.0.0.1:' .. port, {mode: 'raw', callback: TcpIn})
+  g:AssertEqual(ch_status(ch), 'open', 'connect to vimrserver')
+
+  # Small messages must not wait for delayed ACKs (~40 ms each with Nagle's
+  # algorithm and the header and body sent separately). A busy machine may
+  # slow down some round trips, but not the fastest one.
+  var rounds = 20
+  var ok = 0
+  var fastest = 1000.0
+  var t: list<any>
+  for i in range(rounds)
+    srv_out = ''
+    t = reltime()
+    ch_sendraw(job, '2' .. i .. "\n")
+    if WaitFor('g:Pong(' .. i .. ')', 2000)
+      ok += 1
+      var ms = reltimefloat(reltime(t)) * 1000
+      if ms < fastest
+        fastest = ms
+      endif
+    endif
+  endfor
+  g:AssertEqual(ok, rounds, 'every message answered')
+  g:Assert(fastest < 30, printf('fastest round trip %.1f ms', fastest))
+
+  # Arguments of .GlobalEnv functions: only the answer to the last request
+  # is shown, and the answers are cached until .GlobalEnv changes.
+  var fline = "\006\003\006function\006.GlobalEnv\006[\x12not_checked\x12]\006\006\006\n"
+  SendToServer(ch, '+Gfa' .. fline .. 'fb' .. fline)
+  sleep 50m
+  ch_sendraw(job, "6fa\002.GlobalEnv\n")
+  ch_sendraw(job, "6fb\002.GlobalEnv\n")
+  g:Assert(WaitRequests(2), 'one request per function')
+  var ids = mapnew(requests, (_, r) => matchstr(r, '^[0-9]\+'))
+  g:AssertEqual(mapnew(requests, (_, r) => matchstr(r, ' \zs.*')), ['fa', 'fb'], 'requested functions')
+  srv_out = ''
+  SendToServer(ch, '+R' .. ids[0] .. " fa\002\x12x\x12")
+  SendToServer(ch, '+R' .. ids[1] .. " fb\002\x12y\x12")
+  g:Assert(WaitFor('FinishGlbEnvFunArgs("fb"', 2000), 'answer to the last request shown')
+  g:Assert(srv_out !~ '"fa"', 'answer to a superseded request not shown')
+  srv_out = ''
+  ch_sendraw(job, "6fa\002.GlobalEnv\n")
+  g:Assert(WaitFor("FinishGlbEnvFunArgs(\"fa\", \"\x12x\x12\")", 2000), 'cached answer shown')
+  g:AssertEqual(len(requests), 2, 'cached answer not requested again')
+  SendToServer(ch, '+Gfa' .. fline)
+  sleep 50m
+  ch_sendraw(job, "6fa\002.GlobalEnv\n")
+  g:Assert(WaitRequests(3), 'cache cleared when .GlobalEnv changes')
+
+  # Big messages are sent in parts, and the messages sent after them arrive
+  # after them
+  order = []
+  var big = 'Etest15' .. repeat('0123456789', 20000)
+  ch_sendraw(job, '2' .. big .. "\n")
+  ch_sendraw(job, "2small\n")
+  t = reltime()
+  while (parts == [] || parts[-1] !~ '^Q') && reltimefloat(reltime(t)) < 5
+    sleep 1m
+  endwhile
+  g:Assert(len(parts) > 1, printf('big message sent in %d parts', len(parts)))
+  g:AssertEqual(len(filter(copy(parts), (_, v) => len(v) > 16400)), 0, 'parts are small')
+  g:Assert(streamed == big, 'big message reassembled')
+  g:Assert(WaitFor('g:Pong(small)', 2000), 'small message sent after the big one')
+  g:AssertEqual(order, ['big', 'small'], 'order of the messages kept')
+
+  # Code to be sourced reaches vimcom with its delimiters intact
+  var code = 'vimcom:::VimR.source.exprs(echo=TRUE)' .. "\x02" .. "x <- 'a'\x14y <- \"b\""
+  ch_sendraw(job, '2Stest15' .. code .. "\n")
+  t = reltime()
+  while sourced == [] && reltimefloat(reltime(t)) < 2
+    sleep 1m
+  endwhile
+  g:AssertEqual(sourced, [code], 'code to be sourced forwarded')
+
+  # A big block of code is sourced before the code sent after it
+  sourced = []
+  var fdef = 'vimcom:::VimR.source.exprs()' .. "\x02" .. 'f <- function() {' .. repeat("\x14  x <- 1", 5000) .. "\x14}"
+  var fcall = 'vimcom:::VimR.source.exprs()' .. "\x02" .. 'f()'
+  ch_sendraw(job, '2Stest15' .. fdef .. "\n")
+  ch_sendraw(job, '2Stest15' .. fcall .. "\n")
+  t = reltime()
+  while len(sourced) < 2 && reltimefloat(reltime(t)) < 5
+    sleep 1m
+  endwhile
+  g:Assert(sourced == [fdef, fcall], 'big code sourced before the code sent after it')
+
+  # The same R connects again to the same port and is told what vimrserver
+  # already has, while another R must send everything.
+  g:AssertEqual(Hello(ch, '1234.5'), '0 0', 'new session has nothing')
+  SendToServer(ch, "+D7 0\n")
+  sleep 50m
+  srv_out = ''
+  ch_close(ch)
+  g:Assert(WaitFor('g:OnVimcomDisconnect()', 2000), 'disconnection reported')
+  ch = ch_open('127.0.0.1:' .. port, {mode: 'raw', callback: TcpIn})
+  g:AssertEqual(ch_status(ch), 'open', 'same port after reconnection')
+  g:AssertEqual(Hello(ch, '1234.5'), '0 7', 'resumed session keeps its objects')
+  g:Assert(WaitFor('g:OnVimcomReconnect()', 2000), 'reconnection reported')
+  srv_out = ''
+  ch_close(ch)
+  g:Assert(WaitFor('g:OnVimcomDisconnect()', 2000), 'second disconnection')
+  srv_out = ''
+  ch = ch_open('127.0.0.1:' .. port, {mode: 'raw', callback: TcpIn})
+  g:AssertEqual(Hello(ch, '999.1'), '0 0', 'another session starts anew')
+  g:Assert(srv_out !~ 'OnVimcomReconnect', 'another session is not a reconnection')
+
+  ch_close(ch)
+  ch_sendraw(job, "9\n")
+  job_stop(job)
+  delete(dir, 'rf')
+endif